@@ -0,0 +1,197 @@
+/* anno_idx.c
+ *   interval index over annotated transcripts
+ *   implicit augmented interval tree laid out on a sorted flat array,
+ *   as in cgranges
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "anno_idx.h"
+#include "utils.h"
+#include "ksort.h"
+
+KSORT_INIT_GENERIC(int)
+
+static int anno_itv_comp(const void *_a, const void *_b)
+{
+    anno_itv_t *a = (anno_itv_t*)_a, *b = (anno_itv_t*)_b;
+    if (a->beg != b->beg) return a->beg - b->beg;
+    else return a->i - b->i;
+}
+
+// a[] is sorted by beg, fill a[].max bottom-up
+// @return value
+//    max level of the tree, -1 for an empty array
+int anno_idx_index_core(anno_itv_t *a, int64_t n)
+{
+    int64_t i, last_i = 0; int32_t last = 0; int k;
+    if (n <= 0) return -1;
+    for (i = 0; i < n; i += 2) last_i = i, last = a[i].max = a[i].end;
+    for (k = 1; 1LL<<k <= n; ++k) {
+        int64_t x = 1LL<<(k-1), i0 = (x<<1) - 1, step = x<<2;
+        for (i = i0; i < n; i += step) {
+            int32_t el = a[i-x].max, er = i + x < n ? a[i+x].max : last, e = a[i].end;
+            e = e > el ? e : el;
+            a[i].max = e > er ? e : er;
+        }
+        last_i = (last_i>>k&1) ? last_i : last_i + x;
+        if (last_i < n && a[last_i].max > last) last = a[last_i].max;
+    }
+    return k - 1;
+}
+
+// transcripts with unknown tid (< 0) are not indexed
+anno_idx_t *anno_idx_build(read_trans_t *T)
+{
+    anno_idx_t *idx = (anno_idx_t*)_err_calloc(1, sizeof(anno_idx_t));
+    int i, tid;
+    for (i = 0; i < T->trans_n; ++i)
+        if (T->t[i].tid >= idx->chr_n) idx->chr_n = T->t[i].tid + 1;
+    idx->off = (int64_t*)_err_calloc(idx->chr_n + 1, sizeof(int64_t));
+    idx->n = (int32_t*)_err_calloc(idx->chr_n + 1, sizeof(int32_t));
+    idx->lv = (int32_t*)_err_calloc(idx->chr_n + 1, sizeof(int32_t));
+    for (i = 0; i < T->trans_n; ++i)
+        if (T->t[i].tid >= 0) idx->n[T->t[i].tid]++;
+    for (tid = 1; tid <= idx->chr_n; ++tid) idx->off[tid] = idx->off[tid-1] + idx->n[tid-1];
+    idx->itv_n = idx->off[idx->chr_n];
+    idx->itv = (anno_itv_t*)_err_malloc((idx->itv_n > 0 ? idx->itv_n : 1) * sizeof(anno_itv_t));
+    idx->own_itv = 1;
+
+    // bucket by tid, then sort each bucket by beg
+    memset(idx->n, 0, idx->chr_n * sizeof(int32_t));
+    for (i = 0; i < T->trans_n; ++i) {
+        trans_t *t = T->t + i;
+        if (t->tid < 0) continue;
+        anno_itv_t *a = idx->itv + idx->off[t->tid] + idx->n[t->tid]++;
+        a->beg = t->start - 1, a->end = t->end, a->max = t->end, a->i = i;
+    }
+    for (tid = 0; tid < idx->chr_n; ++tid) {
+        qsort(idx->itv + idx->off[tid], idx->n[tid], sizeof(anno_itv_t), anno_itv_comp);
+        idx->lv[tid] = anno_idx_index_core(idx->itv + idx->off[tid], idx->n[tid]);
+    }
+    return idx;
+}
+
+typedef struct {
+    int64_t x; int k, w;
+} anno_idx_stack_t;
+
+// transcripts of tid overlapping [beg, end), 0-based
+// indices in read_trans_t are written to *b in ascending order
+// @return value
+//    number of overlapping transcripts
+int anno_idx_overlap(const anno_idx_t *idx, int tid, int32_t beg, int32_t end, int **b, int *m)
+{
+    int t = 0, n = 0; anno_idx_stack_t stack[64];
+    if (tid < 0 || tid >= idx->chr_n || idx->n[tid] == 0) return 0;
+    const anno_itv_t *a = idx->itv + idx->off[tid]; int64_t a_n = idx->n[tid];
+
+    stack[t].x = (1LL<<idx->lv[tid]) - 1, stack[t].k = idx->lv[tid], stack[t++].w = 0;
+    while (t) {
+        anno_idx_stack_t z = stack[--t];
+        if (z.k <= 3) { // small subtree: linear scan
+            int64_t i, i0 = z.x >> z.k << z.k, i1 = i0 + (1LL<<(z.k+1)) - 1;
+            if (i1 >= a_n) i1 = a_n;
+            for (i = i0; i < i1 && a[i].beg < end; ++i) {
+                if (beg < a[i].end) {
+                    if (n == *m) { *m = *m ? *m << 1 : 16; *b = (int*)_err_realloc(*b, *m * sizeof(int)); }
+                    (*b)[n++] = a[i].i;
+                }
+            }
+        } else if (z.w == 0) { // left child first
+            int64_t y = z.x - (1LL<<(z.k-1));
+            stack[t].k = z.k, stack[t].x = z.x, stack[t++].w = 1;
+            if (y >= a_n || a[y].max > beg)
+                stack[t].k = z.k - 1, stack[t].x = y, stack[t++].w = 0;
+        } else if (z.x < a_n && a[z.x].beg < end) { // then the node itself and the right child
+            if (beg < a[z.x].end) {
+                if (n == *m) { *m = *m ? *m << 1 : 16; *b = (int*)_err_realloc(*b, *m * sizeof(int)); }
+                (*b)[n++] = a[z.x].i;
+            }
+            stack[t].k = z.k - 1, stack[t].x = z.x + (1LL<<(z.k-1)), stack[t++].w = 0;
+        }
+    }
+    ks_introsort(int, n, *b);
+    return n;
+}
+
+void anno_idx_destroy(anno_idx_t *idx)
+{
+    if (idx == NULL) return;
+    if (idx->own_itv) free(idx->itv);
+    free(idx->off); free(idx->n); free(idx->lv); free(idx);
+}
+
+static int anno_site_comp(const void *_a, const void *_b)
+{
+    anno_site_t *a = (anno_site_t*)_a, *b = (anno_site_t*)_b;
+    if (a->pos != b->pos) return a->pos - b->pos;
+    else if (a->i != b->i) return a->i - b->i;
+    else return a->j - b->j;
+}
+
+// exons of transcripts with unknown tid (< 0) are not indexed
+anno_site_idx_t *anno_site_build(read_trans_t *T)
+{
+    anno_site_idx_t *x = (anno_site_idx_t*)_err_calloc(1, sizeof(anno_site_idx_t));
+    int i, j, tid; int64_t site_n;
+    for (i = 0; i < T->trans_n; ++i)
+        for (j = 0; j < T->t[i].exon_n; ++j)
+            if (T->t[i].exon[j].tid >= x->chr_n) x->chr_n = T->t[i].exon[j].tid + 1;
+    x->off = (int64_t*)_err_calloc(x->chr_n + 1, sizeof(int64_t));
+    x->n = (int32_t*)_err_calloc(x->chr_n + 1, sizeof(int32_t));
+    for (i = 0; i < T->trans_n; ++i)
+        for (j = 0; j < T->t[i].exon_n; ++j)
+            if (T->t[i].exon[j].tid >= 0) x->n[T->t[i].exon[j].tid]++;
+    for (tid = 1; tid <= x->chr_n; ++tid) x->off[tid] = x->off[tid-1] + x->n[tid-1];
+    site_n = x->off[x->chr_n] > 0 ? x->off[x->chr_n] : 1;
+    x->start = (anno_site_t*)_err_malloc(site_n * sizeof(anno_site_t));
+    x->end = (anno_site_t*)_err_malloc(site_n * sizeof(anno_site_t));
+
+    memset(x->n, 0, x->chr_n * sizeof(int32_t));
+    for (i = 0; i < T->trans_n; ++i) {
+        for (j = 0; j < T->t[i].exon_n; ++j) {
+            exon_t *e = T->t[i].exon + j;
+            if (e->tid < 0) continue;
+            int64_t k = x->off[e->tid] + x->n[e->tid]++;
+            x->start[k].pos = e->start, x->start[k].i = i, x->start[k].j = j;
+            x->end[k].pos = e->end, x->end[k].i = i, x->end[k].j = j;
+        }
+    }
+    for (tid = 0; tid < x->chr_n; ++tid) {
+        qsort(x->start + x->off[tid], x->n[tid], sizeof(anno_site_t), anno_site_comp);
+        qsort(x->end + x->off[tid], x->n[tid], sizeof(anno_site_t), anno_site_comp);
+    }
+    return x;
+}
+
+// first site of tid not less than pos
+static int32_t anno_site_lower(const anno_site_t *a, int32_t n, int32_t pos)
+{
+    int32_t lo = 0, hi = n;
+    while (lo < hi) {
+        int32_t mid = lo + ((hi - lo) >> 1);
+        if (a[mid].pos < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// sites of tid within [pos-dis, pos+dis], *n of them from the returned one
+const anno_site_t *anno_site_get(const anno_site_idx_t *x, int tid, int is_end, int32_t pos, int dis, int *n)
+{
+    *n = 0;
+    if (tid < 0 || tid >= x->chr_n || x->n[tid] == 0) return NULL;
+    const anno_site_t *a = (is_end ? x->end : x->start) + x->off[tid];
+    int32_t lo = anno_site_lower(a, x->n[tid], pos - dis);
+    int32_t hi = anno_site_lower(a + lo, x->n[tid] - lo, pos + dis + 1) + lo;
+    *n = hi - lo;
+    return a + lo;
+}
+
+void anno_site_destroy(anno_site_idx_t *x)
+{
+    if (x == NULL) return;
+    free(x->off); free(x->n); free(x->start); free(x->end); free(x);
+}
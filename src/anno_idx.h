@@ -0,0 +1,42 @@
+#ifndef _ANNO_IDX_H
+#define _ANNO_IDX_H
+#include <stdint.h>
+#include "gtf.h"
+
+typedef struct {
+    int32_t beg, end, max; // 0-based, [beg, end), max: largest end in the subtree
+    int32_t i;             // index in read_trans_t
+} anno_itv_t;
+
+// implicit augmented interval tree over annotated transcripts
+// intervals of each tid are sorted by beg and stored in itv[off[tid], off[tid]+n[tid])
+typedef struct {
+    int chr_n;
+    int64_t *off; int32_t *n; int32_t *lv; // lv: max level of the tree of tid
+    anno_itv_t *itv; int64_t itv_n;
+    int own_itv;                           // 0: itv points into a mapped snapshot
+} anno_idx_t;
+
+typedef struct {
+    int32_t pos; // exon start or end, 1-based
+    int32_t i, j; // index in read_trans_t, exon index
+} anno_site_t;
+
+// exon start and end sites of annotated transcripts, sorted by pos
+// both arrays of tid are in [off[tid], off[tid]+n[tid])
+typedef struct {
+    int chr_n;
+    int64_t *off; int32_t *n;
+    anno_site_t *start, *end;
+} anno_site_idx_t;
+
+int anno_idx_index_core(anno_itv_t *a, int64_t n);
+anno_idx_t *anno_idx_build(read_trans_t *T);
+int anno_idx_overlap(const anno_idx_t *idx, int tid, int32_t beg, int32_t end, int **b, int *m);
+void anno_idx_destroy(anno_idx_t *idx);
+
+anno_site_idx_t *anno_site_build(read_trans_t *T);
+const anno_site_t *anno_site_get(const anno_site_idx_t *x, int tid, int is_end, int32_t pos, int dis, int *n);
+void anno_site_destroy(anno_site_idx_t *x);
+
+#endif
@@ -10,8 +10,14 @@
 #include <getopt.h>
 #include "bam2gtf.h"
 #include "htslib/sam.h"
+#include "htslib/thread_pool.h"
 #include "utils.h"
 #include "gtf.h"
+#include "kstring.h"
+#include "bam_pipe.h"
+#include "bam_shard.h"
+#include "cigar_walk.h"
+#include "bam_lite.h"
 
 extern const char PROG[20];
 int bam2gtf_usage(void)
@@ -22,101 +28,137 @@ int bam2gtf_usage(void)
     err_printf("         -e --exon-min    [INT]    minimum length of internal exon. [%d]\n", INTER_EXON_MIN_LEN);
     err_printf("         -i --intron-len  [INT]    minimum length of intron. [%d]\n", INTRON_MIN_LEN);
     err_printf("         -s --source      [STR]    source field in GTF, program, database or project name. [NONE]\n");
+    err_printf("         -t --threads     [INT]    number of threads. [1]\n");
+    err_printf("         -O --sort                 sort output GTF by position, as %s sort-gtf does. [False]\n", PROG);
 	err_printf("\n");
 	return 1;
 }
 
-int gen_exon(trans_t *t, bam1_t *b, uint32_t *c, int n_cigar, int exon_min, int intron_len)
+int gen_exon(trans_t *t, bam1_t *b, const cigar_walk_t *w, int exon_min, int intron_len)
 {
     t->exon_n = 0;
-    int tid = b->core.tid; int start = b->core.pos+1, end = start-1;/*1-base*/ uint8_t is_rev, *p;
+    int tid = w->tid; int start = w->start, end;/*1-base*/ uint8_t is_rev, *p;
     p = bam_aux_get(b, "XS"); // strand orientation for a splice
     if (p == 0) is_rev = bam_is_rev(b);
     else is_rev = ((bam_aux2A(p) == '+' )? 0 : 1);
 
     int i;
-    for (i = 0; i < n_cigar; ++i) {
-        int l = bam_cigar_oplen(c[i]);
-        switch (bam_cigar_op(c[i])) {
-            case BAM_CREF_SKIP:  // N(0 1)
-                if (l >= intron_len) {
-                    if (t->exon_n == 0 || (end-start+1) >= exon_min)
-                        add_exon(t, tid, start, end, is_rev);
-                    start = end + l + 1;
-                }
-                end += l;
-                break;
-            case BAM_CDEL : // D(0 1)
-                end += l;
-                break;
-            case BAM_CMATCH: // 1 1
-            case BAM_CEQUAL:
-            case BAM_CDIFF:
-                end += l;
-                break;
-            case BAM_CINS: // 1 0
-            case BAM_CSOFT_CLIP:
-            case BAM_CHARD_CLIP:
-                break;
-            case BAM_CPAD: // 0 0
-            case BAM_CBACK:
-                break;
-            default:
-                err_printf("Error: unknown cigar type: %d.\n", bam_cigar_op(c[i]));
-                break;
-        }
+    for (i = 0; i < w->intr_n; ++i) {
+        if (cigar_intr_len(w->intr[i]) < intron_len) continue;
+        end = w->intr[i].don - 1;
+        if (t->exon_n == 0 || (end-start+1) >= exon_min)
+            add_exon(t, tid, start, end, is_rev);
+        start = w->intr[i].acc + 1;
     }
-    add_exon(t, tid, start, end, is_rev);
+    add_exon(t, tid, start, w->end, is_rev);
     return 0;
 }
 
+// w: CIGAR of b, walked by the caller
+int gen_trans_walk(bam1_t *b, const cigar_walk_t *w, trans_t *t, int exon_min, int intron_len)
+{
+    if (bam_unmap(b)) return 0;
+    gen_exon(t, b, w, exon_min, intron_len);
+    return 1;
+}
+
 int gen_trans(bam1_t *b, trans_t *t, int exon_min, int intron_len)
 {
     if (bam_unmap(b)) return 0;
 
-    uint32_t *c = bam_get_cigar(b); int n_cigar = b->core.n_cigar;
-    gen_exon(t, b, c, n_cigar, exon_min, intron_len);
+    cigar_walk_t w; cigar_walk_init(&w);
+    cigar_walk_bam(&w, b);
+    gen_exon(t, b, &w, exon_min, intron_len);
+    cigar_walk_free(&w);
     return 1;
 }
 
-int read_bam_trans(samFile *in, bam_hdr_t *h, bam1_t *b, update_gtf_para *ugp, read_trans_t *T)
+int read_bam_trans(samFile *in, bam_hdr_t *h, bam1_t *b, update_gtf_para *ugp, trans_pack_t *P)
 {
-    trans_t *t = trans_init(1);
-    int sam_ret = sam_read1(in, h, b) ;
+    trans_t *t = trans_init(1); bam_lite_t *r = bam_lite_init(in, h, "XS");
+    int sam_ret = bam_lite_read1(r, b) ;
     while (sam_ret >= 0) {
-        gen_trans(b, t, ugp->min_exon, ugp->min_intron); set_trans_name(t, NULL, NULL, NULL, bam_get_qname(b));
-        add_read_trans(T, *t); set_trans_name(T->t+T->trans_n-1, NULL, NULL, NULL, bam_get_qname(b));
-        // for bam_trans
-        T->t[T->trans_n-1].novel_exon_map = (uint8_t*)calloc(t->exon_n, sizeof(uint8_t));
-        T->t[T->trans_n-1].novel_sj_map = (uint8_t*)calloc(t->exon_n-1, sizeof(uint8_t));
-        //strcpy(T->t[T->trans_n-1].gname, "UNCLASSIFIED");
-        T->t[T->trans_n-1].lfull = 0, T->t[T->trans_n-1].lnoth = 1, T->t[T->trans_n-1].rfull = 0, T->t[T->trans_n-1].rnoth = 1;
-        T->t[T->trans_n-1].novel = 0, T->t[T->trans_n-1].all_novel=0, T->t[T->trans_n-1].all_iden=0;
-        sam_ret = sam_read1(in, h, b) ;
+        if (gen_trans(b, t, ugp->min_exon, ugp->min_intron) == 0) { sam_ret = bam_lite_read1(r, b); continue; }
+        set_trans_name(t, NULL, NULL, NULL, bam_get_qname(b));
+        trans_pack_add(P, t, bam_get_qname(b));
+        sam_ret = bam_lite_read1(r, b) ;
     }
-    trans_free(t);
-    return T->trans_n;
+    if (sam_ret < -1) err_fatal_simple("bam file error!\n");
+    trans_free(t); bam_lite_destroy(r);
+    return P->n;
 }
 
 const struct option bam2gtf_long_opt [] = {
     { "exon-min", 1, NULL, 'e' },
     { "intron-len", 1, NULL, 'i' },
     { "source", 1, NULL, 's' },
+    { "threads", 1, NULL, 't' },
+    { "sort", 0, NULL, 'O' },
 
     { 0, 0, 0, 0}
 };
 
+typedef struct {
+    bam_hdr_t *h; char *src;
+    int exon_min, intron_len;
+    gtf_sort_t *sort; // non-NULL: text is sorted before it is written
+} bam2gtf_aux_t;
+
+// batch of records => GTF text
+void *bam2gtf_work(bam_batch_t *bat, void *data)
+{
+    bam2gtf_aux_t *aux = (bam2gtf_aux_t*)data;
+    kstring_t *s = (kstring_t*)_err_calloc(1, sizeof(kstring_t));
+    trans_t *t = trans_init(1);
+    int i;
+    for (i = 0; i < bat->n; ++i) {
+        if (gen_trans(bat->b[i], t, aux->exon_min, aux->intron_len) == 0) continue;
+        set_trans_name(t, NULL, NULL, NULL, bam_get_qname(bat->b[i]));
+        sprint_trans(s, t, aux->h, aux->src);
+    }
+    trans_free(t);
+    return s;
+}
+
+// one shard of an indexed BAM => GTF text
+void *bam2gtf_shard_work(bam_aux_t *a, bam_shard_t *sh, void *data)
+{
+    bam2gtf_aux_t *aux = (bam2gtf_aux_t*)data;
+    kstring_t *s = (kstring_t*)_err_calloc(1, sizeof(kstring_t));
+    trans_t *t = trans_init(1);
+    while (bam_shard_read1(a, sh) >= 0) {
+        if (gen_trans(a->b, t, aux->exon_min, aux->intron_len) == 0) continue;
+        set_trans_name(t, NULL, NULL, NULL, bam_get_qname(a->b));
+        sprint_trans(s, t, aux->h, aux->src);
+    }
+    trans_free(t);
+    return s;
+}
+
+int bam2gtf_write(void *res, void *data)
+{
+    bam2gtf_aux_t *aux = (bam2gtf_aux_t*)data;
+    kstring_t *s = (kstring_t*)res;
+    int ret = 0;
+    if (aux->sort) gtf_sort_push(aux->sort, s->s, s->l);
+    else if (s->l > 0 && fwrite(s->s, 1, s->l, stdout) != s->l) ret = -1;
+    free(s->s); free(s);
+    return ret;
+}
+
 int bam2gtf(int argc, char *argv[])
 {
-    int c, exon_min=INTER_EXON_MIN_LEN, intron_len=INTRON_MIN_LEN;
+    int c, exon_min=INTER_EXON_MIN_LEN, intron_len=INTRON_MIN_LEN, n_threads=1, sort_out=0;
     char src[100]="NONE";
-	while ((c = getopt_long(argc, argv, "s:e:i:", bam2gtf_long_opt, NULL)) >= 0)
+	while ((c = getopt_long(argc, argv, "s:e:i:t:O", bam2gtf_long_opt, NULL)) >= 0)
     {
         switch(c)
         {
             case 'e': exon_min = atoi(optarg); break;
             case 's': strcpy(src, optarg); break;
             case 'i': intron_len = atoi(optarg); break;
+            case 't': n_threads = atoi(optarg); break;
+            case 'O': sort_out = 1; break;
             default: err_printf("Error: unknown option: %s.\n", optarg);
                      return bam2gtf_usage();
         }
@@ -131,14 +173,43 @@ int bam2gtf(int argc, char *argv[])
     if (h == NULL) err_fatal(__func__, "Couldn't read header for \"%s\"\n", argv[optind]);
     b = bam_init1();
 
-    trans_t *t = trans_init(1);
+    chr_name_t *cname = NULL;
+    bam2gtf_aux_t aux = {h, src, exon_min, intron_len, NULL};
+    if (sort_out) { // sequence order of BAM header
+        cname = chr_name_init(); bam_set_cname(h, cname);
+        aux.sort = gtf_sort_init(cname, GTF_SORT_MEM, n_threads, NULL);
+    }
 
-    while (sam_read1(in, h, b) >= 0) {
-        if (gen_trans(b, t, exon_min, intron_len)) set_trans_name(t, NULL, NULL, NULL, bam_get_qname(b));
-        print_trans(*t, h, src, stdout);
+    if (n_threads > 1) {
+        // indexed input: one iterator per reference chunk
+        if (bam_shard_run(argv[optind], h, n_threads, 1, bam2gtf_shard_work, bam2gtf_write, &aux) != 0) {
+            // no index: BGZF decompression and GTF generation share one pool
+            htsThreadPool p = {NULL, 0};
+            if ((p.pool = hts_tpool_init(n_threads)) == NULL) err_fatal_simple("Failed to initialize thread pool\n");
+            hts_set_thread_pool(in, &p);
+            bam_lite_set_cram(in);
+            bam_pipe_run(in, h, &p, BAM_PIPE_BATCH, 0, bam2gtf_work, bam2gtf_write, &aux);
+            sam_close(in); in = NULL;
+            hts_tpool_destroy(p.pool);
+        }
+    } else {
+        trans_t *t = trans_init(1); kstring_t s = {0, 0, NULL};
+        bam_lite_t *r = bam_lite_init(in, h, "XS");
+        while (bam_lite_read1(r, b) >= 0) {
+            if (gen_trans(b, t, exon_min, intron_len) == 0) continue;
+            set_trans_name(t, NULL, NULL, NULL, bam_get_qname(b));
+            if (aux.sort) {
+                s.l = 0; sprint_trans(&s, t, h, src);
+                gtf_sort_push(aux.sort, s.s, s.l);
+            } else print_trans(*t, h, src, stdout);
+        }
+        free(s.s); trans_free(t); bam_lite_destroy(r);
     }
 
-    trans_free(t);
-    bam_destroy1(b); bam_hdr_destroy(h); sam_close(in);
+    if (aux.sort) {
+        gtf_sort_write(aux.sort, stdout);
+        gtf_sort_destroy(aux.sort); chr_name_free(cname);
+    }
+    bam_destroy1(b); bam_hdr_destroy(h); if (in) sam_close(in);
     return 0;
 }
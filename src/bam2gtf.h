@@ -2,19 +2,30 @@
 #define _BAM2GTF_H
 #include "htslib/sam.h"
 #include "gtf.h"
+#include "trans_pack.h"
+#include "gtf_sort.h"
+#include "cigar_walk.h"
 
 #define bam_unmap(b) ((b)->core.flag & BAM_FUNMAP)
 
 typedef struct {
     uint8_t input_mode, uncla, full_len_level, only_bam;
     char in_bam[1024], source[1024];
-    FILE *intron_fp, *out_gtf_fp;
+    FILE *out_gtf_fp;
+    char **intron_fn; int intron_fn_n, intron_fn_m; // STAR SJ.out.tab files, pooled
     int min_exon, min_intron, ss_dis;
+    int n_threads, stream;
+    gtf_sort_t *sort;        // non-NULL: output is sorted before it is written
 } update_gtf_para;
 
-int read_bam_trans(samFile *in, bam_hdr_t *h, bam1_t *b, update_gtf_para *ugp, read_trans_t *T);
-int read_intron_group(intron_group_t *I, FILE *fp);
+int gen_trans(bam1_t *b, trans_t *t, int exon_min, int intron_len);
+int gen_trans_walk(bam1_t *b, const cigar_walk_t *w, trans_t *t, int exon_min, int intron_len);
+int read_bam_trans(samFile *in, bam_hdr_t *h, bam1_t *b, update_gtf_para *ugp, trans_pack_t *P);
+int read_intron_group(intron_group_t *I, FILE *fp, chr_name_t *cname);
 int read_anno_trans1(read_trans_t *T, FILE *fp);
+void add_anno_trans(read_trans_t *T, trans_t *t);
+int read_anno_trans_core(const char *fn, chr_name_t *cname, int add_chr, int n_threads, read_trans_t *T);
+int read_anno_trans(const char *fn, chr_name_t *cname, int n_threads, read_trans_t *T);
 
 int bam2gtf(int argc, char *argv[]);
 
@@ -5,24 +5,35 @@
 #include "utils.h"
 #include "htslib/sam.h"
 #include "gtf.h"
+#include "region_mask.h"
+#include "bam_pipe.h"
+#include "bam_sort.h"
+#include "gtf_sort.h"
+#include "bam_filter.h"
+#include "cigar_walk.h"
 
 #define bam_unmap(b) ((b)->core.flag & BAM_FUNMAP)
-#define COV_RATIO 0.67
-#define MAP_QUAL  0.75
-#define SEC_RATIO 0.98
 
 extern const char PROG[20];
-extern int read_anno_trans(FILE *fp, bam_hdr_t *h, read_trans_t *T);
 int filter_usage(void)
 {
     err_printf("\n");
-    err_printf("Usage:   %s filter [option] <in.bam/sam> <rRNA.gtf> | samtools sort > out.sort.bam\n\n", PROG);
+    err_printf("Usage:   %s filter [option] <in.bam/sam> <rRNA.gtf/rRNA.gtf.gtfidx/rRNA.bed> | samtools sort > out.sort.bam\n", PROG);
+    err_printf("         %s filter -S [option] <in.bam/sam> <rRNA.gtf/rRNA.gtf.gtfidx/rRNA.bed> > out.sort.bam\n\n", PROG);
     err_printf("Options:\n");
     err_printf("         -v --coverage   [FLOAT]    minimum fraction of aligned bases. [%.2f]\n", COV_RATIO);
     err_printf("         -q --map-qual   [FLOAT]    minimum fraction of identically aligned bases. [%.2f]\n", MAP_QUAL);
     err_printf("         -s --sec-rat    [FLOAT]    maximum ratio of second best and best score to retain the best\n");
     err_printf("         -i --intron     [INT]      minimum number of intron indicated by the alignment. [%d]\n", MIN_INTRON_NUM);
     err_printf("                                    alignment, or no alignments will be retained. [%.2f]\n", SEC_RATIO);
+    err_printf("         -t --threads    [INT]      number of threads, for BAM (de)compression, filtering and sorting. [1]\n");
+    err_printf("         -S --sort                  write coordinate-sorted BAM. [False]\n");
+    err_printf("         -m --max-mem    [STR]      memory for sorting, K/M/G suffix accepted. [768M]\n");
+    err_printf("         -T --tmp-prefix [STR]      prefix of temporary files of sorting. [output file or ./gtools_sort]\n");
+    err_printf("         -o --output     [STR]      output BAM file. [stdout]\n");
+    err_printf("         -x --index                 build .bai index of the output, with -S and -o. [False]\n");
+    err_printf("         -c --coord                 input is coordinate-sorted, read it twice to pick the best\n");
+    err_printf("                                    alignment of each read. [from @HD SO of the input]\n");
 
     err_printf("\n");
     return 1;
@@ -45,115 +56,434 @@ void add_pathid(bam1_t *b, int id)
     b->core.l_qname += l;
 }
 
-int rRNA_overlap(bam1_t *b, read_trans_t *r)
+int rRNA_overlap(bam1_t *b, region_mask_t *m)
 {
     int pos = b->core.pos, tid = b->core.tid;
     int rlen = bam_cigar2rlen(b->core.n_cigar, bam_get_cigar(b));
-    int i;
-    for (i = 0; i < r->trans_n; ++i) {
-        if (tid == r->t[i].tid && !(pos > r->t[i].end || r->t[i].start > pos+rlen-1)) return 1;
-        if (tid < r->t[i].tid) return 0;
-    }
-    return 0;
+    return region_mask_overlap(m, tid, pos, pos+rlen);
 }
 
-int gtf_filter(bam1_t *b, int *score, int *intron_n, float cov_rate, float map_qual, read_trans_t *r)
+int gtf_filter(bam1_t *b, int *score, int *intron_n, float cov_rate, float map_qual, region_mask_t *r)
 {
     if (bam_unmap(b)) return 1;
-    uint32_t *c = bam_get_cigar(b); int n_c = b->core.n_cigar;
+    cigar_walk_t w; cigar_walk_init(&w);
+    cigar_walk_bam(&w, b);
+    int del_len = w.del_len, clip_len = w.clip_len, beg = w.start-1, end = w.end;
     // intron number
-    int i, del_len=0;
-    *intron_n=0;
-    for (i = 0; i < n_c; ++i) {
-        if (bam_cigar_op(c[i]) == BAM_CREF_SKIP) (*intron_n)++;
-        else if (bam_cigar_op(c[i]) == BAM_CDEL) del_len+= bam_cigar_oplen(c[i]);
-    }
+    *intron_n = w.intr_n;
+    cigar_walk_free(&w);
     // cover len/rate
-    int cigar_qlen = b->core.l_qseq;
-    int op0 = bam_cigar_op(c[0]), op1 = bam_cigar_op(c[n_c-1]);
-    if (op0 == BAM_CSOFT_CLIP || op0 == BAM_CHARD_CLIP) cigar_qlen -= bam_cigar_oplen(c[0]);
-    if (n_c > 1 && (op1 == BAM_CSOFT_CLIP || op1 == BAM_CHARD_CLIP)) cigar_qlen -= bam_cigar_oplen(c[n_c-1]);
+    int cigar_qlen = b->core.l_qseq - clip_len;
     if ((cigar_qlen+0.0) / b->core.l_qseq < cov_rate) return 1;
     // NM 
     uint8_t *p = bam_aux_get(b, "NM"); // Edit Distance
     int ed; 
     ed = bam_aux2i(p);
     if ((cigar_qlen - ed + del_len) < map_qual * cigar_qlen) return 1;
-    if (rRNA_overlap(b, r)) return 1;
+    // reference span of the walk, as rRNA_overlap() does
+    if (region_mask_overlap(r, b->core.tid, beg, end)) return 1;
     *score = (cigar_qlen - ed + del_len);
     return 0;
 }
 
+// alignments of one read name that pass gtf_filter()
+typedef struct {
+    int i;                           // best alignment, index in the batch
+    int b_score, s_score, b_intron_n; // s_score: best score of the others, 0 if none
+    int best_id, id;                 // best_id: rank of the best one among the id alignments
+} filter_grp_t;
+
+typedef struct {
+    bam_batch_t *bat; filter_grp_t *g; int n;
+} filter_res_t;
+
+typedef struct {
+    float cov_rat, map_qual, sec_rat; int min_intron_n;
+    region_mask_t *r;
+    samFile *out; bam_hdr_t *h; bam_sort_t *sort; // sort: NULL for unsorted output
+    bam1_t *last; filter_grp_t last_g; int has_last; // last name of the previous batch
+    int cnt;
+} filter_aux_t;
+
+// score a batch and group its alignments by read name, as bam_filter() does on one thread
+void *filter_work(bam_batch_t *bat, void *data)
+{
+    filter_aux_t *a = (filter_aux_t*)data;
+    filter_res_t *res = (filter_res_t*)_err_calloc(1, sizeof(filter_res_t));
+    int i, score, intron_n;
+    res->bat = bat;
+    res->g = (filter_grp_t*)_err_malloc((bat->n > 0 ? bat->n : 1) * sizeof(filter_grp_t));
+    for (i = 0; i < bat->n; ++i) {
+        if (gtf_filter(bat->b[i], &score, &intron_n, a->cov_rat, a->map_qual, a->r)) continue;
+        filter_grp_t *g = res->g + res->n - 1;
+        if (res->n > 0 && strcmp(bam_get_qname(bat->b[i]), bam_get_qname(bat->b[g->i])) == 0) {
+            g->id++;
+            if (score > g->b_score) {
+                g->i = i, g->best_id = g->id;
+                g->s_score = g->b_score, g->b_score = score;
+                g->b_intron_n = intron_n;
+            } else if (score > g->s_score)
+                g->s_score = score;
+        } else {
+            g = res->g + res->n++;
+            g->i = i, g->b_score = score, g->s_score = 0, g->b_intron_n = intron_n;
+            g->best_id = g->id = 1;
+        }
+    }
+    return res;
+}
+
+static void filter_out(samFile *out, bam_hdr_t *h, bam_sort_t *s, bam1_t *b)
+{
+    if (s) bam_sort_push(s, b);
+    else if (sam_write1(out, h, b) < 0) err_fatal_simple("Error in writing SAM record\n");
+}
+
+static void filter_write1(filter_aux_t *a, bam1_t *b, filter_grp_t *g)
+{
+    if (g->s_score < a->sec_rat * g->b_score && g->b_intron_n >= a->min_intron_n) {
+        add_pathid(b, g->best_id);
+        filter_out(a->out, a->h, a->sort, b);
+        a->cnt++;
+    }
+}
+
+// the last name of a batch is held back, the next batch may go on with it
+int filter_write(void *_res, void *data)
+{
+    filter_res_t *res = (filter_res_t*)_res; filter_aux_t *a = (filter_aux_t*)data;
+    int k;
+    for (k = 0; k < res->n; ++k) {
+        filter_grp_t *g = res->g + k, *l = &a->last_g; bam1_t *b = res->bat->b[g->i];
+        if (k == 0 && a->has_last && strcmp(bam_get_qname(a->last), bam_get_qname(b)) == 0) {
+            if (g->b_score > l->b_score) {
+                l->s_score = g->s_score > l->b_score ? g->s_score : l->b_score;
+                l->b_score = g->b_score, l->b_intron_n = g->b_intron_n;
+                l->best_id = l->id + g->best_id;
+                bam_copy1(a->last, b);
+            } else if (g->b_score > l->s_score) l->s_score = g->b_score;
+            l->id += g->id;
+            continue;
+        }
+        if (a->has_last) filter_write1(a, a->last, l), a->has_last = 0;
+        if (k == res->n - 1) {
+            bam_copy1(a->last, b);
+            *l = *g, a->has_last = 1;
+        } else filter_write1(a, b, g);
+    }
+    free(res->g); free(res);
+    return 0;
+}
+
 const struct option filter_long_opt [] = {
     { "coverage", 1, NULL, 'v' },
     { "map-quality", 1, NULL, 'q' },
     { "sec-rat", 1, NULL, 's' },
+    { "threads", 1, NULL, 't' },
+    { "sort", 0, NULL, 'S' },
+    { "max-mem", 1, NULL, 'm' },
+    { "tmp-prefix", 1, NULL, 'T' },
+    { "output", 1, NULL, 'o' },
+    { "index", 0, NULL, 'x' },
+    { "coord", 0, NULL, 'c' },
 
     { 0, 0, 0, 0}
 };
 
+filter_t *filter_init(float cov_rat, float map_qual, float sec_rat, int min_intron_n, region_mask_t *r)
+{
+    filter_t *f = (filter_t*)_err_calloc(1, sizeof(filter_t));
+    f->cov_rat = cov_rat, f->map_qual = map_qual, f->sec_rat = sec_rat, f->min_intron_n = min_intron_n, f->r = r;
+    f->best[0] = bam_init1(); f->best[1] = bam_init1();
+    return f;
+}
+
+void filter_destroy(filter_t *f)
+{
+    if (f == NULL) return;
+    bam_destroy1(f->best[0]); bam_destroy1(f->best[1]); free(f);
+}
+
+// best alignment of the current read, with its .pathN, NULL if it is not retained
+static bam1_t *filter_best(filter_t *f)
+{
+    if (f->has_name == 0 || !(f->s_score < f->sec_rat * f->b_score && f->b_intron_n >= f->min_intron_n)) return NULL;
+    add_pathid(f->best[f->cur], f->best_id);
+    f->cnt++;
+    return f->best[f->cur];
+}
+
+// alignments of one read name are adjacent in the input
+// @return value
+//    best alignment of the previous read when b starts a new one and the
+//    previous one is retained, NULL otherwise; valid until the next call
+bam1_t *filter_push(filter_t *f, bam1_t *b)
+{
+    int score, intron_n; bam1_t *ret;
+    if (gtf_filter(b, &score, &intron_n, f->cov_rat, f->map_qual, f->r)) return NULL;
+
+    if (f->has_name && strcmp(bam_get_qname(b), f->lqname) == 0) {
+        f->id++;
+        if (score > f->b_score) {
+            bam_copy1(f->best[f->cur], b);
+            f->best_id = f->id;
+            f->s_score = f->b_score;
+            f->b_score = score;
+            f->b_intron_n = intron_n;
+        } else if (score > f->s_score)
+            f->s_score = score;
+        return NULL;
+    }
+    ret = filter_best(f);
+    f->cur ^= 1;
+    bam_copy1(f->best[f->cur], b);
+    f->b_score = score; f->s_score = 0; f->b_intron_n = intron_n;
+    f->best_id = f->id = 1;
+    strcpy(f->lqname, bam_get_qname(b));
+    f->has_name = 1;
+    return ret;
+}
+
+// end of input: best alignment of the last read, NULL if it is not retained
+bam1_t *filter_flush(filter_t *f)
+{
+    bam1_t *ret = filter_best(f);
+    f->has_name = 0;
+    return ret;
+}
+
+int filter_seq(samFile *in, samFile *out, bam_hdr_t *h, bam_sort_t *sort, region_mask_t *r, float cov_rat, float map_qual, float sec_rat, int min_intron_n)
+{
+    filter_t *f = filter_init(cov_rat, map_qual, sec_rat, min_intron_n, r);
+    bam1_t *b = bam_init1(), *best; int cnt;
+    while (sam_read1(in, h, b) >= 0) {
+        if ((best = filter_push(f, b)) != NULL) filter_out(out, h, sort, best);
+    }
+    if ((best = filter_flush(f)) != NULL) filter_out(out, h, sort, best);
+    cnt = f->cnt;
+    bam_destroy1(b); filter_destroy(f);
+    return cnt;
+}
+
+// coordinate-sorted input: alignments of a read are scattered over the file,
+// so best and second best scores are collected per read name in a first pass
+// and the winners are written in a second one.
+// names are kept as 64-bit fingerprints in a table of max_mem bytes at most;
+// when it is full, names are split into classes by fingerprint and the
+// remaining classes are handled in further rounds of two passes
+typedef struct {
+    uint64_t key;                        // fingerprint of qname, 0 for empty slot
+    int32_t b_score, s_score, b_intron_n;
+    int32_t best_id, id;                 // best_id: 0 if the read is filtered out
+} qname_ent_t;
+
+typedef struct {
+    uint64_t n, m; qname_ent_t *e;
+    uint32_t r, P;                       // names with (key>>40)%P == r, P is a power of 2
+} qname_hash_t;
+
+#define QNAME_MAX_CLASS (1<<24)
+#define qname_class(key, P) ((uint32_t)((key) >> 40) & ((P) - 1))
+
+static inline uint64_t qname_key(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+    for (; *s; ++s) h = (h ^ (uint8_t)*s) * 0x100000001b3ULL;
+    h = hash_64(h);
+    return h ? h : 1;
+}
+
+// rebuild with m slots, entries not in class (r, P) are dropped
+static void qname_hash_resize(qname_hash_t *H, uint64_t m, uint32_t r, uint32_t P)
+{
+    qname_ent_t *old = H->e; uint64_t i, k, old_m = H->m, mask = m - 1;
+    H->e = (qname_ent_t*)_err_calloc(m, sizeof(qname_ent_t));
+    H->m = m, H->n = 0, H->r = r, H->P = P;
+    for (i = 0; i < old_m; ++i) {
+        if (old[i].key == 0 || qname_class(old[i].key, P) != r) continue;
+        k = old[i].key & mask;
+        while (H->e[k].key) k = (k + 1) & mask;
+        H->e[k] = old[i], H->n++;
+    }
+    free(old);
+}
+
+// @return value
+//    entry of key, NULL if key is not in the class of H and add == 0
+static qname_ent_t *qname_hash_get(qname_hash_t *H, uint64_t key, int add)
+{
+    uint64_t k, mask = H->m - 1;
+    k = key & mask;
+    while (H->e[k].key && H->e[k].key != key) k = (k + 1) & mask;
+    if (H->e[k].key || !add) return H->e[k].key ? H->e + k : NULL;
+    H->e[k].key = key, H->n++;
+    return H->e + k;
+}
+
+static samFile *filter_open(const char *fn, htsThreadPool *p)
+{
+    samFile *in; bam_hdr_t *h;
+    if ((in = sam_open(fn, "rb")) == NULL) err_fatal(__func__, "Cannot open \"%s\"\n", fn);
+    if (p->pool) hts_set_thread_pool(in, p);
+    if ((h = sam_hdr_read(in)) == NULL) err_fatal(__func__, "Couldn't read header for \"%s\"\n", fn);
+    bam_hdr_destroy(h);
+    return in;
+}
+
+int filter_coord(const char *fn, htsThreadPool *p, int64_t max_mem, filter_aux_t *a)
+{
+    qname_hash_t H = {0, 0, NULL, 0, 1};
+    uint32_t *todo = (uint32_t*)_err_malloc(2 * sizeof(uint32_t)); int todo_n = 1, todo_m = 1;
+    uint64_t i, key; int score, intron_n, round = 0; samFile *in; bam1_t *b = bam_init1(); qname_ent_t *e;
+    todo[0] = 0, todo[1] = 1; // class r, P
+    while (todo_n > 0) {
+        --todo_n;
+        qname_hash_resize(&H, 1024, todo[todo_n<<1], todo[todo_n<<1|1]);
+        // collect best and second best scores
+        in = filter_open(fn, p);
+        while (sam_read1(in, a->h, b) >= 0) {
+            if (gtf_filter(b, &score, &intron_n, a->cov_rat, a->map_qual, a->r)) continue;
+            key = qname_key(bam_get_qname(b));
+            if (qname_class(key, H.P) != H.r) continue;
+            if ((e = qname_hash_get(&H, key, 0)) != NULL) {
+                e->id++;
+                if (score > e->b_score) {
+                    e->best_id = e->id;
+                    e->s_score = e->b_score, e->b_score = score;
+                    e->b_intron_n = intron_n;
+                } else if (score > e->s_score)
+                    e->s_score = score;
+                continue;
+            }
+            if ((H.n + 1) * 2 > H.m) { // load factor 0.5
+                if (H.m * 2 * sizeof(qname_ent_t) > (uint64_t)max_mem && H.P < QNAME_MAX_CLASS) {
+                    // the other half of the class is left to a later round
+                    if (todo_n == todo_m) {
+                        todo_m <<= 1;
+                        todo = (uint32_t*)_err_realloc(todo, 2 * todo_m * sizeof(uint32_t));
+                    }
+                    todo[todo_n<<1] = H.r + H.P, todo[todo_n<<1|1] = H.P << 1, todo_n++;
+                    qname_hash_resize(&H, H.m, H.r, H.P << 1);
+                    if (qname_class(key, H.P) != H.r) continue;
+                }
+                if ((H.n + 1) * 2 > H.m) qname_hash_resize(&H, H.m << 1, H.r, H.P);
+            }
+            e = qname_hash_get(&H, key, 1);
+            e->b_score = score, e->s_score = 0, e->b_intron_n = intron_n;
+            e->best_id = e->id = 1;
+        }
+        sam_close(in);
+        for (i = 0; i < H.m; ++i) {
+            e = H.e + i;
+            if (e->key == 0) continue;
+            if (!(e->s_score < a->sec_rat * e->b_score && e->b_intron_n >= a->min_intron_n)) e->best_id = 0;
+            e->id = 0;
+        }
+        // write the best alignment of each retained read
+        in = filter_open(fn, p);
+        while (sam_read1(in, a->h, b) >= 0) {
+            if (gtf_filter(b, &score, &intron_n, a->cov_rat, a->map_qual, a->r)) continue;
+            key = qname_key(bam_get_qname(b));
+            if (qname_class(key, H.P) != H.r) continue;
+            e = qname_hash_get(&H, key, 0);
+            if (++e->id == e->best_id) {
+                add_pathid(b, e->best_id);
+                filter_out(a->out, a->h, a->sort, b);
+                a->cnt++;
+            }
+        }
+        sam_close(in);
+        round++;
+    }
+    if (round > 1) err_func_format_printf(__func__, "%d rounds over \"%s\", read names did not fit in %lld bytes\n", round, fn, (long long)max_mem);
+    free(H.e); free(todo); bam_destroy1(b);
+    return a->cnt;
+}
+
+// SO:coordinate in the @HD line
+static int bam_hdr_is_coord(const bam_hdr_t *h)
+{
+    const char *p, *q;
+    if (h->text == NULL || strncmp(h->text, "@HD", 3) != 0) return 0;
+    if ((q = strchr(h->text, '\n')) == NULL) q = h->text + strlen(h->text);
+    p = strstr(h->text, "\tSO:coordinate");
+    return p != NULL && p < q;
+}
+
 int bam_filter(int argc, char *argv[])
 {
     int c; float cov_rat=COV_RATIO, map_qual = MAP_QUAL, sec_rat=SEC_RATIO; int min_intron_n = MIN_INTRON_NUM;
-    int cnt=0;
-    while ((c = getopt_long(argc, argv, "v:q:s:i:", filter_long_opt, NULL)) >= 0) {
+    int cnt=0, n_threads=1, is_sort=0, is_index=0, is_coord=0; int64_t max_mem=BAM_SORT_MEM; char *prefix=NULL, *out_fn=NULL;
+    while ((c = getopt_long(argc, argv, "v:q:s:i:t:Sm:T:o:xc", filter_long_opt, NULL)) >= 0) {
         switch (c) {
             case 'v': cov_rat = atof(optarg); break;
             case 'q': map_qual = atof(optarg); break;
             case 's': sec_rat = atof(optarg); break;
             case 'i': min_intron_n = atoi(optarg); break;
+            case 't': n_threads = atoi(optarg); break;
+            case 'S': is_sort = 1; break;
+            case 'm': max_mem = gtf_sort_parse_mem(optarg); break;
+            case 'T': prefix = optarg; break;
+            case 'o': out_fn = optarg; break;
+            case 'x': is_index = 1; break;
+            case 'c': is_coord = 1; break;
             default : return filter_usage();
         }
     }
 
     if (argc - optind != 2) return filter_usage();
+    if (is_index && (!is_sort || out_fn == NULL)) err_fatal_simple("-x/--index needs -S/--sort and -o/--output.\n");
 
-    samFile *in, *out; bam_hdr_t *h; bam1_t *b;
-    bam1_t *best_b; int b_score=0, s_score=0, score, b_intron_n=0, intron_n;
+    samFile *in, *out; bam_hdr_t *h;
     if ((in = sam_open(argv[optind], "rb")) == NULL) err_fatal(__func__, "Cannot open \"%s\"\n", argv[optind]);
     if ((h = sam_hdr_read(in)) == NULL) err_fatal(__func__, "Couldn't read header for \"%s\"\n", argv[optind]);
-    b = bam_init1();  best_b = bam_init1();
+    if (bam_hdr_is_coord(h)) is_coord = 1;
+    if (is_coord && strcmp(argv[optind], "-") == 0) err_fatal_simple("coordinate-sorted input is read twice, it can not be \"-\".\n");
 
-    // read rRNA gtf
-    FILE *fp = xopen(argv[optind+1], "r"); read_trans_t *r = read_trans_init();
-    read_anno_trans(fp, h, r);
-    err_fclose(fp); 
+    // read rRNA gtf/bed
+    region_mask_t *r = region_mask_init();
+    chr_name_t *cname = chr_name_init(); bam_set_cname(h, cname);
+    region_mask_read(r, argv[optind+1], cname);
+    chr_name_free(cname);
 
-    if ((out = sam_open_format("-", "wb", NULL)) == NULL) err_fatal_simple("Cannot open \"-\"\n");
-    if (sam_hdr_write(out, h) != 0) err_fatal_simple("Error in writing SAM header\n"); //sam header
-    char lqname[100]="\0"; int id=1, best_id=1;
-    while (sam_read1(in, h, b) >= 0) {
-        if (gtf_filter(b, &score, &intron_n, cov_rat, map_qual, r)) continue;
-
-        if (strcmp(bam_get_qname(b), lqname) == 0) {
-            id++;
-            if (score > b_score) {
-                bam_copy1(best_b, b);
-                best_id = id;
-                s_score = b_score;
-                b_score = score;
-                b_intron_n = intron_n;
-            } else if (score > s_score)
-                s_score = score;
-        } else { 
-            if (strcmp(lqname, "\0") != 0 && s_score < sec_rat * b_score && b_intron_n >= min_intron_n) {
-                add_pathid(best_b, best_id);
-                if (sam_write1(out, h, best_b) < 0) err_fatal_simple("Error in writing SAM record\n");
-                cnt++;
-            }
-            bam_copy1(best_b, b);
-            b_score = score; s_score = 0; b_intron_n=intron_n;
-            best_id = id = 1;
-            strcpy(lqname, bam_get_qname(b)); 
-        }
+    if ((out = sam_open_format(out_fn ? out_fn : "-", "wb", NULL)) == NULL) err_fatal(__func__, "Cannot open \"%s\"\n", out_fn ? out_fn : "-");
+    htsThreadPool p = {NULL, 0};
+    if (n_threads > 1) { // BGZF input, output and filtering share one pool
+        if ((p.pool = hts_tpool_init(n_threads)) == NULL) err_fatal_simple("Failed to initialize thread pool\n");
+        hts_set_thread_pool(in, &p); hts_set_thread_pool(out, &p);
     }
-    if (strcmp(lqname, "\0") != 0 && s_score < sec_rat * b_score && b_intron_n >= min_intron_n) {
-        add_pathid(best_b, best_id);
-        if (sam_write1(out, h, best_b) < 0) err_fatal_simple("Error in writing SAM record\n");
-        cnt++;
+    bam_sort_t *sort = NULL; char *idx_fn = NULL;
+    if (is_sort) {
+        sort = bam_sort_init(max_mem, n_threads, prefix ? prefix : out_fn);
+        if (sam_hdr_update_hd(h, "SO", "coordinate") < 0 && sam_hdr_add_line(h, "HD", "VN", "1.6", "SO", "coordinate", NULL) < 0)
+            err_fatal_simple("Error in updating SAM header\n");
     }
+    if (sam_hdr_write(out, h) != 0) err_fatal_simple("Error in writing SAM header\n"); //sam header
+    if (is_index) {
+        idx_fn = (char*)_err_malloc(strlen(out_fn) + 5);
+        sprintf(idx_fn, "%s.bai", out_fn);
+        if (sam_idx_init(out, h, 0, idx_fn) < 0) err_fatal(__func__, "Cannot initialize index \"%s\"\n", idx_fn);
+    }
+    if (is_coord) {
+        filter_aux_t aux = {cov_rat, map_qual, sec_rat, min_intron_n, r, out, h, sort};
+        sam_close(in); in = NULL;
+        cnt = filter_coord(argv[optind], &p, max_mem, &aux);
+    } else if (n_threads > 1) {
+        filter_aux_t aux = {cov_rat, map_qual, sec_rat, min_intron_n, r, out, h, sort, bam_init1()};
+        bam_pipe_run(in, h, &p, BAM_PIPE_BATCH, BAM_PIPE_QNAME, filter_work, filter_write, &aux);
+        if (aux.has_last) filter_write1(&aux, aux.last, &aux.last_g);
+        cnt = aux.cnt;
+        bam_destroy1(aux.last);
+    } else cnt = filter_seq(in, out, h, sort, r, cov_rat, map_qual, sec_rat, min_intron_n);
     err_func_format_printf(__func__, "Filtered alignments: %d\n", cnt);
-    bam_destroy1(b); bam_destroy1(best_b); bam_hdr_destroy(h); sam_close(in); sam_close(out);
-    read_trans_free(r);    
+    if (sort) {
+        if (sort->fd_n > 0) err_func_format_printf(__func__, "merging %d temporary files ...\n", sort->fd_n + (sort->r_n > 0));
+        bam_sort_write(sort, out, h);
+        bam_sort_destroy(sort);
+    }
+    if (is_index && sam_idx_save(out) < 0) err_fatal(__func__, "Error in writing index \"%s\"\n", idx_fn);
+    bam_hdr_destroy(h); if (in) sam_close(in); sam_close(out);
+    if (p.pool) hts_tpool_destroy(p.pool);
+    region_mask_destroy(r); free(idx_fn);
     return 0;
 }
@@ -1,5 +1,26 @@
 #ifndef _BAM_FILTER_H
 #define _BAM_FILTER_H
+#include "htslib/sam.h"
+#include "region_mask.h"
+
+#define COV_RATIO 0.67
+#define MAP_QUAL  0.75
+#define SEC_RATIO 0.98
+
+// best alignment of each read, for input with the alignments of a read adjacent
+typedef struct {
+    float cov_rat, map_qual, sec_rat; int min_intron_n;
+    region_mask_t *r;
+    bam1_t *best[2]; int cur;          // best[cur]: best alignment of the current read
+    char lqname[256]; int has_name;
+    int b_score, s_score, b_intron_n, best_id, id;
+    int cnt;                           // retained reads
+} filter_t;
+
+filter_t *filter_init(float cov_rat, float map_qual, float sec_rat, int min_intron_n, region_mask_t *r);
+bam1_t *filter_push(filter_t *f, bam1_t *b);
+bam1_t *filter_flush(filter_t *f);
+void filter_destroy(filter_t *f);
 
 int bam_filter(int argc, char *argv[]);
 
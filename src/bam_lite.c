@@ -0,0 +1,199 @@
+/* bam_lite.c
+ *   read alignments with only core fields, CIGAR and a few tags decoded
+ *   for bam2gtf, bam2sj and update-gtf, which never look at SEQ/QUAL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "htslib/sam.h"
+#include "htslib/bgzf.h"
+#include "bam_lite.h"
+#include "utils.h"
+
+#ifndef KS_SEP_LINE
+#define KS_SEP_LINE 2 // "\n" or "\r\n"
+#endif
+
+// CRAM skips decoding of the fields that are not required
+// SEQ/QUAL, MD and NM are left out then
+int bam_lite_set_cram(samFile *fp)
+{
+    if (hts_get_format(fp)->format != cram) return 0;
+    if (hts_set_opt(fp, CRAM_OPT_REQUIRED_FIELDS, BAM_LITE_FIELDS) != 0) return -1;
+    return hts_set_opt(fp, CRAM_OPT_DECODE_MD, 0);
+}
+
+// tags: concatenated 2-char tags, e.g. "XSNH", NULL for all tags
+// records of fp are read on the calling thread, a thread pool on BAM is used for BGZF only
+bam_lite_t *bam_lite_init(samFile *fp, bam_hdr_t *h, const char *tags)
+{
+    bam_lite_t *r = (bam_lite_t*)_err_calloc(1, sizeof(bam_lite_t));
+    r->fp = fp, r->h = h;
+    for (; tags && tags[0] && tags[1] && r->tag_n < BAM_LITE_TAG_N; tags += 2)
+        memcpy(r->tag[r->tag_n++], tags, 2);
+    r->fmt = hts_get_format(fp)->format;
+    if (r->fmt == cram && bam_lite_set_cram(fp) != 0) err_fatal(__func__, "failed to set required fields of \"%s\"\n", fp->fn);
+    // other formats and big-endian hosts go through sam_read1()
+    if ((r->fmt == bam && (fp->is_bgzf == 0 || ed_is_big())) || (r->fmt != bam && r->fmt != sam)) r->fmt = unknown_format;
+    return r;
+}
+
+void bam_lite_destroy(bam_lite_t *r)
+{
+    free(r);
+}
+
+static void bam_lite_resize(bam1_t *b, int l)
+{
+    if ((uint32_t)l <= b->m_data) return;
+    b->m_data = l; kroundup32(b->m_data);
+    b->data = (uint8_t*)_err_realloc(b->data, b->m_data * sizeof(uint8_t));
+}
+
+// move the uncompressed offset of fp by n bytes without copying them
+static int bam_lite_skip(BGZF *fp, int64_t n)
+{
+    fp->uncompressed_address += n;
+    while (n > 0) {
+        int l = fp->block_length - fp->block_offset;
+        if (l <= 0) {
+            if (bgzf_read_block(fp) != 0) return -1;
+            if ((l = fp->block_length - fp->block_offset) <= 0) return -1; // EOF
+        }
+        if (l > n) l = n;
+        fp->block_offset += l, n -= l;
+    }
+    return 0;
+}
+
+// a CIGAR of over 65535 ops is kept in the CG tag with kSmN in its place,
+// restore it as bam_read1() does
+static void bam_lite_cg(bam1_t *b, int32_t l_seq)
+{
+    uint32_t *c = bam_get_cigar(b), n; uint8_t *p, *d = b->data;
+    if (b->core.n_cigar != 2 || bam_cigar_op(c[0]) != BAM_CSOFT_CLIP || (int32_t)bam_cigar_oplen(c[0]) != l_seq
+        || bam_cigar_op(c[1]) != BAM_CREF_SKIP) return;
+    if ((p = bam_aux_get(b, "CG")) == NULL || p[0] != 'B' || p[1] != 'I') return;
+    memcpy(&n, p + 2, 4);
+    // qname|kSmN|aux1|CG|aux2 => qname|CG ops|aux1|aux2, no longer than before
+    int l_q = b->core.l_qname, cg = p - 2 - d, cg_end = cg + 8 + n * 4;
+    int aux1 = l_q + 8, l_aux1 = cg - aux1, l_aux2 = b->l_data - cg_end;
+    uint32_t *ops = (uint32_t*)_err_malloc(n * 4);
+    memcpy(ops, p + 6, n * 4);
+    memmove(d + l_q + n * 4, d + aux1, l_aux1);
+    memmove(d + l_q + n * 4 + l_aux1, d + cg_end, l_aux2);
+    memcpy(d + l_q, ops, n * 4);
+    b->core.n_cigar = n, b->l_data = l_q + n * 4 + l_aux1 + l_aux2;
+    free(ops);
+}
+
+// as bam_read1(), SEQ/QUAL are skipped in the BGZF stream
+static int bam_lite_read_bam(bam_lite_t *r, bam1_t *b)
+{
+    BGZF *fp = r->fp->fp.bgzf; bam1_core_t *c = &b->core;
+    int32_t block_len, x[8], l_qname, l_extranul, n_cigar, l_seq, l_aux; int ret;
+    if ((ret = bgzf_read(fp, &block_len, 4)) != 4) return ret == 0 ? -1 : -2;
+    if (block_len < 32 || bgzf_read(fp, x, 32) != 32) return -4;
+    c->tid = x[0], c->pos = x[1];
+    c->bin = (uint32_t)x[2] >> 16, c->qual = x[2] >> 8 & 0xff, l_qname = x[2] & 0xff;
+    c->flag = (uint32_t)x[3] >> 16, n_cigar = x[3] & 0xffff;
+    l_seq = x[4], c->mtid = x[5], c->mpos = x[6], c->isize = x[7];
+    l_aux = block_len - 32 - l_qname - n_cigar * 4 - (l_seq + 1) / 2 - l_seq;
+    if (l_qname == 0 || l_seq < 0 || l_aux < 0) return -4;
+    l_extranul = l_qname % 4 ? 4 - l_qname % 4 : 0; // keep CIGAR 4-byte aligned
+    bam_lite_resize(b, l_qname + l_extranul + n_cigar * 4 + l_aux);
+    if (bgzf_read(fp, b->data, l_qname) != l_qname) return -4;
+    memset(b->data + l_qname, 0, l_extranul);
+    c->l_qname = l_qname + l_extranul, c->l_extranul = l_extranul;
+    c->n_cigar = n_cigar, c->l_qseq = 0;
+    if (bgzf_read(fp, b->data + c->l_qname, n_cigar * 4) != n_cigar * 4) return -4;
+    if (bam_lite_skip(fp, (l_seq + 1) / 2 + l_seq) < 0) return -4;
+    if (bgzf_read(fp, b->data + c->l_qname + n_cigar * 4, l_aux) != l_aux) return -4;
+    b->l_data = c->l_qname + n_cigar * 4 + l_aux;
+    bam_lite_cg(b, l_seq);
+    return 4 + block_len;
+}
+
+// one "TG:T:VALUE" field, B arrays are not needed by any caller and are skipped
+static int bam_lite_sam_aux(bam1_t *b, const char *s)
+{
+    const char *v = s + 5; char *e;
+    switch (s[3]) {
+        case 'A': return bam_aux_append(b, s, 'A', 1, (const uint8_t*)v);
+        case 'i': {
+            int64_t x = strtoll(v, &e, 10);
+            if (e == v || x < INT32_MIN || x > UINT32_MAX) return -1;
+            if (x > INT32_MAX) { uint32_t y = x; return bam_aux_append(b, s, 'I', 4, (uint8_t*)&y); }
+            int32_t y = x; return bam_aux_append(b, s, 'i', 4, (uint8_t*)&y);
+        }
+        case 'f': { float y = strtod(v, &e); return bam_aux_append(b, s, 'f', 4, (uint8_t*)&y); }
+        case 'Z':
+        case 'H': return bam_aux_append(b, s, s[3], strlen(v) + 1, (const uint8_t*)v);
+        default: return 0;
+    }
+}
+
+// as sam_parse1(), SEQ/QUAL are not parsed, optional fields only for r->tag
+static int bam_lite_read_sam(bam_lite_t *r, bam1_t *b)
+{
+    kstring_t *s = &r->fp->line; bam1_core_t *c = &b->core;
+    char *p, *q, *f[11]; int i, ret, n_cigar, l_qname, l_extranul, tag_n;
+    // sam_hdr_read() leaves the first record in fp->line
+    if (s->l == 0 && (ret = hts_getline(r->fp, KS_SEP_LINE, s)) < 0) return ret;
+    s->l = 0;
+    for (i = 0, p = s->s; i < 11; ++i) {
+        if (p == NULL) return -4;
+        f[i] = p;
+        if ((q = strchr(p, '\t')) != NULL) *q = 0, p = q + 1;
+        else p = NULL;
+    }
+    // QNAME and CIGAR
+    if ((l_qname = strlen(f[0]) + 1) > 255) return -4;
+    l_extranul = l_qname % 4 ? 4 - l_qname % 4 : 0;
+    n_cigar = 0;
+    if (strcmp(f[5], "*") != 0)
+        for (q = f[5]; *q; ++q) if (!isdigit(*q)) ++n_cigar;
+    bam_lite_resize(b, l_qname + l_extranul + n_cigar * 4);
+    memcpy(b->data, f[0], l_qname); memset(b->data + l_qname, 0, l_extranul);
+    c->l_qname = l_qname + l_extranul, c->l_extranul = l_extranul;
+    c->n_cigar = n_cigar, c->l_qseq = 0;
+    uint32_t *cigar = bam_get_cigar(b);
+    for (i = 0, q = f[5]; i < n_cigar; ++i) {
+        long l = strtol(q, &q, 10); const char *op;
+        if (*q == 0 || (op = strchr(BAM_CIGAR_STR, *q)) == NULL) return -4;
+        cigar[i] = l << BAM_CIGAR_SHIFT | (op - BAM_CIGAR_STR); ++q;
+    }
+    b->l_data = c->l_qname + n_cigar * 4;
+    // core
+    c->flag = strtol(f[1], NULL, 0);
+    c->tid = strcmp(f[2], "*") ? bam_name2id(r->h, f[2]) : -1;
+    c->pos = strtol(f[3], NULL, 10) - 1, c->qual = atoi(f[4]);
+    c->mtid = strcmp(f[6], "=") == 0 ? c->tid : strcmp(f[6], "*") ? bam_name2id(r->h, f[6]) : -1;
+    c->mpos = strtol(f[7], NULL, 10) - 1, c->isize = strtol(f[8], NULL, 10);
+    int rlen = bam_cigar2rlen(n_cigar, cigar);
+    c->bin = bam_reg2bin(c->pos, c->pos + (rlen > 0 ? rlen : 1));
+    // stop after the wanted tags
+    for (tag_n = 0; p && (r->tag_n == 0 || tag_n < r->tag_n); p = q) {
+        if ((q = strchr(p, '\t')) != NULL) *q++ = 0;
+        if (strlen(p) < 5 || p[2] != ':' || p[4] != ':') return -4;
+        if (r->tag_n > 0) {
+            for (i = 0; i < r->tag_n; ++i)
+                if (r->tag[i][0] == p[0] && r->tag[i][1] == p[1]) break;
+            if (i == r->tag_n) continue;
+            ++tag_n;
+        }
+        if (bam_lite_sam_aux(b, p) < 0) return -4;
+    }
+    return 0;
+}
+
+// @return value
+//    as sam_read1(): >= 0 on success, -1 at the end, < -1 on error
+int bam_lite_read1(bam_lite_t *r, bam1_t *b)
+{
+    if (r->fmt == bam) return bam_lite_read_bam(r, b);
+    if (r->fmt == sam) return bam_lite_read_sam(r, b);
+    return sam_read1(r->fp, r->h, b);
+}
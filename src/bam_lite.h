@@ -0,0 +1,24 @@
+#ifndef _BAM_LITE_H
+#define _BAM_LITE_H
+#include "htslib/sam.h"
+
+// fields decoded by bam_lite_read1(), also the CRAM required fields
+#define BAM_LITE_FIELDS (SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_AUX)
+#define BAM_LITE_TAG_N 8
+
+// reduced decoding for commands that only look at core fields, CIGAR and a few tags
+// SEQ/QUAL are not decoded, b->core.l_qseq is 0
+//    BAM:  SEQ/QUAL are skipped in the BGZF stream, aux is kept
+//    SAM:  only the given tags are parsed
+//    CRAM: sam_read1() with CRAM_OPT_REQUIRED_FIELDS
+typedef struct {
+    samFile *fp; bam_hdr_t *h; int fmt; // sam, bam or cram of htsExactFormat
+    char tag[BAM_LITE_TAG_N][2]; int tag_n; // 0: all tags
+} bam_lite_t;
+
+int bam_lite_set_cram(samFile *fp);
+bam_lite_t *bam_lite_init(samFile *fp, bam_hdr_t *h, const char *tags);
+int bam_lite_read1(bam_lite_t *r, bam1_t *b);
+void bam_lite_destroy(bam_lite_t *r);
+
+#endif
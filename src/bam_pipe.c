@@ -0,0 +1,121 @@
+/* bam_pipe.c
+ *   ordered multi-threaded pipeline over BAM/SAM records
+ *   main thread reads records in batches, pool threads process each batch,
+ *   results are written back on the main thread in input order
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "htslib/sam.h"
+#include "htslib/thread_pool.h"
+#include "bam_pipe.h"
+#include "utils.h"
+
+typedef struct {
+    bam_batch_t *bat;
+    bam_pipe_work_f work; void *data;
+} bam_pipe_job_t;
+
+static bam_batch_t *bam_batch_init(int m)
+{
+    bam_batch_t *bat = (bam_batch_t*)_err_malloc(sizeof(bam_batch_t));
+    bat->b = (bam1_t**)_err_malloc(m * sizeof(bam1_t*));
+    int i; for (i = 0; i < m; ++i) bat->b[i] = bam_init1();
+    bat->n = 0, bat->m = m; bat->res = NULL;
+    return bat;
+}
+
+static void bam_batch_grow(bam_batch_t *bat)
+{
+    int i, m = bat->m << 1;
+    bat->b = (bam1_t**)_err_realloc(bat->b, m * sizeof(bam1_t*));
+    for (i = bat->m; i < m; ++i) bat->b[i] = bam_init1();
+    bat->m = m;
+}
+
+// read up to batch_size records, with BAM_PIPE_QNAME the batch is extended
+// to the end of the current name, the first record of the next name is kept
+// in *carry
+static int bam_batch_read(samFile *in, bam_hdr_t *h, bam_batch_t *bat, int batch_size, int flag, bam1_t **carry, int *has_carry)
+{
+    int ret = 0; bam1_t *tmp;
+    if (*has_carry) {
+        tmp = bat->b[0], bat->b[0] = *carry, *carry = tmp;
+        bat->n = 1, *has_carry = 0;
+    }
+    while ((ret = sam_read1(in, h, bat->b[bat->n])) >= 0) {
+        if ((flag & BAM_PIPE_QNAME) && bat->n >= batch_size && strcmp(bam_get_qname(bat->b[bat->n]), bam_get_qname(bat->b[bat->n-1])) != 0) {
+            tmp = bat->b[bat->n], bat->b[bat->n] = *carry, *carry = tmp;
+            *has_carry = 1;
+            break;
+        }
+        if (++bat->n == batch_size && !(flag & BAM_PIPE_QNAME)) break;
+        if (bat->n == bat->m) bam_batch_grow(bat);
+    }
+    return ret;
+}
+
+static void bam_batch_free(bam_batch_t *bat)
+{
+    int i; for (i = 0; i < bat->m; ++i) bam_destroy1(bat->b[i]);
+    free(bat->b); free(bat);
+}
+
+static void *bam_pipe_worker(void *arg)
+{
+    bam_pipe_job_t *job = (bam_pipe_job_t*)arg;
+    job->bat->res = job->work(job->bat, job->data);
+    return job;
+}
+
+// write one finished batch, then put it back to the free list
+static void bam_pipe_flush1(hts_tpool_result *r, bam_pipe_write_f write, void *data, bam_pipe_job_t **free_job, int *free_n)
+{
+    bam_pipe_job_t *job = (bam_pipe_job_t*)hts_tpool_result_data(r);
+    if (write(job->bat->res, data) < 0) err_fatal_simple("Error in writing pipeline output\n");
+    job->bat->res = NULL; job->bat->n = 0;
+    free_job[(*free_n)++] = job;
+    hts_tpool_delete_result(r, 0);
+}
+
+int bam_pipe_run(samFile *in, bam_hdr_t *h, htsThreadPool *p, int batch_size, int flag, bam_pipe_work_f work, bam_pipe_write_f write, void *data)
+{
+    int qsize = hts_tpool_size(p->pool) * 2, job_n = qsize + 1, free_n = 0, i, ret = 0, has_carry = 0;
+    bam1_t *carry = bam_init1();
+    hts_tpool_process *q = hts_tpool_process_init(p->pool, qsize, 0);
+    if (q == NULL) err_fatal_simple("Failed to initialize thread pool queue\n");
+    bam_pipe_job_t **free_job = (bam_pipe_job_t**)_err_malloc(job_n * sizeof(bam_pipe_job_t*));
+    for (i = 0; i < job_n; ++i) {
+        free_job[i] = (bam_pipe_job_t*)_err_malloc(sizeof(bam_pipe_job_t));
+        free_job[i]->bat = bam_batch_init(batch_size);
+        free_job[i]->work = work, free_job[i]->data = data;
+    }
+    free_n = job_n;
+
+    hts_tpool_result *r;
+    while (ret >= 0) {
+        // every job is queued or waiting to be written
+        if (free_n == 0) bam_pipe_flush1(hts_tpool_next_result_wait(q), write, data, free_job, &free_n);
+        bam_pipe_job_t *job = free_job[--free_n];
+        bam_batch_t *bat = job->bat;
+        ret = bam_batch_read(in, h, bat, batch_size, flag, &carry, &has_carry);
+        if (ret < -1) err_fatal_simple("bam file error!\n");
+        if (bat->n == 0) { free_job[free_n++] = job; break; }
+
+        while (hts_tpool_dispatch2(p->pool, q, bam_pipe_worker, job, 1) < 0) {
+            if (errno != EAGAIN) err_fatal_simple("Failed to dispatch pipeline job\n");
+            bam_pipe_flush1(hts_tpool_next_result_wait(q), write, data, free_job, &free_n);
+        }
+        while ((r = hts_tpool_next_result(q)) != NULL)
+            bam_pipe_flush1(r, write, data, free_job, &free_n);
+    }
+    hts_tpool_process_flush(q);
+    while (free_n < job_n) bam_pipe_flush1(hts_tpool_next_result_wait(q), write, data, free_job, &free_n);
+
+    hts_tpool_process_destroy(q); bam_destroy1(carry);
+    for (i = 0; i < job_n; ++i) { bam_batch_free(free_job[i]->bat); free(free_job[i]); }
+    free(free_job);
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef _BAM_PIPE_H
+#define _BAM_PIPE_H
+#include "htslib/sam.h"
+#include "htslib/thread_pool.h"
+
+#define BAM_PIPE_BATCH 4096 // records per batch
+#define BAM_PIPE_QNAME 0x1  // a batch does not end inside a run of records with the same name
+
+typedef struct {
+    bam1_t **b; int n, m;
+    void *res;  // result of work(), handed to write() in input order
+} bam_batch_t;
+
+// work() runs on a pool thread, write() on the calling thread
+typedef void *(*bam_pipe_work_f)(bam_batch_t *bat, void *data);
+typedef int (*bam_pipe_write_f)(void *res, void *data);
+
+int bam_pipe_run(samFile *in, bam_hdr_t *h, htsThreadPool *p, int batch_size, int flag, bam_pipe_work_f work, bam_pipe_write_f write, void *data);
+
+#endif
@@ -0,0 +1,124 @@
+/* bam_shard.c
+ *   index-driven parallel processing of coordinate-sorted BAM/CRAM
+ *   each reference (or chunk of a long reference) is read by its own
+ *   iterator on its own thread, results are merged back in header order
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "htslib/sam.h"
+#include "htslib/hts.h"
+#include "bam_shard.h"
+#include "parse_bam.h"
+#include "bam_lite.h"
+#include "utils.h"
+
+typedef struct {
+    const char *fn; int lite; // lite: CRAM decodes BAM_LITE_FIELDS only
+    bam_shard_t *s; int shard_n, shard_i, write_i;
+    void **res; uint8_t *done;
+    bam_shard_work_f work; void *data;
+    pthread_mutex_t lock; pthread_cond_t cond;
+} bam_shard_aux_t;
+
+static int bam_shard_init(bam_hdr_t *h, bam_shard_t **_s)
+{
+    int i, beg, shard_n = 0, shard_m = h->n_targets > 0 ? h->n_targets : 1;
+    bam_shard_t *s = (bam_shard_t*)_err_malloc(shard_m * sizeof(bam_shard_t));
+    for (i = 0; i < h->n_targets; ++i) {
+        for (beg = 0; beg == 0 || beg < (int)h->target_len[i]; beg += BAM_SHARD_LEN) {
+            if (shard_n == shard_m) _realloc(s, shard_m, bam_shard_t)
+            s[shard_n].tid = i, s[shard_n].beg = beg;
+            s[shard_n].end = (h->target_len[i] - beg > BAM_SHARD_LEN) ? beg + BAM_SHARD_LEN : (int)h->target_len[i];
+            shard_n++;
+        }
+    }
+    *_s = s;
+    return shard_n;
+}
+
+// read next record that starts inside shard s
+// records starting in an earlier chunk of the same reference are skipped,
+// so every record is seen by exactly one shard
+int bam_shard_read1(bam_aux_t *aux, bam_shard_t *s)
+{
+    int ret;
+    while ((ret = sam_itr_next(aux->in, aux->itr, aux->b)) >= 0) {
+        if (aux->b->core.pos >= s->beg) return ret;
+    }
+    if (ret < -1) err_fatal(__func__, "fail to read \"%s\"\n", aux->fn);
+    return ret;
+}
+
+static void *bam_shard_thread(void *arg)
+{
+    bam_shard_aux_t *a = (bam_shard_aux_t*)arg;
+    bam_aux_t *aux = bam_aux_init();
+    strcpy(aux->fn, a->fn);
+    err_sam_open(aux->in, a->fn);
+    err_sam_hdr_read(aux->h, aux->in, a->fn);
+    if (a->lite && bam_lite_set_cram(aux->in) != 0) err_fatal(__func__, "failed to set required fields of \"%s\"\n", a->fn);
+    err_sam_idx_load(aux->idx, aux->in, a->fn);
+    aux->b = bam_init1();
+
+    while (1) {
+        pthread_mutex_lock(&a->lock);
+        int i = a->shard_i++;
+        pthread_mutex_unlock(&a->lock);
+        if (i >= a->shard_n) break;
+
+        bam_shard_t *s = a->s + i;
+        if ((aux->itr = sam_itr_queryi(aux->idx, s->tid, s->beg, s->end)) == NULL)
+            err_fatal(__func__, "fail to query \"%s\" for tid %d\n", a->fn, s->tid);
+        void *res = a->work(aux, s, a->data);
+        hts_itr_destroy(aux->itr); aux->itr = NULL;
+
+        pthread_mutex_lock(&a->lock);
+        a->res[i] = res; a->done[i] = 1;
+        pthread_cond_signal(&a->cond);
+        pthread_mutex_unlock(&a->lock);
+    }
+    bam_aux_destroy(aux);
+    return NULL;
+}
+
+// lite: work() only needs the fields of bam_lite_read1()
+// @return value
+//    -1: no index found for fn, nothing is processed
+//     0: done
+int bam_shard_run(const char *fn, bam_hdr_t *h, int n_threads, int lite, bam_shard_work_f work, bam_shard_write_f write, void *data)
+{
+    samFile *in; hts_idx_t *idx;
+    err_sam_open(in, fn);
+    idx = sam_index_load(in, fn);
+    sam_close(in);
+    if (idx == NULL) return -1;
+    hts_idx_destroy(idx);
+
+    bam_shard_aux_t a;
+    a.fn = fn; a.lite = lite; a.work = work; a.data = data;
+    a.shard_n = bam_shard_init(h, &a.s); a.shard_i = a.write_i = 0;
+    a.res = (void**)_err_calloc(a.shard_n, sizeof(void*));
+    a.done = (uint8_t*)_err_calloc(a.shard_n, sizeof(uint8_t));
+    pthread_mutex_init(&a.lock, NULL); pthread_cond_init(&a.cond, NULL);
+
+    int i; pthread_t *tid = (pthread_t*)_err_malloc(n_threads * sizeof(pthread_t));
+    for (i = 0; i < n_threads; ++i) pthread_create(tid+i, NULL, bam_shard_thread, &a);
+
+    // emit in header order as soon as the next shard is finished
+    while (a.write_i < a.shard_n) {
+        pthread_mutex_lock(&a.lock);
+        while (a.done[a.write_i] == 0) pthread_cond_wait(&a.cond, &a.lock);
+        void *res = a.res[a.write_i]; a.res[a.write_i] = NULL;
+        pthread_mutex_unlock(&a.lock);
+        if (write(res, data) < 0) err_fatal_simple("Error in writing shard output\n");
+        a.write_i++;
+    }
+    for (i = 0; i < n_threads; ++i) pthread_join(tid[i], NULL);
+
+    pthread_mutex_destroy(&a.lock); pthread_cond_destroy(&a.cond);
+    free(tid); free(a.s); free(a.res); free(a.done);
+    return 0;
+}
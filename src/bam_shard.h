@@ -0,0 +1,20 @@
+#ifndef _BAM_SHARD_H
+#define _BAM_SHARD_H
+#include "htslib/sam.h"
+#include "parse_bam.h"
+
+#define BAM_SHARD_LEN 0x2000000 // split references longer than 32M
+
+typedef struct {
+    int tid, beg, end; // 0-based, [beg, end)
+} bam_shard_t;
+
+// work() runs on a shard thread with its own file handle,
+// write() runs on the calling thread in header order
+typedef void *(*bam_shard_work_f)(bam_aux_t *aux, bam_shard_t *s, void *data);
+typedef int (*bam_shard_write_f)(void *res, void *data);
+
+int bam_shard_read1(bam_aux_t *aux, bam_shard_t *s);
+int bam_shard_run(const char *fn, bam_hdr_t *h, int n_threads, int lite, bam_shard_work_f work, bam_shard_write_f write, void *data);
+
+#endif
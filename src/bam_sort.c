@@ -0,0 +1,224 @@
+/* bam_sort.c
+ *   external-memory coordinate sorting of BAM records
+ *   records are buffered up to a memory budget, sorted by several threads,
+ *   spilled as fast-compressed runs to temporary files and k-way merged
+ *   into the output, so no separate samtools sort is needed
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "bam_sort.h"
+#include "utils.h"
+
+bam_sort_t *bam_sort_init(int64_t max_mem, int n_threads, const char *prefix)
+{
+    bam_sort_t *s = (bam_sort_t*)_err_calloc(1, sizeof(bam_sort_t));
+    s->max_mem = max_mem > 0 ? max_mem : BAM_SORT_MEM;
+    s->n_threads = n_threads > 0 ? n_threads : 1;
+    s->prefix = strdup(prefix ? prefix : "gtools_sort");
+    return s;
+}
+
+void bam_sort_destroy(bam_sort_t *s)
+{
+    int i;
+    if (s == NULL) return;
+    for (i = 0; i < s->fd_n; ++i) close(s->fd[i]);
+    free(s->fd); free(s->data.s); free(s->r); free(s->prefix);
+    free(s);
+}
+
+static inline int bam_sort_comp(const bam_sort_rec_t *a, const bam_sort_rec_t *b)
+{
+    if (a->key != b->key) return a->key < b->key ? -1 : 1;
+    return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static int bam_sort_qcomp(const void *a, const void *b)
+{
+    return bam_sort_comp((const bam_sort_rec_t*)a, (const bam_sort_rec_t*)b);
+}
+
+// head of an in-memory sorted part or of a spilled run
+typedef struct {
+    bam_sort_rec_t *r, *end; const char *data; // in-memory part
+    gzFile fp; kstring_t str;                  // run
+    bam_sort_rec_t cur; const char *s;         // current record and its core/data
+} bam_src_t;
+
+// @return value
+//    1: next record is in src->cur, 0: src is exhausted
+static int bam_src_next(bam_src_t *src)
+{
+    if (src->fp == NULL) {
+        if (src->r == src->end) return 0;
+        src->cur = *src->r, src->s = src->data + src->r->off;
+        src->r++;
+        return 1;
+    }
+    int ret = gzread(src->fp, &src->cur, sizeof(bam_sort_rec_t));
+    if (ret == 0) return 0;
+    if (ret != sizeof(bam_sort_rec_t)) err_fatal_simple("failed to read temporary file.\n");
+    ks_resize(&src->str, src->cur.len);
+    if (gzread(src->fp, src->str.s, src->cur.len) != src->cur.len) err_fatal_simple("failed to read temporary file.\n");
+    src->s = src->str.s;
+    return 1;
+}
+
+static void bam_heap_down(int *h, int n, int i, bam_src_t *src)
+{
+    int tmp = h[i], k;
+    while ((k = (i << 1) + 1) < n) {
+        if (k + 1 < n && bam_sort_comp(&src[h[k+1]].cur, &src[h[k]].cur) < 0) ++k;
+        if (bam_sort_comp(&src[h[k]].cur, &src[tmp].cur) >= 0) break;
+        h[i] = h[k], i = k;
+    }
+    h[i] = tmp;
+}
+
+typedef void (*bam_sort_out_f)(const bam_sort_rec_t *r, const char *s, void *data);
+
+static void bam_sort_out_run(const bam_sort_rec_t *r, const char *s, void *data)
+{
+    gzFile fp = (gzFile)data;
+    if (gzwrite(fp, r, sizeof(bam_sort_rec_t)) != sizeof(bam_sort_rec_t) || gzwrite(fp, s, r->len) != r->len)
+        err_fatal_simple("failed to write temporary file.\n");
+}
+
+typedef struct {
+    samFile *out; bam_hdr_t *h;
+} bam_sort_out_t;
+
+static void bam_sort_out_bam(const bam_sort_rec_t *r, const char *s, void *data)
+{
+    bam_sort_out_t *o = (bam_sort_out_t*)data; bam1_t b;
+    memset(&b, 0, sizeof(bam1_t));
+    memcpy(&b.core, s, sizeof(bam1_core_t));
+    b.data = (uint8_t*)s + sizeof(bam1_core_t); // read only, not owned
+    b.l_data = b.m_data = r->len - sizeof(bam1_core_t);
+    if (sam_write1(o->out, o->h, &b) < 0) err_fatal_simple("Error in writing SAM record\n");
+}
+
+// k-way merge of sorted sources
+static void bam_sort_merge(bam_src_t *src, int n, bam_sort_out_f out, void *data)
+{
+    int *h = (int*)_err_malloc((n > 0 ? n : 1) * sizeof(int)), h_n = 0, i;
+    for (i = 0; i < n; ++i)
+        if (bam_src_next(src+i)) h[h_n++] = i;
+    for (i = h_n/2 - 1; i >= 0; --i) bam_heap_down(h, h_n, i, src);
+    while (h_n > 0) {
+        bam_src_t *x = src + h[0];
+        out(&x->cur, x->s, data);
+        if (bam_src_next(x) == 0) h[0] = h[--h_n];
+        bam_heap_down(h, h_n, 0, src);
+    }
+    free(h);
+}
+
+typedef struct {
+    bam_sort_rec_t *r; int64_t n;
+} bam_sort_job_t;
+
+static void *bam_sort_job(void *data)
+{
+    bam_sort_job_t *j = (bam_sort_job_t*)data;
+    if (j->n > 1) qsort(j->r, j->n, sizeof(bam_sort_rec_t), bam_sort_qcomp);
+    return NULL;
+}
+
+// sort buffered records as up to n_threads parts in parallel, one source per part
+static int bam_sort_parts(bam_sort_t *s, bam_src_t *src)
+{
+    int i, n = s->n_threads;
+    if (n > s->r_n / 1024 + 1) n = s->r_n / 1024 + 1;
+    bam_sort_job_t *j = (bam_sort_job_t*)_err_malloc(n * sizeof(bam_sort_job_t));
+    pthread_t *tid = (pthread_t*)_err_malloc(n * sizeof(pthread_t));
+    for (i = 0; i < n; ++i) {
+        j[i].r = s->r + s->r_n * i / n;
+        j[i].n = s->r_n * (i+1) / n - s->r_n * i / n;
+    }
+    for (i = 1; i < n; ++i) pthread_create(tid+i, NULL, bam_sort_job, j+i);
+    bam_sort_job(j);
+    for (i = 1; i < n; ++i) pthread_join(tid[i], NULL);
+    memset(src, 0, n * sizeof(bam_src_t));
+    for (i = 0; i < n; ++i)
+        src[i].r = j[i].r, src[i].end = j[i].r + j[i].n, src[i].data = s->data.s;
+    free(j); free(tid);
+    return n;
+}
+
+// sort buffered records and write them as one run, compressed at level 1
+static void bam_sort_spill(bam_sort_t *s)
+{
+    bam_src_t *src = (bam_src_t*)_err_malloc(s->n_threads * sizeof(bam_src_t));
+    char *fn = (char*)_err_malloc(strlen(s->prefix) + 16);
+    int n, fd;
+    sprintf(fn, "%s.%04d.XXXXXX", s->prefix, s->fd_n % 10000);
+    if ((fd = mkstemp(fn)) < 0) err_fatal(__func__, "failed to create temporary file \"%s\".\n", fn);
+    unlink(fn);
+    gzFile fp = gzdopen(dup(fd), "wb1");
+    if (fp == NULL) err_fatal(__func__, "failed to open temporary file \"%s\".\n", fn);
+
+    n = bam_sort_parts(s, src);
+    bam_sort_merge(src, n, bam_sort_out_run, fp);
+    if (gzclose(fp) != Z_OK) err_fatal(__func__, "failed to write temporary file \"%s\".\n", fn);
+    if (s->fd_n == s->fd_m) {
+        s->fd_m = s->fd_m ? s->fd_m << 1 : 16;
+        s->fd = (int*)_err_realloc(s->fd, s->fd_m * sizeof(int));
+    }
+    s->fd[s->fd_n++] = fd;
+    s->r_n = 0, s->data.l = 0;
+    free(src); free(fn);
+}
+
+// a copy of b is buffered
+int bam_sort_push(bam_sort_t *s, const bam1_t *b)
+{
+    int32_t len = sizeof(bam1_core_t) + b->l_data;
+    if (s->r_n > 0 && s->data.l + len + (s->r_n + 1) * sizeof(bam_sort_rec_t) > (size_t)s->max_mem)
+        bam_sort_spill(s);
+    if (s->r_n == s->r_m) {
+        s->r_m = s->r_m ? s->r_m << 1 : 1024;
+        s->r = (bam_sort_rec_t*)_err_realloc(s->r, s->r_m * sizeof(bam_sort_rec_t));
+    }
+    bam_sort_rec_t *r = s->r + s->r_n++;
+    r->key = (uint64_t)(uint32_t)b->core.tid << 32 | (uint64_t)(uint32_t)(b->core.pos + 1) << 1 | bam_is_rev(b);
+    r->seq = s->seq++, r->off = s->data.l, r->len = len;
+    // records start 8-byte aligned, as cigar is read in place
+    ks_resize(&s->data, s->data.l + ((len + 7) & ~7));
+    memcpy(s->data.s + s->data.l, &b->core, sizeof(bam1_core_t));
+    memcpy(s->data.s + s->data.l + sizeof(bam1_core_t), b->data, b->l_data);
+    s->data.l += (len + 7) & ~7;
+    return 0;
+}
+
+// write all records in order, s is empty afterwards
+int bam_sort_write(bam_sort_t *s, samFile *out, bam_hdr_t *h)
+{
+    int i, n; bam_sort_out_t o = {out, h};
+    if (s->fd_n == 0) { // everything fits in memory
+        bam_src_t *src = (bam_src_t*)_err_malloc(s->n_threads * sizeof(bam_src_t));
+        n = bam_sort_parts(s, src);
+        bam_sort_merge(src, n, bam_sort_out_bam, &o);
+        free(src);
+    } else {
+        if (s->r_n > 0) bam_sort_spill(s);
+        bam_src_t *src = (bam_src_t*)_err_calloc(s->fd_n, sizeof(bam_src_t));
+        for (i = 0; i < s->fd_n; ++i) {
+            lseek(s->fd[i], 0, SEEK_SET);
+            if ((src[i].fp = gzdopen(dup(s->fd[i]), "rb")) == NULL) err_fatal_simple("failed to open temporary file.\n");
+        }
+        bam_sort_merge(src, s->fd_n, bam_sort_out_bam, &o);
+        for (i = 0; i < s->fd_n; ++i) {
+            gzclose(src[i].fp); free(src[i].str.s);
+            close(s->fd[i]);
+        }
+        free(src);
+    }
+    s->data.l = 0, s->r_n = 0, s->fd_n = 0;
+    return 0;
+}
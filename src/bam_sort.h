@@ -0,0 +1,28 @@
+#ifndef _BAM_SORT_H
+#define _BAM_SORT_H
+#include <stdint.h>
+#include "htslib/sam.h"
+#include "kstring.h"
+
+#define BAM_SORT_MEM 768000000 // default memory budget of buffered records
+
+// records are ordered by tid, pos, strand and input order, as samtools sort does
+// unmapped records (tid < 0) go last
+typedef struct {
+    uint64_t key;              // tid<<32 | (pos+1)<<1 | is_rev
+    int64_t seq;
+    int64_t off; int32_t len;  // bam1_core_t and data in bam_sort_t.data, or length in a run
+} bam_sort_rec_t;
+
+typedef struct {
+    int64_t max_mem; int n_threads; char *prefix;
+    kstring_t data; bam_sort_rec_t *r; int64_t r_n, r_m, seq;
+    int fd_n, fd_m, *fd;       // sorted runs spilled to unlinked temp files
+} bam_sort_t;
+
+bam_sort_t *bam_sort_init(int64_t max_mem, int n_threads, const char *prefix);
+int bam_sort_push(bam_sort_t *s, const bam1_t *b);
+int bam_sort_write(bam_sort_t *s, samFile *out, bam_hdr_t *h);
+void bam_sort_destroy(bam_sort_t *s);
+
+#endif
@@ -0,0 +1,289 @@
+/* cigar_walk.c
+ *   decode the CIGAR of one alignment into reference blocks and introns,
+ *   plus the counts the filters need, in one pass
+ *   gen_exon, gen_sj, bam2ad and gtf_filter all work on its output
+ *
+ *   long CIGARs are scanned with SSE4.2/AVX2, picked at run time:
+ *   blocks without N are summed in vector registers, a block with N is
+ *   walked op by op to get the exact position of each intron
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cigar_walk.h"
+#include "utils.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CIGAR_SIMD
+#include <immintrin.h>
+#endif
+
+#define CIGAR_SIMD_MIN 16  // shorter CIGARs are walked op by op
+#define CIGAR_REF_OPS 0x18D // 1<<op of M, D, N, =, X
+
+void cigar_walk_init(cigar_walk_t *w)
+{
+    memset(w, 0, sizeof(cigar_walk_t));
+    w->intr = w->intr0, w->intr_m = CIGAR_INTR_N;
+}
+
+void cigar_walk_free(cigar_walk_t *w)
+{
+    if (w->intr != w->intr0) free(w->intr);
+    w->intr = w->intr0, w->intr_m = CIGAR_INTR_N, w->intr_n = 0;
+}
+
+static void cigar_walk_grow(cigar_walk_t *w)
+{
+    cigar_intr_t *p = (cigar_intr_t*)_err_malloc((w->intr_m << 1) * sizeof(cigar_intr_t));
+    memcpy(p, w->intr, w->intr_n * sizeof(cigar_intr_t));
+    if (w->intr != w->intr0) free(w->intr);
+    w->intr = p, w->intr_m <<= 1;
+}
+
+// walk c[0..n) from reference position end (1-based, last base so far)
+// @return value
+//    end after c[n-1]
+typedef int32_t (*cigar_scan_f)(cigar_walk_t *w, int32_t end, const uint32_t *c, int n);
+
+static int32_t cigar_scan_scalar(cigar_walk_t *w, int32_t end, const uint32_t *c, int n)
+{
+    int i;
+    for (i = 0; i < n; ++i) {
+        int l = bam_cigar_oplen(c[i]), op = bam_cigar_op(c[i]);
+        w->op_mask |= 1U << op;
+        switch (op) {
+            case BAM_CREF_SKIP: // N(0 1)
+                if (w->intr_n == w->intr_m) cigar_walk_grow(w);
+                w->intr[w->intr_n].don = end+1, w->intr[w->intr_n].acc = end+l;
+                w->intr_n++;
+                end += l;
+                break;
+            case BAM_CDEL : // D(0 1)
+                w->del_len += l;
+                end += l;
+                break;
+            case BAM_CMATCH: // 1 1
+            case BAM_CEQUAL:
+            case BAM_CDIFF:
+                end += l;
+                break;
+            case BAM_CINS: // 1 0
+            case BAM_CSOFT_CLIP:
+            case BAM_CHARD_CLIP:
+            case BAM_CPAD: // 0 0
+            case BAM_CBACK:
+                break;
+            default:
+                err_printf("Error: unknown cigar type: %d.\n", op);
+                break;
+        }
+    }
+    return end;
+}
+
+#ifdef CIGAR_SIMD
+__attribute__((target("sse4.2")))
+static inline int32_t cigar_hsum_sse(__m128i x)
+{
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(x);
+}
+
+__attribute__((target("sse4.2")))
+static inline uint32_t cigar_hor_sse(__m128i x)
+{
+    x = _mm_or_si128(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm_or_si128(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(x);
+}
+
+// 4 ops per step, ops are looked up with pshufb
+__attribute__((target("sse4.2")))
+static int32_t cigar_scan_sse42(cigar_walk_t *w, int32_t end, const uint32_t *c, int n)
+{
+    const __m128i lo4 = _mm_set1_epi32(0xf), b0 = _mm_set1_epi32(0xff), zero = _mm_setzero_si128();
+    const __m128i op_N = _mm_set1_epi32(BAM_CREF_SKIP), op_D = _mm_set1_epi32(BAM_CDEL), op_X = _mm_set1_epi32(BAM_CDIFF);
+    const __m128i rep = _mm_setr_epi8(0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12);
+    //                                 M   I   D   N  S  H  P   =   X
+    const __m128i t_ref = _mm_setr_epi8(-1, 0, -1, -1, 0, 0, 0, -1, -1, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i t_lo = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i t_hi = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0);
+    __m128i ref = zero, del = zero, bit = zero;
+    int i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(c + i)), op = _mm_and_si128(x, lo4);
+        __m128i sp = _mm_or_si128(_mm_cmpeq_epi32(op, op_N), _mm_cmpgt_epi32(op, op_X));
+        if (!_mm_testz_si128(sp, sp)) { // N, B or unknown op
+            end += cigar_hsum_sse(ref), w->del_len += cigar_hsum_sse(del);
+            ref = del = zero;
+            end = cigar_scan_scalar(w, end, c + i, 4);
+            continue;
+        }
+        __m128i l = _mm_srli_epi32(x, 4);
+        ref = _mm_add_epi32(ref, _mm_and_si128(l, _mm_shuffle_epi8(t_ref, _mm_shuffle_epi8(op, rep))));
+        del = _mm_add_epi32(del, _mm_and_si128(l, _mm_cmpeq_epi32(op, op_D)));
+        bit = _mm_or_si128(bit, _mm_and_si128(_mm_shuffle_epi8(t_lo, op), b0));
+        bit = _mm_or_si128(bit, _mm_slli_epi32(_mm_and_si128(_mm_shuffle_epi8(t_hi, op), b0), 8));
+    }
+    end += cigar_hsum_sse(ref), w->del_len += cigar_hsum_sse(del);
+    w->op_mask |= cigar_hor_sse(bit);
+    return cigar_scan_scalar(w, end, c + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline int32_t cigar_hsum_avx(__m256i x)
+{
+    __m128i y = _mm_add_epi32(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+    y = _mm_add_epi32(y, _mm_shuffle_epi32(y, _MM_SHUFFLE(1, 0, 3, 2)));
+    y = _mm_add_epi32(y, _mm_shuffle_epi32(y, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(y);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t cigar_hor_avx(__m256i x)
+{
+    __m128i y = _mm_or_si128(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+    y = _mm_or_si128(y, _mm_shuffle_epi32(y, _MM_SHUFFLE(1, 0, 3, 2)));
+    y = _mm_or_si128(y, _mm_shuffle_epi32(y, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(y);
+}
+
+// 8 ops per step, ops are looked up with variable shifts
+__attribute__((target("avx2")))
+static int32_t cigar_scan_avx2(cigar_walk_t *w, int32_t end, const uint32_t *c, int n)
+{
+    const __m256i lo4 = _mm256_set1_epi32(0xf), one = _mm256_set1_epi32(1), zero = _mm256_setzero_si256();
+    const __m256i op_N = _mm256_set1_epi32(BAM_CREF_SKIP), op_D = _mm256_set1_epi32(BAM_CDEL), op_X = _mm256_set1_epi32(BAM_CDIFF);
+    const __m256i ref_ops = _mm256_set1_epi32(CIGAR_REF_OPS);
+    __m256i ref = zero, del = zero, bit = zero;
+    int i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(c + i)), op = _mm256_and_si256(x, lo4);
+        __m256i sp = _mm256_or_si256(_mm256_cmpeq_epi32(op, op_N), _mm256_cmpgt_epi32(op, op_X));
+        if (!_mm256_testz_si256(sp, sp)) { // N, B or unknown op
+            end += cigar_hsum_avx(ref), w->del_len += cigar_hsum_avx(del);
+            ref = del = zero;
+            end = cigar_scan_scalar(w, end, c + i, 8);
+            continue;
+        }
+        __m256i l = _mm256_srli_epi32(x, 4);
+        __m256i is_ref = _mm256_sub_epi32(zero, _mm256_and_si256(_mm256_srlv_epi32(ref_ops, op), one));
+        ref = _mm256_add_epi32(ref, _mm256_and_si256(l, is_ref));
+        del = _mm256_add_epi32(del, _mm256_and_si256(l, _mm256_cmpeq_epi32(op, op_D)));
+        bit = _mm256_or_si256(bit, _mm256_sllv_epi32(one, op));
+    }
+    end += cigar_hsum_avx(ref), w->del_len += cigar_hsum_avx(del);
+    w->op_mask |= cigar_hor_avx(bit);
+    return cigar_scan_scalar(w, end, c + i, n - i);
+}
+#endif
+
+static cigar_scan_f cigar_scan_select(void)
+{
+#ifdef CIGAR_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return cigar_scan_avx2;
+    if (__builtin_cpu_supports("sse4.2")) return cigar_scan_sse42;
+#endif
+    return cigar_scan_scalar;
+}
+
+static cigar_scan_f cigar_scan; // set on the first long CIGAR, same value from any thread
+
+static int cigar_walk_core(cigar_walk_t *w, int32_t tid, int32_t start, int n_cigar, const uint32_t *c, cigar_scan_f scan)
+{
+    w->tid = tid, w->start = start;
+    w->del_len = w->clip_len = 0, w->op_mask = 0, w->intr_n = 0;
+    w->end = scan(w, start - 1, c, n_cigar);
+    // only the two ends count, as the query length excludes them
+    if (n_cigar > 0) {
+        int op0 = bam_cigar_op(c[0]), op1 = bam_cigar_op(c[n_cigar-1]);
+        if (op0 == BAM_CSOFT_CLIP || op0 == BAM_CHARD_CLIP) w->clip_len += bam_cigar_oplen(c[0]);
+        if (n_cigar > 1 && (op1 == BAM_CSOFT_CLIP || op1 == BAM_CHARD_CLIP)) w->clip_len += bam_cigar_oplen(c[n_cigar-1]);
+    }
+    return w->intr_n;
+}
+
+// @return value
+//    number of introns (N)
+int cigar_walk(cigar_walk_t *w, int32_t tid, int32_t start, int n_cigar, const uint32_t *c)
+{
+    if (n_cigar < CIGAR_SIMD_MIN) return cigar_walk_core(w, tid, start, n_cigar, c, cigar_scan_scalar);
+    if (cigar_scan == NULL) cigar_scan = cigar_scan_select();
+    return cigar_walk_core(w, tid, start, n_cigar, c, cigar_scan);
+}
+
+/***********************
+ * The main() function *
+ ***********************/
+
+#ifdef CIGAR_BENCH_MAIN
+// random long-read CIGAR: clipped ends, M with short I/D in between, an N about every 500 ops
+static int cigar_bench_gen(uint32_t *c, int n)
+{
+    int i = 0;
+    c[i++] = (1 + rand() % 500) << 4 | BAM_CSOFT_CLIP;
+    while (i < n - 1) {
+        int r = rand() % 1000;
+        if (r < 2) c[i++] = (50 + rand() % 10000) << 4 | BAM_CREF_SKIP;
+        else if (r < 600) c[i++] = (1 + rand() % 50) << 4 | BAM_CMATCH;
+        else if (r < 800) c[i++] = (1 + rand() % 5) << 4 | BAM_CINS;
+        else c[i++] = (1 + rand() % 5) << 4 | BAM_CDEL;
+    }
+    c[i++] = (1 + rand() % 500) << 4 | BAM_CSOFT_CLIP;
+    return i;
+}
+
+static uint64_t cigar_bench_sum(const cigar_walk_t *w)
+{
+    uint64_t h = (uint64_t)w->end << 32 ^ (uint32_t)w->del_len ^ (uint64_t)w->clip_len << 16 ^ w->op_mask;
+    int i;
+    for (i = 0; i < w->intr_n; ++i) h = h * 31 + ((uint64_t)w->intr[i].don << 32 | (uint32_t)w->intr[i].acc);
+    return h;
+}
+
+// cigar-bench [n_read] [n_op] [n_round]
+int main(int argc, char *argv[])
+{
+    int n_read = argc > 1 ? atoi(argv[1]) : 1000, n_op = argc > 2 ? atoi(argv[2]) : 5000, n_round = argc > 3 ? atoi(argv[3]) : 20;
+    int i, j, k, *n = (int*)_err_malloc(n_read * sizeof(int));
+    uint32_t **c = (uint32_t**)_err_malloc(n_read * sizeof(uint32_t*));
+    cigar_scan_f scan[3] = {cigar_scan_scalar, NULL, NULL};
+    const char *name[3] = {"scalar", "sse4.2", "avx2"};
+    int64_t tot = 0;
+    if (n_op < 2) n_op = 2;
+#ifdef CIGAR_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) scan[1] = cigar_scan_sse42;
+    if (__builtin_cpu_supports("avx2")) scan[2] = cigar_scan_avx2;
+#endif
+    srand(11);
+    for (i = 0; i < n_read; ++i) {
+        c[i] = (uint32_t*)_err_malloc(n_op * sizeof(uint32_t));
+        n[i] = cigar_bench_gen(c[i], n_op), tot += n[i];
+    }
+    cigar_walk_t w; cigar_walk_init(&w);
+    uint64_t sum0 = 0; double t0 = 0;
+    for (k = 0; k < 3; ++k) {
+        if (scan[k] == NULL) { printf("%s\tnot supported\n", name[k]); continue; }
+        uint64_t sum = 0; double t = realtime();
+        for (j = 0; j < n_round; ++j)
+            for (i = 0; i < n_read; ++i) {
+                cigar_walk_core(&w, 0, 1, n[i], c[i], scan[k]);
+                sum += cigar_bench_sum(&w);
+            }
+        t = realtime() - t;
+        if (k == 0) sum0 = sum, t0 = t;
+        printf("%s\t%.3f ns/op\t%.2fx\t%s\n", name[k], t * 1e9 / ((double)tot * n_round), t0 / t, sum == sum0 ? "OK" : "MISMATCH");
+        if (sum != sum0) return 1;
+    }
+    printf("default\t%s\n", cigar_scan_select() == scan[2] ? name[2] : cigar_scan_select() == scan[1] ? name[1] : name[0]);
+    cigar_walk_free(&w);
+    for (i = 0; i < n_read; ++i) free(c[i]);
+    free(c); free(n);
+    return 0;
+}
+#endif
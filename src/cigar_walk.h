@@ -0,0 +1,41 @@
+#ifndef _CIGAR_WALK_H
+#define _CIGAR_WALK_H
+#include <stdint.h>
+#include "htslib/sam.h"
+
+#define CIGAR_INTR_N 16 // introns kept in the walk itself, more are put on the heap
+
+typedef struct {
+    int32_t don, acc; // first and last intronic base, 1-based
+} cigar_intr_t;
+
+// one alignment after a single pass over its CIGAR
+// every N is an intron, consumers pick the ones not shorter than their own minimum
+// reference block i: [i ? intr[i-1].acc+1 : start, i < intr_n ? intr[i].don-1 : end]
+typedef struct {
+    int32_t tid, start, end;     // 1-based, end: last reference base, start-1 if none
+    int32_t del_len, clip_len;   // D bases, S/H bases at the two ends of the query
+    uint32_t op_mask;            // 1<<op of every op in the CIGAR
+    int intr_n, intr_m; cigar_intr_t *intr, intr0[CIGAR_INTR_N]; // intr: intr0 or heap
+} cigar_walk_t;
+
+#define cigar_intr_len(in) ((in).acc - (in).don + 1)
+// only M and N, as rMATS requires
+#define cigar_walk_is_MN(w) (((w)->op_mask & ~(1U<<BAM_CMATCH | 1U<<BAM_CREF_SKIP)) == 0)
+#define cigar_walk_bam(w, b) cigar_walk(w, (b)->core.tid, (b)->core.pos+1, (b)->core.n_cigar, bam_get_cigar(b))
+
+// w holds a pointer into itself, init it in place and do not copy it
+void cigar_walk_init(cigar_walk_t *w);
+void cigar_walk_free(cigar_walk_t *w);
+int cigar_walk(cigar_walk_t *w, int32_t tid, int32_t start, int n_cigar, const uint32_t *c);
+
+// number of introns not shorter than min_len
+static inline int cigar_walk_intr_n(const cigar_walk_t *w, int min_len)
+{
+    int i, n;
+    for (i = n = 0; i < w->intr_n; ++i)
+        if (cigar_intr_len(w->intr[i]) >= min_len) ++n;
+    return n;
+}
+
+#endif
@@ -0,0 +1,84 @@
+/* genome.c
+ *   on-demand access to genome sequence through a .fai index
+ *   peak memory follows the chromosomes in use instead of genome size
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "htslib/faidx.h"
+#include "genome.h"
+#include "parse_bam.h"
+#include "utils.h"
+
+genome_t *genome_load(const char *fn, int cache_m)
+{
+    genome_t *g = (genome_t*)_err_calloc(1, sizeof(genome_t));
+    if (cache_m < 1) cache_m = 1;
+    g->cache_m = cache_m;
+    g->cache = (genome_chr_t*)_err_calloc(cache_m, sizeof(genome_chr_t));
+
+    // fai_load() builds the .fai when it is missing, this fails for plain gzip
+    if ((g->fai = fai_load(fn)) != NULL) {
+        g->seq_n = faidx_nseq(g->fai);
+        err_func_format_printf(__func__, "genome fasta file indexed, %d sequences.\n", g->seq_n);
+        return g;
+    }
+    err_func_format_printf(__func__, "no .fai index for \"%s\", whole genome is loaded into memory.\n", fn);
+    gzFile genome_fp = gzopen(fn, "r");
+    if (genome_fp == NULL) err_fatal(__func__, "Can not open genome file. %s\n", fn);
+    int i, seq_n, seq_m;
+    kseq_t *seq = kseq_load_genome(genome_fp, &seq_n, &seq_m);
+    err_gzclose(genome_fp);
+    g->seq_n = seq_n;
+    g->mem_seq = (char**)_err_malloc((seq_n > 0 ? seq_n : 1) * sizeof(char*));
+    g->mem_len = (int*)_err_malloc((seq_n > 0 ? seq_n : 1) * sizeof(int));
+    for (i = 0; i < seq_n; ++i) {
+        g->mem_seq[i] = seq[i].seq.s, g->mem_len[i] = seq[i].seq.l;
+        free(seq[i].name.s);
+    }
+    free(seq);
+    return g;
+}
+
+void genome_destroy(genome_t *g)
+{
+    int i;
+    if (g->fai) fai_destroy(g->fai);
+    for (i = 0; i < g->cache_n; ++i) free(g->cache[i].seq);
+    free(g->cache);
+    if (g->mem_seq) {
+        for (i = 0; i < g->seq_n; ++i) free(g->mem_seq[i]);
+        free(g->mem_seq); free(g->mem_len);
+    }
+    free(g);
+}
+
+// sequence of chromosome tid, decoded on first use
+// least recently used chromosome is dropped when the cache is full
+const char *genome_chr(genome_t *g, int tid, int *len)
+{
+    if (tid < 0 || tid >= g->seq_n) err_fatal(__func__, "unknown tid: %d\n", tid);
+    if (g->mem_seq) { *len = g->mem_len[tid]; return g->mem_seq[tid]; }
+
+    int i, lru = 0;
+    for (i = 0; i < g->cache_n; ++i) {
+        if (g->cache[i].tid == tid) {
+            g->cache[i].used = ++g->clock;
+            *len = g->cache[i].len;
+            return g->cache[i].seq;
+        }
+        if (g->cache[i].used < g->cache[lru].used) lru = i;
+    }
+    genome_chr_t *c;
+    if (g->cache_n < g->cache_m) c = g->cache + g->cache_n++;
+    else { c = g->cache + lru; free(c->seq); }
+
+    const char *name = faidx_iseq(g->fai, tid);
+    c->tid = tid; c->used = ++g->clock;
+    c->seq = faidx_fetch_seq(g->fai, name, 0, faidx_seq_len(g->fai, name)-1, &c->len);
+    if (c->seq == NULL || c->len < 0) err_fatal(__func__, "fail to fetch sequence \"%s\"\n", name);
+    *len = c->len;
+    return c->seq;
+}
@@ -0,0 +1,28 @@
+#ifndef _GENOME_H
+#define _GENOME_H
+#include <stdint.h>
+#include "htslib/faidx.h"
+
+#define GENOME_CACHE_N 4 // decoded chromosomes kept in memory
+
+typedef struct {
+    int tid, len;
+    char *seq;
+    uint64_t used; // LRU clock
+} genome_chr_t;
+
+// genome sequence, addressed by tid (order of records in the FASTA file)
+// with a .fai index, chromosomes are decoded on demand and kept in a
+// bounded LRU cache; otherwise the whole genome is loaded into memory
+// not thread-safe
+typedef struct {
+    faidx_t *fai; int seq_n;
+    genome_chr_t *cache; int cache_n, cache_m; uint64_t clock;
+    char **mem_seq; int *mem_len; // no .fai
+} genome_t;
+
+genome_t *genome_load(const char *fn, int cache_m);
+void genome_destroy(genome_t *g);
+const char *genome_chr(genome_t *g, int tid, int *len);
+
+#endif
@@ -2,7 +2,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include "gtf.h"
+#include "gtf_reader.h"
 #include "utils.h"
+#include "kstring.h"
 #include "htslib/sam.h"
 
 extern int gen_trans(bam1_t *b, trans_t *t, int exon_min);
@@ -16,8 +18,8 @@ void exon_free(exon_t *e) { free(e); }
 
 //transcript
 trans_t *trans_init(int n) { 
-    trans_t *t = (trans_t*)_err_malloc(n * sizeof(trans_t));
-    strcpy(t->tname, "");
+    trans_t *t = (trans_t*)_err_calloc(n, sizeof(trans_t));
+    t->tname = t->trans_id = t->gname = t->gid = "";
     t->exon_n = 0; t->exon_m = 2;
     t->exon = exon_init(2);
     return t;
@@ -80,30 +82,32 @@ int check_iden(trans_t *t1, trans_t *t2, int dis)
     return 1;
 }
 
-int set_trans_name(trans_t *t, char *gid, char *gname, char *tname, char *trans_id)
+// names are not copied, they have to outlive t
+// add_read_trans() interns them into the pool of the read_trans_t
+int set_trans_name(trans_t *t, const char *gid, const char *gname, const char *tname, const char *trans_id)
 {
     sort_exon(t);
     t->tid = t->exon[0].tid;
     t->is_rev = t->exon[0].is_rev;
     t->start = t->exon[0].start;
     t->end = t->exon[t->exon_n-1].end;
-    if (gid) strcpy(t->gid, gid);
-    if (gname) strcpy(t->gname, gname);
-    if (trans_id) strcpy(t->trans_id, trans_id);
-    if (tname) strcpy(t->tname, tname);
+    if (gid) t->gid = gid;
+    if (gname) t->gname = gname;
+    if (trans_id) t->trans_id = trans_id;
+    if (tname) t->tname = tname;
     return 0;
 }
 
 int set_gene(gene_t *g, char *gname)
 {
-    int i;
-    g->tid = g->trans[0].tid; g->is_rev = g->trans[0].is_rev;
-    g->start = g->trans[0].start; g->end = g->trans[0].end;
-    for (i = 1; i < g->trans_n; ++i) {
-        if (g->start > g->trans[i].start) g->start = g->trans[i].start;
-        if (g->end < g->trans[i].end) g->end= g->trans[i].end;
+    int i; read_trans_t *T = g->T;
+    g->tid = T->t[0].tid; g->is_rev = T->t[0].is_rev;
+    g->start = T->t[0].start; g->end = T->t[0].end;
+    for (i = 1; i < T->trans_n; ++i) {
+        if (g->start > T->t[i].start) g->start = T->t[i].start;
+        if (g->end < T->t[i].end) g->end= T->t[i].end;
     }
-    if (gname) strcpy(g->gname, gname);
+    if (gname) g->gname = str_pool_put(T->sp, gname);
     return 0;
 }
 
@@ -118,55 +122,112 @@ void trans_free(trans_t *t) { free(t->exon); free(t); }
 //for one read: multi-alignments => multi-transcripts
 read_trans_t *read_trans_init(void)
 {
-    read_trans_t *r = (read_trans_t*)_err_malloc(sizeof(read_trans_t));
-    r->trans_n = 0, r->trans_m = 1;
-    r->t = trans_init(1);
+    read_trans_t *r = (read_trans_t*)_err_calloc(1, sizeof(read_trans_t));
+    r->sp = str_pool_init();
     return r;
 }
 
-void add_read_trans(read_trans_t *r, trans_t t)
+// point t[].exon and the maps into the arena again, after it moved
+static void read_trans_rebase(read_trans_t *r)
 {
-    if (r->trans_n == r->trans_m) r = read_trans_realloc(r);
     int i;
-    r->t[r->trans_n].exon_n = 0;
-    r->t[r->trans_n].cov = 1;
-    for (i = 0; i < t.exon_n; ++i)
-        add_exon(r->t+r->trans_n, t.exon[i].tid, t.exon[i].start, t.exon[i].end, t.exon[i].is_rev);
-    strcpy(r->t[r->trans_n].trans_id, t.trans_id);
-    strcpy(r->t[r->trans_n].tname, t.tname);
-    strcpy(r->t[r->trans_n].gid, t.gid);
-    strcpy(r->t[r->trans_n].gname, t.gname);
-    r->trans_n++;
+    for (i = 0; i < r->trans_n; ++i) {
+        trans_t *t = r->t + i;
+        t->exon = r->exon + t->exon_off;
+        t->novel_exon_map = r->exon_map + t->exon_off, t->novel_sj_map = r->sj_map + t->exon_off;
+    }
+}
+
+// make room for n more exons
+static void read_trans_exon_reserve(read_trans_t *r, int64_t n)
+{
+    if (r->exon_n + n <= r->exon_m) return;
+    if (r->exon_m == 0) r->exon_m = 256;
+    while (r->exon_n + n > r->exon_m) r->exon_m <<= 1;
+    r->exon = (exon_t*)_err_realloc(r->exon, r->exon_m * sizeof(exon_t));
+    r->exon_map = (uint8_t*)_err_realloc(r->exon_map, r->exon_m * sizeof(uint8_t));
+    r->sj_map = (uint8_t*)_err_realloc(r->sj_map, r->exon_m * sizeof(uint8_t));
+    read_trans_rebase(r);
+}
+
+// append an empty transcript, its exons are added by read_trans_add_exon()
+trans_t *read_trans_new(read_trans_t *r)
+{
+    if (r->trans_n == r->trans_m) r = read_trans_realloc(r);
+    trans_t *t = r->t + r->trans_n++;
+    memset(t, 0, sizeof(trans_t));
+    t->exon_off = r->exon_n, t->exon = r->exon + r->exon_n;
+    t->novel_exon_map = r->exon_map + r->exon_n, t->novel_sj_map = r->sj_map + r->exon_n;
+    t->tname = t->trans_id = t->gname = t->gid = "";
+    t->cov = 1;
+    t->lnoth = 1, t->rnoth = 1;
+    return t;
+}
+
+// add exon to the last transcript
+int read_trans_add_exon(read_trans_t *r, int tid, int start, int end, uint8_t is_rev)
+{
+    read_trans_exon_reserve(r, 1);
+    exon_t *e = r->exon + r->exon_n;
+    e->tid = tid, e->start = start, e->end = end, e->is_rev = is_rev;
+    r->exon_map[r->exon_n] = r->sj_map[r->exon_n] = 0;
+    r->exon_n++;
+    return ++r->t[r->trans_n-1].exon_n;
+}
+
+void add_read_trans(read_trans_t *r, trans_t *t)
+{
+    read_trans_exon_reserve(r, t->exon_n);
+    trans_t *t1 = read_trans_new(r);
+    memcpy(t1->exon, t->exon, t->exon_n * sizeof(exon_t));
+    memset(t1->novel_exon_map, 0, t->exon_n); memset(t1->novel_sj_map, 0, t->exon_n);
+    t1->exon_n = t->exon_n; r->exon_n += t->exon_n;
+    t1->tid = t->tid, t1->is_rev = t->is_rev, t1->start = t->start, t1->end = t->end;
+    t1->trans_id = str_pool_put(r->sp, t->trans_id);
+    t1->tname = str_pool_put(r->sp, t->tname);
+    t1->gid = str_pool_put(r->sp, t->gid);
+    t1->gname = str_pool_put(r->sp, t->gname);
 }
 
 read_trans_t *read_trans_realloc(read_trans_t *r)
 {
-    r->trans_m <<= 1;
+    r->trans_m = r->trans_m ? r->trans_m << 1 : 16;
     r->t = (trans_t*)_err_realloc(r->t, r->trans_m * sizeof(trans_t));
-    int i;
-    for (i = (r->trans_m >> 1); i < r->trans_m; ++i) {
-        r->t[i].exon_n = 0, r->t[i].exon_m = 2;
-        r->t[i].exon = exon_init(2);
-    }
     return r;
 }
 
-void novel_read_trans_free(read_trans_t *r)
-{
-    int i;
-    for (i = 0; i < r->trans_m; ++i) { 
-        free(r->t[i].exon); 
-        free(r->t[i].novel_exon_map);
-        free(r->t[i].novel_sj_map);
+// drop the first k transcripts, t[] has to be in the order they were added
+// names of the others are moved to a new pool
+void read_trans_shift(read_trans_t *r, int k)
+{
+    int i; int64_t off;
+    if (k <= 0) return;
+    if (k > r->trans_n) k = r->trans_n;
+    off = k < r->trans_n ? r->t[k].exon_off : r->exon_n;
+    memmove(r->exon, r->exon + off, (r->exon_n - off) * sizeof(exon_t));
+    memmove(r->exon_map, r->exon_map + off, r->exon_n - off);
+    memmove(r->sj_map, r->sj_map + off, r->exon_n - off);
+    memmove(r->t, r->t + k, (r->trans_n - k) * sizeof(trans_t));
+    r->trans_n -= k, r->exon_n -= off;
+    for (i = 0; i < r->trans_n; ++i) r->t[i].exon_off -= off;
+    read_trans_rebase(r);
+
+    str_pool_t *sp = str_pool_init();
+    for (i = 0; i < r->trans_n; ++i) {
+        trans_t *t = r->t + i;
+        t->trans_id = str_pool_put(sp, t->trans_id), t->tname = str_pool_put(sp, t->tname);
+        t->gid = str_pool_put(sp, t->gid), t->gname = str_pool_put(sp, t->gname);
     }
-    free(r->t); free(r);
+    str_pool_free(r->sp); r->sp = sp;
 }
 
+void novel_read_trans_free(read_trans_t *r) { read_trans_free(r); }
+
 void read_trans_free(read_trans_t *r)
 {
-    int i;
-    for (i = 0; i < r->trans_m; ++i) free(r->t[i].exon);
-    free(r->t); free(r);
+    if (r == NULL) return;
+    free(r->t); free(r->exon); free(r->exon_map); free(r->sj_map);
+    str_pool_free(r->sp); free(r);
 }
 
 // intron_group
@@ -181,6 +242,7 @@ intron_group_t *intron_group_init(void)
     intron_group_t *i = (intron_group_t*)_err_malloc(sizeof(intron_group_t));
     i->intron = intron_init(2);
     i->intron_n = 0, i->intron_m = 2;
+    i->key = NULL;
     return i;
 }
 
@@ -206,24 +268,18 @@ void add_intron(intron_group_t *i, intron_t i1)
     i->intron_n++;
 }
 
-//XXX
-int name2id(char ref[])
-{
-    if (ref[3] == 'X') return 22;
-    else if (ref[3] == 'Y') return 23;
-    else if (ref[3] == 'M') return 24;
-    else return atoi(ref+3)-1;
-}
-
-int read_intron_group(intron_group_t *I, FILE *fp)
+// STAR SJ.out.tab, appended to I, intron_group_index() has to be called
+// once all files are read
+int read_intron_group(intron_group_t *I, FILE *fp, chr_name_t *cname)
 {
     if (fp == NULL) return 0;
-    char line[1024], ref[100]; int start, end, nstrand, canon, anno, uniq_map, multi_map, overlang;
+    char line[1024], ref[1024]; int start, end, nstrand, canon, anno, uniq_map, multi_map, overlang;
     intron_t *i = intron_init(1);
     while (fgets(line, 1024, fp) != NULL) {
-        sscanf(line, "%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d", ref, &start, &end, &nstrand, &canon, &anno, &uniq_map, &multi_map, &overlang);
-        i->tid = name2id(ref); i->start = start, i->end = end;
+        if (sscanf(line, "%s\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d", ref, &start, &end, &nstrand, &canon, &anno, &uniq_map, &multi_map, &overlang) != 9) continue;
+        i->tid = get_chr_id(cname, ref); i->start = start, i->end = end;
         i->is_rev = (nstrand == 1 ? 0 : (nstrand == 2 ? 1 : -1)); i->is_canon = canon;
+        i->is_anno = anno;
         i->uniq_c = uniq_map; i->multi_c = multi_map;
         add_intron(I, *i);
     }
@@ -231,13 +287,66 @@ int read_intron_group(intron_group_t *I, FILE *fp)
     return I->intron_n;
 }
 
-void intron_group_free(intron_group_t *i) { free(i->intron); free(i); }
+#define intron_key(tid, is_rev, start) ((uint64_t)(tid) << 34 | (uint64_t)(is_rev) << 32 | (uint32_t)(start))
+
+static int intron_key_comp(const void *_a, const void *_b)
+{
+    intron_t *a = (intron_t*)_a, *b = (intron_t*)_b;
+    uint64_t ka = intron_key(a->tid, a->is_rev, a->start), kb = intron_key(b->tid, b->is_rev, b->start);
+    if (ka != kb) return ka < kb ? -1 : 1;
+    else return (a->end > b->end) - (a->end < b->end);
+}
+
+// sort introns of all files, merge identical ones and sum their counts
+int intron_group_index(intron_group_t *I)
+{
+    int i, n = 0;
+    qsort(I->intron, I->intron_n, sizeof(intron_t), intron_key_comp);
+    for (i = 0; i < I->intron_n; ++i) {
+        intron_t *a = I->intron + i;
+        if (n > 0 && intron_key_comp(I->intron + n-1, a) == 0) {
+            I->intron[n-1].uniq_c += a->uniq_c, I->intron[n-1].multi_c += a->multi_c;
+            I->intron[n-1].is_anno |= a->is_anno;
+        } else I->intron[n++] = *a;
+    }
+    I->intron_n = n;
+    I->key = (uint64_t*)_err_realloc(I->key, (n > 0 ? n : 1) * sizeof(uint64_t));
+    for (i = 0; i < n; ++i) I->key[i] = intron_key(I->intron[i].tid, I->intron[i].is_rev, I->intron[i].start);
+    return n;
+}
+
+// first of a[0, n) not less than x, without a branch in the loop
+static inline int64_t key_lower(const uint64_t *a, int64_t n, uint64_t x)
+{
+    const uint64_t *b = a;
+    if (n == 0) return 0;
+    while (n > 1) {
+        int64_t h = n >> 1;
+        b = b[h] < x ? b + h : b;
+        n -= h;
+    }
+    return (b - a) + (*b < x);
+}
+
+// intron of the same strand with both ends within dis
+// @return value
+//    1: found, 0: not found
+int intron_group_get(const intron_group_t *I, int tid, uint8_t is_rev, int start, int end, int dis)
+{
+    uint64_t hi = intron_key(tid, is_rev, start + dis);
+    int64_t i = key_lower(I->key, I->intron_n, intron_key(tid, is_rev, start > dis ? start - dis : 0));
+    for (; i < I->intron_n && I->key[i] <= hi; ++i)
+        if (abs(I->intron[i].end - end) <= dis) return 1;
+    return 0;
+}
+
+void intron_group_free(intron_group_t *i) { free(i->intron); free(i->key); free(i); }
 
 //gene
 gene_t *gene_init(void) {
-    gene_t *g = (gene_t*)_err_malloc(sizeof(gene_t));
-    g->trans_n = 0, g->trans_m = 1;
-    g->trans = trans_init(1);
+    gene_t *g = (gene_t*)_err_calloc(1, sizeof(gene_t));
+    g->T = read_trans_init();
+    g->gname = g->gid = "";
     return g; 
 }
 
@@ -245,65 +354,24 @@ gene_t *copy_gene(gene_t *g) {
     gene_t *r_g = gene_init();
     r_g->tid = g->tid; r_g->is_rev = g->is_rev;
     r_g->start = g->start, r_g->end = g->end;
-    strcpy(r_g->gname, g->gname), strcpy(r_g->gid, g->gid);
+    r_g->gname = str_pool_put(r_g->T->sp, g->gname), r_g->gid = str_pool_put(r_g->T->sp, g->gid);
     int i;
-    for (i = 0; i < g->trans_n; ++i) {
-        add_trans(r_g, g->trans[i], 0);
+    for (i = 0; i < g->T->trans_n; ++i) {
+        add_trans(r_g, g->T->t+i, 0);
     }
 
     return r_g;
 }
 
-void add_trans(gene_t *g, trans_t t, int novel_gene_flag)
+void add_trans(gene_t *g, trans_t *t, int novel_gene_flag)
 {
-    if (g->trans_n == g->trans_m) g = trans_realloc(g);
-    int i;
-    g->trans[g->trans_n].tid = t.tid;
-    g->trans[g->trans_n].is_rev = t.is_rev;
-    g->trans[g->trans_n].start = t.start;
-    g->trans[g->trans_n].end = t.end;
-    g->trans[g->trans_n].novel_gene_flag = novel_gene_flag;
-    g->trans[g->trans_n].cov = 1;
-    strcpy(g->trans[g->trans_n].tname, t.tname);
-    strcpy(g->trans[g->trans_n].trans_id, t.trans_id);
-
-    g->trans[g->trans_n].exon_n = 0;
-    for (i = 0; i < t.exon_n; ++i) {
-        add_exon(g->trans+g->trans_n, t.exon[i].tid, t.exon[i].start, t.exon[i].end, t.exon[i].is_rev);
-    }
-    // update gene start and end
-    g->trans_n++;
-}
-
-gene_t *trans_realloc(gene_t *g) {
-    g->trans_m <<= 1;
-    g->trans = (trans_t*)_err_realloc(g->trans, g->trans_m * sizeof(trans_t));
-    int i;
-    for (i = (g->trans_m >> 1); i < g->trans_m; ++i) {
-        g->trans[i].exon_n = 0, g->trans[i].exon_m = 2;
-        g->trans[i].exon = exon_init(2);
-    }
-    return g;
+    add_read_trans(g->T, t);
+    g->T->t[g->T->trans_n-1].novel_gene_flag = novel_gene_flag;
+    g->T->t[g->T->trans_n-1].gid = g->T->t[g->T->trans_n-1].gname = "";
 }
 
 void gene_free(gene_t *g) {
-    int i;
-    for (i = 0; i < g->trans_m; ++i) {
-        free(g->trans[i].exon);
-    }
-    free(g->trans); free(g);
-}
-
-// gtf additional information
-void gtf_add_info(char add_info[], char tag[], char *info)
-{
-    int i;
-    for (i=0; add_info[i] != '\0'; ++i) {
-        if (strncmp(add_info+i, tag, strlen(tag)) == 0) {
-            sscanf(add_info+i+strlen(tag)+2, "%[^\"]", info);
-            return;
-        }
-    }
+    read_trans_free(g->T); free(g);
 }
 
 // gene_group
@@ -314,20 +382,22 @@ gene_group_t *gene_group_init(void)
     return gg;
 }
 
+// chromosome name dictionary: names are interned once, looked up by hash
 chr_name_t *chr_name_init(void)
 {
     chr_name_t *cname = (chr_name_t*)_err_malloc(sizeof(chr_name_t));
-    cname->chr_name = (char**)_err_malloc(30 * sizeof(char*));
-    int i;
-    for (i = 0; i < 30; ++i) cname->chr_name[i] = (char*)_err_malloc(100 * sizeof(char));
-    cname->chr_n = 0; cname->chr_m = 30;
+    cname->chr_n = 0; cname->chr_m = 32;
+    cname->chr_name = (char**)_err_malloc(cname->chr_m * sizeof(char*));
+    cname->h_m = 64;
+    cname->h = (int32_t*)_err_malloc(cname->h_m * sizeof(int32_t));
+    memset(cname->h, 0xff, cname->h_m * sizeof(int32_t));
     return cname;
 }
 
 void chr_name_free(chr_name_t *cname)
 {
-    int i; for (i = 0; i < cname->chr_m; ++i) free(cname->chr_name[i]);
-    free(cname->chr_name); free(cname);
+    int i; for (i = 0; i < cname->chr_n; ++i) free(cname->chr_name[i]);
+    free(cname->chr_name); free(cname->h); free(cname);
 }
 
 gene_group_t *gene_group_realloc(gene_group_t *gg)
@@ -336,8 +406,9 @@ gene_group_t *gene_group_realloc(gene_group_t *gg)
     gg->gene_m <<= 1;
     gg->g = (gene_t*)_err_realloc(gg->g, gg->gene_m * sizeof(gene_t));
     for (i=gg->gene_m>>1; i < gg->gene_m; ++i) {
-        gg->g[i].trans_n = 0; gg->g[i].trans_m = 1;
-        gg->g[i].trans = trans_init(1);
+        memset(gg->g+i, 0, sizeof(gene_t));
+        gg->g[i].T = read_trans_init();
+        gg->g[i].gname = gg->g[i].gid = "";
     }
     return gg;
 }
@@ -346,9 +417,10 @@ void add_gene(gene_group_t *gg, gene_t g, int novel_gene_flag)
 {
     if (gg->gene_n == gg->gene_m) gg = gene_group_realloc(gg);
     int i;
-    for (i = 0; i < g.trans_n; ++i)
-        add_trans(gg->g+gg->gene_n, g.trans[i], novel_gene_flag);
-    strcpy(gg->g[gg->gene_n].gname, g.gname);
+    for (i = 0; i < g.T->trans_n; ++i)
+        add_trans(gg->g+gg->gene_n, g.T->t+i, novel_gene_flag);
+    gg->g[gg->gene_n].gname = str_pool_put(gg->g[gg->gene_n].T->sp, g.gname);
+    gg->g[gg->gene_n].gid = str_pool_put(gg->g[gg->gene_n].T->sp, g.gid);
     gg->g[gg->gene_n].tid = g.tid;
     gg->g[gg->gene_n].start = g.start;
     gg->g[gg->gene_n].end = g.end;
@@ -358,28 +430,107 @@ void add_gene(gene_group_t *gg, gene_t g, int novel_gene_flag)
 
 void gene_group_free(gene_group_t *gg)
 {
-    int i, j;
-    for (i = 0; i < gg->gene_m; ++i) {
-        for (j = 0; j < gg->g[i].trans_m; ++j)
-            free(gg->g[i].trans[j].exon);
-        free(gg->g[i].trans);
-    }
+    int i;
+    for (i = 0; i < gg->gene_m; ++i) read_trans_free(gg->g[i].T);
     free(gg->g); free(gg);
 }
 
-int get_chr_id(chr_name_t *cname, char *chr)
+static inline uint32_t chr_name_hash(const char *s)
+{
+    uint64_t h = 0;
+    for (; *s; ++s) h = (h << 5) - h + (uint8_t)*s;
+    return (uint32_t)hash_64(h);
+}
+
+// string pool: strings are copied into large blocks and interned
+str_pool_t *str_pool_init(void)
+{
+    return (str_pool_t*)_err_calloc(1, sizeof(str_pool_t));
+}
+
+void str_pool_free(str_pool_t *sp)
 {
     int i;
-    for (i = 0; i < cname->chr_n; ++i) {
-        if (strcmp(cname->chr_name[i], chr) == 0) return i;
+    if (sp == NULL) return;
+    for (i = 0; i < sp->blk_n; ++i) free(sp->blk[i]);
+    free(sp->blk); free(sp->h); free(sp);
+}
+
+// @return value
+//    the copy of s in sp, equal strings share one copy
+const char *str_pool_put(str_pool_t *sp, const char *s)
+{
+    uint32_t k, mask; int l = strlen(s) + 1;
+    if (sp->h_n * 2 >= sp->h_m) { // grow and rehash
+        uint32_t i, old_m = sp->h_m; const char **old_h = sp->h;
+        sp->h_m = sp->h_m ? sp->h_m << 1 : 64; mask = sp->h_m - 1;
+        sp->h = (const char**)_err_calloc(sp->h_m, sizeof(char*));
+        for (i = 0; i < old_m; ++i) {
+            if (old_h[i] == NULL) continue;
+            k = chr_name_hash(old_h[i]) & mask;
+            while (sp->h[k]) k = (k + 1) & mask;
+            sp->h[k] = old_h[i];
+        }
+        free(old_h);
     }
-    if (cname->chr_n == cname->chr_m) {
-        cname->chr_m <<= 1;
-        cname->chr_name = (char**)_err_realloc(cname->chr_name, cname->chr_m * sizeof(char*));
-        for (i = cname->chr_m>>1; i < cname->chr_m; ++i)
-            cname->chr_name[i] = (char*)_err_malloc(100 * sizeof(char));
+    mask = sp->h_m - 1, k = chr_name_hash(s) & mask;
+    while (sp->h[k]) {
+        if (strcmp(sp->h[k], s) == 0) return sp->h[k];
+        k = (k + 1) & mask;
+    }
+    // blocks grow from 1K to STR_POOL_BLK, longer strings get their own block
+    if (sp->blk_l + l > sp->blk_s) {
+        if (sp->blk_n == sp->blk_m) {
+            sp->blk_m = sp->blk_m ? sp->blk_m << 1 : 16;
+            sp->blk = (char**)_err_realloc(sp->blk, sp->blk_m * sizeof(char*));
+        }
+        sp->blk_s = sp->blk_n < 6 ? 1024 << sp->blk_n : STR_POOL_BLK;
+        if (sp->blk_s < l) sp->blk_s = l;
+        sp->blk[sp->blk_n++] = (char*)_err_malloc(sp->blk_s);
+        sp->blk_l = 0;
+    }
+    char *p = sp->blk[sp->blk_n-1] + sp->blk_l;
+    memcpy(p, s, l); sp->blk_l += l;
+    sp->h[k] = p; sp->h_n++;
+    return p;
+}
+
+// slot of chr: either holding chr or the empty slot it would go to
+static uint32_t chr_name_slot(chr_name_t *cname, const char *chr)
+{
+    uint32_t mask = cname->h_m - 1, k = chr_name_hash(chr) & mask;
+    while (cname->h[k] >= 0 && strcmp(cname->chr_name[cname->h[k]], chr) != 0)
+        k = (k + 1) & mask;
+    return k;
+}
+
+// @return value
+//    tid of chr, -1 if chr is unknown
+int chr_name_id(chr_name_t *cname, const char *chr)
+{
+    return cname->h[chr_name_slot(cname, chr)];
+}
+
+// tid of chr, a new tid is assigned to an unknown chr
+int get_chr_id(chr_name_t *cname, const char *chr)
+{
+    uint32_t k = chr_name_slot(cname, chr);
+    if (cname->h[k] >= 0) return cname->h[k];
+
+    if (cname->chr_n == cname->chr_m) _realloc(cname->chr_name, cname->chr_m, char*)
+    cname->chr_name[cname->chr_n] = strdup(chr);
+    cname->h[k] = cname->chr_n;
+    if ((cname->chr_n + 1) * 2 > (int)cname->h_m) { // load factor 0.5
+        int i; uint32_t mask;
+        cname->h_m <<= 1; mask = cname->h_m - 1;
+        cname->h = (int32_t*)_err_realloc(cname->h, cname->h_m * sizeof(int32_t));
+        memset(cname->h, 0xff, cname->h_m * sizeof(int32_t));
+        for (i = 0; i <= cname->chr_n; ++i) {
+            k = chr_name_hash(cname->chr_name[i]) & mask;
+            while (cname->h[k] >= 0) k = (k + 1) & mask;
+            cname->h[k] = i;
+        }
     }
-    strcpy(cname->chr_name[cname->chr_n], chr);
     return cname->chr_n++;
 }
 
@@ -431,13 +582,13 @@ int read_sj_group(FILE *sj_fp, chr_name_t *cname, sj_t **sj_group, int sj_m)
 void reverse_exon_order(gene_group_t *gg) {
     int i, j, k; exon_t tmp;
     for (i = 0; i < gg->gene_n; ++i) {
-        for (j = 0; j < gg->g[i].trans_n; ++j) {
-            if (gg->g[i].trans[j].is_rev == 0) continue;
-            int exon_n = gg->g[i].trans[j].exon_n;
-            for (k = 0; k < exon_n >> 1; ++k) {
-                tmp = gg->g[i].trans[j].exon[k];
-                gg->g[i].trans[j].exon[k] = gg->g[i].trans[j].exon[exon_n-1-k];
-                gg->g[i].trans[j].exon[exon_n-1-k] = tmp;
+        for (j = 0; j < gg->g[i].T->trans_n; ++j) {
+            trans_t *t = gg->g[i].T->t + j;
+            if (t->is_rev == 0) continue;
+            for (k = 0; k < t->exon_n >> 1; ++k) {
+                tmp = t->exon[k];
+                t->exon[k] = t->exon[t->exon_n-1-k];
+                t->exon[t->exon_n-1-k] = tmp;
             }
         }
     }
@@ -446,66 +597,67 @@ void reverse_exon_order(gene_group_t *gg) {
 // merge overlapping gene into one complex
 // sorted with chr and start
 // exon sorted by start
-int read_gene_group(char *fn, chr_name_t *cname, gene_group_t *gg)
-{
-    err_func_format_printf(__func__, "read gene annotation from GTF file ...\n");
-    FILE *gtf = fopen(fn, "r");
-    char line[1024], ref[100]="\0", type[20]="\0"; int start, end; char strand, add_info[1024], gname[1024], gid[1024], trans_name[1024], trans_id[1024], tag[20];
-    gene_t *cur_g=0; trans_t *cur_t=0; exon_t *cur_e=0;
-    gg->gene_n = 0;
-    int last_tid=-1, last_start=-1, last_end=-1;
-
-    while (fgets(line, 1024, gtf) != NULL) {
-        if (line[0] == '#') continue;
-        sscanf(line, "%s\t%*s\t%s\t%d\t%d\t%*s\t%c\t%*s\t%[^\n]", ref, type, &start, &end, &strand, add_info);
-        int tid = get_chr_id(cname, ref);
-        uint8_t is_rev = (strand == '-' ? 1 : 0);
-        strcpy(tag, "gene_id"); gtf_add_info(add_info, tag, gid);
-        strcpy(tag, "gene_name"); gtf_add_info(add_info, tag, gname);
-        strcpy(tag, "transcript_id"); gtf_add_info(add_info, tag, trans_id);
-        strcpy(tag, "transcript_name"); gtf_add_info(add_info, tag, trans_name);
- 
-        if (strcmp(type, "gene") == 0) { // new gene starts old gene ends
-            if (tid == last_tid &&  start < last_end) {
-                if (start < last_start) {
-                    last_start = start;
-                    cur_g->start = start;
-                }
-                if (end > last_end) {
-                    last_end = end;
-                    cur_g->end = end;
-                }
-                continue;
+typedef struct {
+    const char *fn; gene_group_t *gg;
+    gene_t *cur_g; trans_t *cur_t;
+    int last_tid, last_start, last_end;
+    char gname[1024], gid[1024], trans_name[100], trans_id[100];
+} gene_group_aux_t;
+
+static void read_gene_group_rec(const gtf_rec_t *r, int tid, void *data)
+{
+    gene_group_aux_t *a = (gene_group_aux_t*)data; gene_group_t *gg = a->gg;
+    int start = r->start, end = r->end; uint8_t is_rev = r->is_rev;
+    gtf_attr_cpy(a->gid, 1024, r, GTF_GENE_ID);
+    gtf_attr_cpy(a->gname, 1024, r, GTF_GENE_NAME);
+    gtf_attr_cpy(a->trans_id, 100, r, GTF_TRANS_ID);
+    gtf_attr_cpy(a->trans_name, 100, r, GTF_TRANS_NAME);
+
+    if (r->type == GTF_GENE) { // new gene starts old gene ends
+        if (tid == a->last_tid &&  start < a->last_end) {
+            if (start < a->last_start) {
+                a->last_start = start;
+                a->cur_g->start = start;
             }
-            last_tid = tid, last_start = start, last_end = end;
-            if (++gg->gene_n == gg->gene_m) gg = gene_group_realloc(gg);
-            cur_g = gg->g + gg->gene_n-1;
-            cur_g->tid = tid; cur_g->is_rev = is_rev;
-            cur_g->start = start; cur_g->end = end;
-            strcpy(cur_g->gname, gname); strcpy(cur_g->gid, gid);
-            cur_g->trans_n = 0;
-        } else if (strcmp(type, "transcript") == 0) { // new trans starts, old trans ends
-            if (cur_g == 0) err_fatal_core(__func__, "GTF format error in %s.\n", fn);
-            if (++cur_g->trans_n == cur_g->trans_m) cur_g = trans_realloc(cur_g);
-            cur_t = cur_g->trans + cur_g->trans_n-1;
-            cur_t->tid = tid; cur_t->is_rev = is_rev;
-            cur_t->start = start; cur_t->end = end;
-            strcpy(cur_t->tname, trans_name); strcpy(cur_t->trans_id, trans_id);
-            cur_t->exon_n = 0;
-        } else if (strcmp(type, "exon") == 0) { // new exon starts, old exon ends
-            if (cur_t == 0) err_fatal_core(__func__, "GTF format error in %s.\n", fn);
-            // add exon to gg
-            if (++cur_t->exon_n == cur_t->exon_m) cur_t = exon_realloc(cur_t);
-            cur_e = cur_t->exon + cur_t->exon_n-1;
-            cur_e->tid = tid; cur_e->is_rev = is_rev;
-            cur_e->start = start; cur_e->end = end;
+            if (end > a->last_end) {
+                a->last_end = end;
+                a->cur_g->end = end;
+            }
+            return;
         }
+        a->last_tid = tid, a->last_start = start, a->last_end = end;
+        if (++gg->gene_n == gg->gene_m) gg = gene_group_realloc(gg);
+        a->cur_g = gg->g + gg->gene_n-1;
+        a->cur_g->tid = tid; a->cur_g->is_rev = is_rev;
+        a->cur_g->start = start; a->cur_g->end = end;
+        a->cur_g->T->trans_n = 0, a->cur_g->T->exon_n = 0;
+        a->cur_g->gname = str_pool_put(a->cur_g->T->sp, a->gname);
+        a->cur_g->gid = str_pool_put(a->cur_g->T->sp, a->gid);
+    } else if (r->type == GTF_TRANS) { // new trans starts, old trans ends
+        if (a->cur_g == 0) err_fatal_core(__func__, "GTF format error in %s.\n", a->fn);
+        a->cur_t = read_trans_new(a->cur_g->T);
+        a->cur_t->tid = tid; a->cur_t->is_rev = is_rev;
+        a->cur_t->start = start; a->cur_t->end = end;
+        a->cur_t->tname = str_pool_put(a->cur_g->T->sp, a->trans_name);
+        a->cur_t->trans_id = str_pool_put(a->cur_g->T->sp, a->trans_id);
+    } else { // new exon starts, old exon ends
+        if (a->cur_t == 0) err_fatal_core(__func__, "GTF format error in %s.\n", a->fn);
+        // add exon to gg
+        read_trans_add_exon(a->cur_g->T, tid, start, end, is_rev);
     }
+}
+
+int read_gene_group(char *fn, chr_name_t *cname, int n_threads, gene_group_t *gg)
+{
+    err_func_format_printf(__func__, "read gene annotation from GTF file ...\n");
+    gene_group_aux_t a; memset(&a, 0, sizeof(a));
+    a.fn = fn; a.gg = gg; a.last_tid = a.last_start = a.last_end = -1;
+    gg->gene_n = 0;
+    gtf_read(fn, cname, 1, n_threads, read_gene_group_rec, &a);
     // reverse '-' transcript
     reverse_exon_order(gg);
     // sort with cname
     qsort(gg->g, gg->gene_n, sizeof(gene_t), gene_group_comp);
-    err_fclose(gtf);
     err_func_format_printf(__func__, "read gene annotation from GTF file done!\n");
     return gg->gene_n;
 }
@@ -525,29 +677,53 @@ int print_trans(trans_t t, bam_hdr_t *h, char *src, FILE *out)
     return 0;
 }
 
+int sprint_trans(kstring_t *s, trans_t *t, bam_hdr_t *h, char *src)
+{
+    int i;
+    ksprintf(s, "%s\t%s\t%s\t%d\t%d\t.\t%c\t.\tgene_id \"%s\"; transcript_id \"%s\";\n", h->target_name[t->tid], src, "transcript", t->start, t->end, "+-"[t->is_rev], "UNCLASSIFIED", t->tname);
+    for (i = 0; i < t->exon_n; ++i)
+        ksprintf(s, "%s\t%s\t%s\t%d\t%d\t.\t%c\t.\tgene_id \"%s\"; transcript_id \"%s\";\n", h->target_name[t->tid], src, "exon", t->exon[i].start, t->exon[i].end, "+-"[t->exon[i].is_rev], "UNCLASSIFIED",t->tname);
+    return 0;
+}
+
 // tid source feature start end score(.) strand phase(.) additional
-int print_read_trans(read_trans_t *anno_T, read_trans_t *novel_T, bam_hdr_t *h, char *src, FILE *out)
+int sprint_read_trans1(kstring_t *s, trans_t *t, bam_hdr_t *h, char *src)
 {
-    int i, j; char tmp[1024], name[1024];
+    int j; char tmp[1024], name[1024];
     int score_min = 450, score_step=50;
 
-    for (i = 0; i < novel_T->trans_n; ++i) {
-        memset(tmp, 0, 1024); memset(name, 0, 1024);
-        if (strlen(novel_T->t[i].gid) > 0) sprintf(tmp, " gene_id \"%s\";", novel_T->t[i].gid), strcat(name, tmp);
-        if (strlen(novel_T->t[i].trans_id) > 0) sprintf(tmp, " transcript_id \"%s\";", novel_T->t[i].trans_id), strcat(name, tmp);
-        if (strlen(novel_T->t[i].gname) > 0) sprintf(tmp, " gene_name \"%s\";", novel_T->t[i].gname), strcat(name, tmp);
-        if (strlen(novel_T->t[i].tname) > 0) sprintf(tmp, " transcript_name \"%s\";", novel_T->t[i].tname), strcat(name, tmp);
+    memset(tmp, 0, 1024); memset(name, 0, 1024);
+    if (strlen(t->gid) > 0) sprintf(tmp, " gene_id \"%s\";", t->gid), strcat(name, tmp);
+    if (strlen(t->trans_id) > 0) sprintf(tmp, " transcript_id \"%s\";", t->trans_id), strcat(name, tmp);
+    if (strlen(t->gname) > 0) sprintf(tmp, " gene_name \"%s\";", t->gname), strcat(name, tmp);
+    if (strlen(t->tname) > 0) sprintf(tmp, " transcript_name \"%s\";", t->tname), strcat(name, tmp);
+
+    ksprintf(s, "%s\t%s\t%s\t%d\t%d\t.\t%c\t.\t%s\n", h->target_name[t->tid], src, "transcript", t->start, t->end, "+-"[t->is_rev], name+1);
+
+    if (t->is_rev) { // '-' strand
+        for (j = t->exon_n-1; j >= 0; --j)
+            ksprintf(s, "%s\t%s\t%s\t%d\t%d\t%d\t%c\t.\t%s\n", h->target_name[t->exon[j].tid], src, "exon", t->exon[j].start, t->exon[j].end, score_min+score_step*t->cov, "+-"[t->exon[j].is_rev], name+1);
+    } else { // '+' strand
+        for (j = 0; j < t->exon_n; ++j)
+            ksprintf(s, "%s\t%s\t%s\t%d\t%d\t%d\t%c\t.\t%s\n", h->target_name[t->exon[j].tid], src, "exon", t->exon[j].start, t->exon[j].end, score_min+score_step*t->cov, "+-"[t->exon[j].is_rev], name+1);
+    }
+    return 0;
+}
 
-        fprintf(out, "%s\t%s\t%s\t%d\t%d\t.\t%c\t.\t%s\n", h->target_name[novel_T->t[i].tid], src, "transcript", novel_T->t[i].start, novel_T->t[i].end, "+-"[novel_T->t[i].is_rev], name+1);
+int print_read_trans1(trans_t *t, bam_hdr_t *h, char *src, FILE *out)
+{
+    kstring_t s = {0, 0, NULL};
+    sprint_read_trans1(&s, t, h, src);
+    err_fwrite(s.s, 1, s.l, out);
+    free(s.s);
+    return 0;
+}
 
-        if (novel_T->t[i].is_rev) { // '-' strand
-            for (j = novel_T->t[i].exon_n-1; j >= 0; --j)
-                fprintf(out, "%s\t%s\t%s\t%d\t%d\t%d\t%c\t.\t%s\n", h->target_name[novel_T->t[i].exon[j].tid], src, "exon", novel_T->t[i].exon[j].start, novel_T->t[i].exon[j].end, score_min+score_step*novel_T->t[i].cov, "+-"[novel_T->t[i].exon[j].is_rev], name+1);
-        } else { // '+' strand
-            for (j = 0; j < novel_T->t[i].exon_n; ++j)
-                fprintf(out, "%s\t%s\t%s\t%d\t%d\t%d\t%c\t.\t%s\n", h->target_name[novel_T->t[i].exon[j].tid], src, "exon", novel_T->t[i].exon[j].start, novel_T->t[i].exon[j].end, score_min+score_step*novel_T->t[i].cov, "+-"[novel_T->t[i].exon[j].is_rev], name+1);
-        }
-    }
+int print_read_trans(read_trans_t *anno_T, read_trans_t *novel_T, bam_hdr_t *h, char *src, FILE *out)
+{
+    int i;
+    for (i = 0; i < novel_T->trans_n; ++i)
+        print_read_trans1(novel_T->t+i, h, src, out);
     err_printf("Total novel transcript: %d\n", novel_T->trans_n);
     return 0;
 }
@@ -560,8 +736,8 @@ void print_gene(FILE *out, char *src, gene_t *gene, char **cname) {
     if (strlen(gene->gname) > 0) sprintf(tmp, " gene_name \"%s\";", gene->gname), strcat(name, tmp);
     fprintf(out, "%s\t%s\t%s\t%d\t%d\t.\t%c\t.\t%s\n", cname[gene->tid], src, "gene", gene->start, gene->end, "+-"[gene->is_rev], name+1);
 
-    for (i = 0; i < gene->trans_n; ++i) {
-        trans_t *t = gene->trans + i;
+    for (i = 0; i < gene->T->trans_n; ++i) {
+        trans_t *t = gene->T->t + i;
         memset(tmp, 0, 1024); memset(name, 0, 1024);
         if (strlen(gene->gid) > 0) sprintf(tmp, " gene_id \"%s\";", gene->gid), strcat(name, tmp);
         if (strlen(t->trans_id) > 0) sprintf(tmp, " transcript_id \"%s\";", t->trans_id), strcat(name, tmp);
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "htslib/sam.h"
+#include "kstring.h"
 
 #define MAX_SITE 2147483647
 #define DON_SITE_F 0
@@ -36,13 +37,23 @@ typedef struct {
 #define check_r_iden(map) (map & 0x2)
 #define check_b_iden(map) (map & 0x1)
 
+// interned strings, each distinct string is stored once in large blocks
 typedef struct {
-    exon_t *exon; int exon_n, exon_m;
+    char **blk; int blk_n, blk_m;
+    int blk_l, blk_s;                          // blk[blk_n-1]: blk_l of blk_s bytes used
+    const char **h; uint32_t h_n, h_m;         // open-addressing slots, NULL: empty
+} str_pool_t;
+
+#define STR_POOL_BLK 0x10000
+
+typedef struct {
+    exon_t *exon; int exon_n, exon_m;       // exon_m == 0: exon is read_trans_t.exon + exon_off
+    int64_t exon_off;
     uint8_t *novel_exon_map, *novel_sj_map; // 3-bit map: l-iden | r-iden | both-iden
     int tid; uint8_t is_rev;
     int start, end;
-    char tname[100], trans_id[100];
-    char gname[100], gid[100];
+    const char *tname, *trans_id;           // not owned, interned in read_trans_t.sp
+    const char *gname, *gid;
     int novel_gene_flag, cov;
     uint8_t lfull:2, lnoth:2, rfull:2, rnoth:2;
     uint8_t full:2, novel:2, all_novel:2, all_iden:2;
@@ -55,19 +66,27 @@ typedef struct {
     int uniq_c, multi_c;
 } intron_t;
 
+// after intron_group_index(), introns are unique and sorted by key:
+// tid<<34 | is_rev<<32 | start, then by end
 typedef struct {
     intron_t *intron; int intron_n, intron_m;
+    uint64_t *key;
 } intron_group_t;
 
+// transcripts with their exons in one arena, novel_exon_map/novel_sj_map
+// of t[i] point into exon_map/sj_map at t[i].exon_off
 typedef struct {
     trans_t *t; int trans_n, trans_m;
+    exon_t *exon; int64_t exon_n, exon_m;
+    uint8_t *exon_map, *sj_map;
+    str_pool_t *sp;
 } read_trans_t;
 
 typedef struct {
-    trans_t *trans; int trans_n, anno_tran_n, trans_m;
+    read_trans_t *T; int anno_tran_n;
     int tid; uint8_t is_rev;
     int start, end;
-    char gname[1024], gid[1024];
+    const char *gname, *gid; // interned in T->sp
 } gene_t;
 
 typedef struct {
@@ -75,29 +94,40 @@ typedef struct {
 } gene_group_t;
 
 typedef struct {
-    char **chr_name;
+    char **chr_name;            // chr_name[tid]
     int chr_n, chr_m;
+    int32_t *h; uint32_t h_m;   // open-addressing slots, tid, -1: empty
 } chr_name_t;
 
 exon_t *exon_init(int n);
 void exon_free(exon_t *e);
 
 
+str_pool_t *str_pool_init(void);
+const char *str_pool_put(str_pool_t *sp, const char *s);
+void str_pool_free(str_pool_t *sp);
+
 chr_name_t *chr_name_init(void);
 void chr_name_free(chr_name_t *cname);
+int chr_name_id(chr_name_t *cname, const char *chr);
+int get_chr_id(chr_name_t *cname, const char *chr);
+int sj_group_comp(const void *_a, const void *_b);
 int read_sj_group(FILE *sj_fp, chr_name_t *cname, sj_t **sj_group, int sj_m);
 int bam_set_cname(bam_hdr_t *h, chr_name_t *cname);
 
 trans_t *trans_init(int n);
 int add_exon(trans_t *t, int tid, int start, int end, uint8_t is_rev);
 void sort_exon(trans_t *t);
-int set_trans_name(trans_t *t, char *gid, char *gname, char *trans_id, char *tname);
+int set_trans_name(trans_t *t, const char *gid, const char *gname, const char *tname, const char *trans_id);
 trans_t *exon_realloc(trans_t *t);
 void trans_free(trans_t *t);
 
 read_trans_t *read_trans_init(void);
-void add_read_trans(read_trans_t *r, trans_t t);
+trans_t *read_trans_new(read_trans_t *r);
+int read_trans_add_exon(read_trans_t *r, int tid, int start, int end, uint8_t is_rev);
+void add_read_trans(read_trans_t *r, trans_t *t);
 read_trans_t *read_trans_realloc(read_trans_t *r);
+void read_trans_shift(read_trans_t *r, int k);
 void novel_read_trans_free(read_trans_t *r);
 void read_trans_free(read_trans_t *r);
 //int set_read_trans(read_trans_t *r);
@@ -105,26 +135,29 @@ void read_trans_free(read_trans_t *r);
 intron_t *intron_init(int n);
 intron_group_t *intron_group_init(void);
 void add_intron(intron_group_t *i, intron_t i1);
-int read_intron_group(intron_group_t *I, FILE *fp);
+int read_intron_group(intron_group_t *I, FILE *fp, chr_name_t *cname);
+int intron_group_index(intron_group_t *I);
+int intron_group_get(const intron_group_t *I, int tid, uint8_t is_rev, int start, int end, int dis);
 
 void intron_group_free(intron_group_t *i);
 
 gene_t *gene_init(void);
 gene_t *copy_gene(gene_t *g);
-void add_trans(gene_t *g, trans_t t, int novel_gene_flag);
-gene_t *trans_realloc(gene_t *g);
+void add_trans(gene_t *g, trans_t *t, int novel_gene_flag);
 void gene_free(gene_t *g);
-void gtf_add_info(char add_info[], char tag[], char *info);
 
 gene_group_t *gene_group_init(void);
 gene_group_t *gene_group_realloc(gene_group_t *gg);
 void add_gene(gene_group_t *gg, gene_t g, int novel_gene_flag);
 void set_gene_group(gene_group_t *gg);
 void gene_group_free(gene_group_t *gg);
-int read_gene_group(char *fn, chr_name_t *cname, gene_group_t *gg);
+int read_gene_group(char *fn, chr_name_t *cname, int n_threads, gene_group_t *gg);
 
 int print_exon(exon_t e, FILE *out);
 int print_trans(trans_t t, bam_hdr_t *h, char *src, FILE *out);
+int sprint_trans(kstring_t *s, trans_t *t, bam_hdr_t *h, char *src);
+int sprint_read_trans1(kstring_t *s, trans_t *t, bam_hdr_t *h, char *src);
+int print_read_trans1(trans_t *t, bam_hdr_t *h, char *src, FILE *out);
 int print_read_trans(read_trans_t *anno_T, read_trans_t *novel_T, bam_hdr_t *h, char *src, FILE *out);
 void print_gene(FILE* out, char *src, gene_t *g, char **cname);
 void print_gene_group(gene_group_t gg, bam_hdr_t *h, char *src, FILE *out, char **group_line, int *group_line_n);
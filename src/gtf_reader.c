@@ -0,0 +1,196 @@
+/* gtf_reader.c
+ *   memory-mapped GTF reader
+ *   the file is cut into line-aligned chunks that are parsed in parallel,
+ *   records are then handed to the caller in file order
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gtf_reader.h"
+#include "utils.h"
+
+typedef struct {
+    const char *beg, *end;
+    gtf_rec_t *r; int rec_n, rec_m;
+} gtf_chunk_t;
+
+// copy attribute i into dst, dst is left untouched if the attribute is absent
+// @return value
+//    1: copied, possibly truncated to size-1 bytes
+//    0: absent
+int gtf_attr_cpy(char *dst, int size, const gtf_rec_t *r, int i)
+{
+    if (r->attr[i] == NULL) return 0;
+    int l = r->attr_l[i] < size ? r->attr_l[i] : size-1;
+    memcpy(dst, r->attr[i], l); dst[l] = '\0';
+    return 1;
+}
+
+static int gtf_attr_key(const char *k, int l)
+{
+    switch (l) {
+        case 7:  return memcmp(k, "gene_id", 7) == 0 ? GTF_GENE_ID : -1;
+        case 9:  return memcmp(k, "gene_name", 9) == 0 ? GTF_GENE_NAME : -1;
+        case 13: return memcmp(k, "transcript_id", 13) == 0 ? GTF_TRANS_ID : -1;
+        case 15: return memcmp(k, "transcript_name", 15) == 0 ? GTF_TRANS_NAME : -1;
+        default: return -1;
+    }
+}
+
+// single pass over `key "value"; key value; ...'
+static void gtf_parse_attr(const char *p, const char *end, gtf_rec_t *r)
+{
+    const char *k, *v; int k_l, v_l, i;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ';')) ++p;
+        k = p;
+        while (p < end && *p != ' ' && *p != '"' && *p != ';') ++p;
+        k_l = p - k;
+        while (p < end && *p == ' ') ++p;
+        if (p < end && *p == '"') {
+            v = ++p;
+            while (p < end && *p != '"') ++p;
+            v_l = p - v;
+            if (p < end) ++p;
+        } else {
+            v = p;
+            while (p < end && *p != ';') ++p;
+            for (v_l = p - v; v_l > 0 && v[v_l-1] == ' '; --v_l);
+        }
+        if ((i = gtf_attr_key(k, k_l)) >= 0 && r->attr[i] == NULL)
+            r->attr[i] = v, r->attr_l[i] = v_l;
+    }
+}
+
+static inline int gtf_parse_int(const char *p, const char *end)
+{
+    int x = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) x = x * 10 + (*p - '0');
+    return x;
+}
+
+// @return value
+//    1: r is filled
+//    0: comment, malformed line or unused feature type
+static int gtf_parse_line(const char *p, const char *end, gtf_rec_t *r)
+{
+    const char *f[9]; int i, f_n = 0;
+    if (end > p && end[-1] == '\r') --end;
+    if (p == end || *p == '#') return 0;
+    f[f_n++] = p;
+    while (f_n < 9 && (p = memchr(p, '\t', end - p)) != NULL) f[f_n++] = ++p;
+    if (f_n < 8) return 0;
+
+    int type_l = f[3] - f[2] - 1;
+    if (type_l == 4 && memcmp(f[2], "exon", 4) == 0) r->type = GTF_EXON;
+    else if (type_l == 10 && memcmp(f[2], "transcript", 10) == 0) r->type = GTF_TRANS;
+    else if (type_l == 4 && memcmp(f[2], "gene", 4) == 0) r->type = GTF_GENE;
+    else return 0;
+
+    r->ref = f[0]; r->ref_l = f[1] - f[0] - 1;
+    r->start = gtf_parse_int(f[3], f[4]); r->end = gtf_parse_int(f[4], f[5]);
+    r->is_rev = (*f[6] == '-');
+    for (i = 0; i < GTF_ATTR_N; ++i) r->attr[i] = NULL, r->attr_l[i] = 0;
+    if (f_n == 9) gtf_parse_attr(f[8], end, r);
+    return 1;
+}
+
+static void *gtf_parse_chunk(void *arg)
+{
+    gtf_chunk_t *c = (gtf_chunk_t*)arg;
+    const char *p = c->beg, *q;
+    c->rec_n = 0;
+    while (p < c->end) {
+        if ((q = memchr(p, '\n', c->end - p)) == NULL) q = c->end;
+        if (c->rec_n == c->rec_m) _realloc(c->r, c->rec_m, gtf_rec_t)
+        c->rec_n += gtf_parse_line(p, q, c->r + c->rec_n);
+        p = q + 1;
+    }
+    return NULL;
+}
+
+// whole file in memory: mmap for regular files, read() for pipes
+static char *gtf_map(const char *fn, size_t *len, int *is_mmap)
+{
+    int fd = strcmp(fn, "-") == 0 ? STDIN_FILENO : open(fn, O_RDONLY);
+    if (fd < 0) err_fatal(__func__, "Can not open GTF file \"%s\"\n", fn);
+    struct stat st; char *buf = NULL;
+    *len = 0; *is_mmap = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) { if (fd != STDIN_FILENO) close(fd); return NULL; }
+        buf = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf != MAP_FAILED) {
+            madvise(buf, st.st_size, MADV_SEQUENTIAL);
+            *len = st.st_size; *is_mmap = 1;
+            if (fd != STDIN_FILENO) close(fd);
+            return buf;
+        }
+    }
+    size_t m = 0x100000; ssize_t l;
+    buf = (char*)_err_malloc(m);
+    while ((l = read(fd, buf + *len, m - *len)) > 0) {
+        *len += l;
+        if (*len == m) { m <<= 1; buf = (char*)_err_realloc(buf, m); }
+    }
+    if (l < 0) err_fatal(__func__, "fail to read GTF file \"%s\"\n", fn);
+    if (fd != STDIN_FILENO) close(fd);
+    return buf;
+}
+
+// parse fn with n_threads, call func() on each gene/transcript/exon line
+// chromosome names are resolved in cname, unknown names are added if add_chr
+// @return value
+//    number of records
+int gtf_read(const char *fn, chr_name_t *cname, int add_chr, int n_threads, gtf_rec_f func, void *data)
+{
+    size_t len; int is_mmap;
+    char *buf = gtf_map(fn, &len, &is_mmap);
+    if (n_threads < 1) n_threads = 1;
+
+    int i, rec_n = 0, last_tid = -1; kstring_t ref = {0, 0, 0}; ref.l = (size_t)-1;
+    gtf_chunk_t *c = (gtf_chunk_t*)_err_calloc(n_threads, sizeof(gtf_chunk_t));
+    pthread_t *tid = (pthread_t*)_err_malloc(n_threads * sizeof(pthread_t));
+    for (i = 0; i < n_threads; ++i) {
+        c[i].rec_m = 1024;
+        c[i].r = (gtf_rec_t*)_err_malloc(c[i].rec_m * sizeof(gtf_rec_t));
+    }
+    const char *p = buf, *end = buf + len;
+    while (p < end) {
+        // cut up to n_threads chunks at line boundaries
+        int c_n = 0;
+        while (c_n < n_threads && p < end) {
+            const char *e = end - p > GTF_CHUNK_SIZE ? p + GTF_CHUNK_SIZE : end;
+            if (e < end && (e = memchr(e, '\n', end - e)) == NULL) e = end;
+            c[c_n].beg = p, c[c_n].end = e;
+            p = e < end ? e + 1 : end;
+            c_n++;
+        }
+        for (i = 1; i < c_n; ++i) pthread_create(tid+i, NULL, gtf_parse_chunk, c+i);
+        gtf_parse_chunk(c);
+        for (i = 1; i < c_n; ++i) pthread_join(tid[i], NULL);
+
+        // hand out in file order, consecutive lines mostly share the same ref
+        for (i = 0; i < c_n; ++i) {
+            int j;
+            for (j = 0; j < c[i].rec_n; ++j) {
+                gtf_rec_t *r = c[i].r + j;
+                if ((size_t)r->ref_l != ref.l || memcmp(r->ref, ref.s, ref.l) != 0) {
+                    ref.l = 0; kputsn(r->ref, r->ref_l, &ref);
+                    last_tid = add_chr ? get_chr_id(cname, ref.s) : chr_name_id(cname, ref.s);
+                }
+                func(r, last_tid, data);
+            }
+            rec_n += c[i].rec_n;
+        }
+    }
+    for (i = 0; i < n_threads; ++i) free(c[i].r);
+    free(c); free(tid); free(ref.s);
+    if (is_mmap) munmap(buf, len); else free(buf);
+    return rec_n;
+}
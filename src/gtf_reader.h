@@ -0,0 +1,36 @@
+#ifndef _GTF_READER_H
+#define _GTF_READER_H
+#include <stdint.h>
+#include "gtf.h"
+
+#define GTF_CHUNK_SIZE 0x800000 // 8M bytes of GTF text per parsing job
+
+// record types kept by the reader, other features are skipped
+#define GTF_GENE  1
+#define GTF_TRANS 2
+#define GTF_EXON  3
+
+// attributes pulled out by the tokenizer
+#define GTF_GENE_ID    0
+#define GTF_GENE_NAME  1
+#define GTF_TRANS_ID   2
+#define GTF_TRANS_NAME 3
+#define GTF_ATTR_N     4
+
+// one GTF line, strings point into the input buffer and are NOT
+// NUL-terminated, they are only valid inside the callback
+typedef struct {
+    const char *ref; int ref_l;
+    uint8_t type, is_rev;
+    int32_t start, end; // 1-based
+    const char *attr[GTF_ATTR_N]; int attr_l[GTF_ATTR_N]; // NULL: absent
+} gtf_rec_t;
+
+// called on the calling thread for every record, in file order
+// tid is looked up in cname, -1 if unknown
+typedef void (*gtf_rec_f)(const gtf_rec_t *r, int tid, void *data);
+
+int gtf_attr_cpy(char *dst, int size, const gtf_rec_t *r, int i);
+int gtf_read(const char *fn, chr_name_t *cname, int add_chr, int n_threads, gtf_rec_f func, void *data);
+
+#endif
@@ -0,0 +1,350 @@
+/* gtf_sort.c
+ *   external-memory GTF sorting
+ *   gene lines and transcript blocks are buffered up to a memory budget,
+ *   sorted by several threads, spilled as compressed runs to temporary
+ *   files and k-way merged into the output
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "gtf_sort.h"
+#include "utils.h"
+#include "kseq.h"
+#include "htslib/sam.h"
+
+KSTREAM_INIT(gzFile, gzread, 0x10000)
+
+extern const char PROG[20];
+
+gtf_sort_t *gtf_sort_init(chr_name_t *cname, int64_t max_mem, int n_threads, const char *prefix)
+{
+    gtf_sort_t *s = (gtf_sort_t*)_err_calloc(1, sizeof(gtf_sort_t));
+    if (cname) s->cname = cname;
+    else s->cname = chr_name_init(), s->own_cname = 1;
+    s->max_mem = max_mem > 0 ? max_mem : GTF_SORT_MEM;
+    s->n_threads = n_threads > 0 ? n_threads : 1;
+    s->prefix = strdup(prefix ? prefix : "gtools_sort");
+    return s;
+}
+
+void gtf_sort_destroy(gtf_sort_t *s)
+{
+    int i;
+    if (s == NULL) return;
+    for (i = 0; i < s->fd_n; ++i) close(s->fd[i]);
+    free(s->fd); free(s->head.s); free(s->text.s); free(s->b); free(s->prefix);
+    if (s->own_cname) chr_name_free(s->cname);
+    free(s);
+}
+
+static inline int gtf_block_comp(const gtf_block_t *a, const gtf_block_t *b)
+{
+    if (a->tid != b->tid) return a->tid < b->tid ? -1 : 1;
+    if (a->start != b->start) return a->start < b->start ? -1 : 1;
+    if (a->rank != b->rank) return a->rank - b->rank;
+    if (a->end != b->end) return a->end < b->end ? -1 : 1;
+    return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static int gtf_block_qcomp(const void *a, const void *b)
+{
+    return gtf_block_comp((const gtf_block_t*)a, (const gtf_block_t*)b);
+}
+
+// head of an in-memory sorted part or of a spilled run
+typedef struct {
+    gtf_block_t *b, *end; const char *text; // in-memory part
+    gzFile fp; kstring_t str;               // run
+    gtf_block_t cur; const char *s;         // current block and its text
+} gtf_src_t;
+
+// @return value
+//    1: next block is in src->cur, 0: src is exhausted
+static int gtf_src_next(gtf_src_t *src)
+{
+    if (src->fp == NULL) {
+        if (src->b == src->end) return 0;
+        src->cur = *src->b, src->s = src->text + src->b->off;
+        src->b++;
+        return 1;
+    }
+    int ret = gzread(src->fp, &src->cur, sizeof(gtf_block_t));
+    if (ret == 0) return 0;
+    if (ret != sizeof(gtf_block_t)) err_fatal_simple("failed to read temporary file.\n");
+    ks_resize(&src->str, src->cur.len);
+    if (gzread(src->fp, src->str.s, src->cur.len) != src->cur.len) err_fatal_simple("failed to read temporary file.\n");
+    src->s = src->str.s;
+    return 1;
+}
+
+static void gtf_heap_down(int *h, int n, int i, gtf_src_t *src)
+{
+    int tmp = h[i], k;
+    while ((k = (i << 1) + 1) < n) {
+        if (k + 1 < n && gtf_block_comp(&src[h[k+1]].cur, &src[h[k]].cur) < 0) ++k;
+        if (gtf_block_comp(&src[h[k]].cur, &src[tmp].cur) >= 0) break;
+        h[i] = h[k], i = k;
+    }
+    h[i] = tmp;
+}
+
+typedef void (*gtf_sort_out_f)(const gtf_block_t *b, const char *text, void *data);
+
+static void gtf_sort_out_run(const gtf_block_t *b, const char *text, void *data)
+{
+    gzFile fp = (gzFile)data;
+    if (gzwrite(fp, b, sizeof(gtf_block_t)) != sizeof(gtf_block_t) || gzwrite(fp, text, b->len) != b->len)
+        err_fatal_simple("failed to write temporary file.\n");
+}
+
+static void gtf_sort_out_text(const gtf_block_t *b, const char *text, void *data)
+{
+    err_fwrite(text, 1, b->len, (FILE*)data);
+}
+
+// k-way merge of sorted sources
+static void gtf_sort_merge(gtf_src_t *src, int n, gtf_sort_out_f out, void *data)
+{
+    int *h = (int*)_err_malloc((n > 0 ? n : 1) * sizeof(int)), h_n = 0, i;
+    for (i = 0; i < n; ++i)
+        if (gtf_src_next(src+i)) h[h_n++] = i;
+    for (i = h_n/2 - 1; i >= 0; --i) gtf_heap_down(h, h_n, i, src);
+    while (h_n > 0) {
+        gtf_src_t *x = src + h[0];
+        out(&x->cur, x->s, data);
+        if (gtf_src_next(x) == 0) h[0] = h[--h_n];
+        gtf_heap_down(h, h_n, 0, src);
+    }
+    free(h);
+}
+
+typedef struct {
+    gtf_block_t *b; int64_t n;
+} gtf_sort_job_t;
+
+static void *gtf_sort_job(void *data)
+{
+    gtf_sort_job_t *j = (gtf_sort_job_t*)data;
+    qsort(j->b, j->n, sizeof(gtf_block_t), gtf_block_qcomp);
+    return NULL;
+}
+
+// sort buffered blocks as up to n_threads parts in parallel, one source per part
+static int gtf_sort_parts(gtf_sort_t *s, gtf_src_t *src)
+{
+    int i, n = s->n_threads;
+    if (n > s->b_n / 1024 + 1) n = s->b_n / 1024 + 1;
+    gtf_sort_job_t *j = (gtf_sort_job_t*)_err_malloc(n * sizeof(gtf_sort_job_t));
+    pthread_t *tid = (pthread_t*)_err_malloc(n * sizeof(pthread_t));
+    for (i = 0; i < n; ++i) {
+        j[i].b = s->b + s->b_n * i / n;
+        j[i].n = s->b_n * (i+1) / n - s->b_n * i / n;
+    }
+    for (i = 1; i < n; ++i) pthread_create(tid+i, NULL, gtf_sort_job, j+i);
+    gtf_sort_job(j);
+    for (i = 1; i < n; ++i) pthread_join(tid[i], NULL);
+    memset(src, 0, n * sizeof(gtf_src_t));
+    for (i = 0; i < n; ++i)
+        src[i].b = j[i].b, src[i].end = j[i].b + j[i].n, src[i].text = s->text.s;
+    free(j); free(tid);
+    return n;
+}
+
+// sort buffered blocks and write them as one compressed run
+static void gtf_sort_spill(gtf_sort_t *s)
+{
+    gtf_src_t *src = (gtf_src_t*)_err_malloc(s->n_threads * sizeof(gtf_src_t));
+    char *fn = (char*)_err_malloc(strlen(s->prefix) + 16);
+    int n, fd;
+    sprintf(fn, "%s.%04d.XXXXXX", s->prefix, s->fd_n % 10000);
+    if ((fd = mkstemp(fn)) < 0) err_fatal(__func__, "failed to create temporary file \"%s\".\n", fn);
+    unlink(fn);
+    gzFile fp = gzdopen(dup(fd), "wb1");
+    if (fp == NULL) err_fatal(__func__, "failed to open temporary file \"%s\".\n", fn);
+
+    n = gtf_sort_parts(s, src);
+    gtf_sort_merge(src, n, gtf_sort_out_run, fp);
+    if (gzclose(fp) != Z_OK) err_fatal(__func__, "failed to write temporary file \"%s\".\n", fn);
+    if (s->fd_n == s->fd_m) {
+        s->fd_m = s->fd_m ? s->fd_m << 1 : 16;
+        s->fd = (int*)_err_realloc(s->fd, s->fd_m * sizeof(int));
+    }
+    s->fd[s->fd_n++] = fd;
+    s->b_n = 0, s->text.l = 0;
+    free(src); free(fn);
+}
+
+// one GTF line, a trailing newline is optional
+// gene and transcript lines start a new block, other lines go to the current one
+int gtf_sort_push_line(gtf_sort_t *s, const char *line, int len)
+{
+    const char *p[5]; int i, k = 0; char chr[1024];
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) --len;
+    if (len == 0) return 0;
+    if (line[0] == '#') {
+        kputsn(line, len, &s->head); kputc('\n', &s->head);
+        return 0;
+    }
+    p[k++] = line;
+    for (i = 0; i < len && k < 5; ++i)
+        if (line[i] == '\t') p[k++] = line + i + 1;
+    if (k < 5) err_fatal(__func__, "GTF format error: \"%.*s\".\n", len, line);
+
+    int feat_l = p[3] - p[2] - 1;
+    int is_gene = feat_l == 4 && strncmp(p[2], "gene", 4) == 0;
+    int is_trans = feat_l == 10 && strncmp(p[2], "transcript", 10) == 0;
+    if (is_gene || is_trans || s->b_n == 0) {
+        int chr_l = p[1] - p[0] - 1;
+        if (chr_l >= 1024) err_fatal(__func__, "sequence name is too long: \"%.*s\".\n", len, line);
+        if (s->b_n > 0 && s->text.l + (s->b_n + 1) * sizeof(gtf_block_t) > (size_t)s->max_mem)
+            gtf_sort_spill(s);
+        if (s->b_n == s->b_m) {
+            s->b_m = s->b_m ? s->b_m << 1 : 1024;
+            s->b = (gtf_block_t*)_err_realloc(s->b, s->b_m * sizeof(gtf_block_t));
+        }
+        gtf_block_t *b = s->b + s->b_n++;
+        memcpy(chr, p[0], chr_l); chr[chr_l] = '\0';
+        b->tid = get_chr_id(s->cname, chr);
+        b->start = atoi(p[3]), b->end = atoi(p[4]), b->rank = is_gene ? 0 : 1;
+        b->seq = s->seq++, b->off = s->text.l, b->len = 0;
+    }
+    kputsn(line, len, &s->text); kputc('\n', &s->text);
+    s->b[s->b_n-1].len += len + 1;
+    return 0;
+}
+
+// complete lines of GTF text
+int gtf_sort_push(gtf_sort_t *s, const char *text, int64_t len)
+{
+    const char *p = text, *end = text + len, *q;
+    while (p < end) {
+        if ((q = memchr(p, '\n', end - p)) == NULL) q = end;
+        gtf_sort_push_line(s, p, q - p);
+        p = q + 1;
+    }
+    return 0;
+}
+
+// write comment lines and all blocks in order, s is empty afterwards
+int gtf_sort_write(gtf_sort_t *s, FILE *out)
+{
+    int i, n;
+    if (s->head.l > 0) err_fwrite(s->head.s, 1, s->head.l, out);
+    if (s->fd_n == 0) { // everything fits in memory
+        gtf_src_t *src = (gtf_src_t*)_err_malloc(s->n_threads * sizeof(gtf_src_t));
+        n = gtf_sort_parts(s, src);
+        gtf_sort_merge(src, n, gtf_sort_out_text, out);
+        free(src);
+    } else {
+        if (s->b_n > 0) gtf_sort_spill(s);
+        gtf_src_t *src = (gtf_src_t*)_err_calloc(s->fd_n, sizeof(gtf_src_t));
+        for (i = 0; i < s->fd_n; ++i) {
+            lseek(s->fd[i], 0, SEEK_SET);
+            if ((src[i].fp = gzdopen(dup(s->fd[i]), "rb")) == NULL) err_fatal_simple("failed to open temporary file.\n");
+        }
+        gtf_sort_merge(src, s->fd_n, gtf_sort_out_text, out);
+        for (i = 0; i < s->fd_n; ++i) {
+            gzclose(src[i].fp); free(src[i].str.s);
+            close(s->fd[i]);
+        }
+        free(src);
+    }
+    s->head.l = 0, s->text.l = 0, s->b_n = 0, s->fd_n = 0;
+    return 0;
+}
+
+// 768M, 2G, 500000 ...
+int64_t gtf_sort_parse_mem(const char *str)
+{
+    char *p; double x = strtod(str, &p);
+    if (*p == 'k' || *p == 'K') x *= 1e3;
+    else if (*p == 'm' || *p == 'M') x *= 1e6;
+    else if (*p == 'g' || *p == 'G') x *= 1e9;
+    return (int64_t)x;
+}
+
+const struct option sort_gtf_long_opt [] = {
+    { "ref-fai", 1, NULL, 'r' },
+    { "bam", 1, NULL, 'b' },
+    { "max-mem", 1, NULL, 'm' },
+    { "threads", 1, NULL, 't' },
+    { "tmp-prefix", 1, NULL, 'T' },
+    { "output", 1, NULL, 'o' },
+
+    { 0, 0, 0, 0 }
+};
+
+static int sort_gtf_usage(void)
+{
+    err_printf("\n");
+    err_printf("Usage:   %s sort-gtf [option] <in.gtf> > out.gtf\n\n", PROG);
+    err_printf("         sort gene lines and transcript blocks by sequence and position,\n");
+    err_printf("         exon lines stay with the transcript line they follow\n\n");
+    err_printf("Options:\n\n");
+    err_printf("         -r --ref-fai     [STR]    .fai index of the reference, gives the sequence order.\n");
+    err_printf("         -b --bam         [STR]    BAM/SAM file, its header gives the sequence order.\n");
+    err_printf("                                   sequences not listed follow in order of appearance. [order of appearance]\n");
+    err_printf("         -m --max-mem     [STR]    memory for buffered blocks, K/M/G suffix accepted. [768M]\n");
+    err_printf("         -t --threads     [INT]    number of sorting threads. [1]\n");
+    err_printf("         -T --tmp-prefix  [STR]    prefix of temporary files. [output file or ./gtools_sort]\n");
+    err_printf("         -o --output      [STR]    output GTF file. [stdout]\n");
+    err_printf("\n");
+    return 1;
+}
+
+int sort_gtf(int argc, char *argv[])
+{
+    int c, n_threads = 1; int64_t max_mem = GTF_SORT_MEM;
+    char *fai = NULL, *bam = NULL, *prefix = NULL, *out_fn = NULL;
+    while ((c = getopt_long(argc, argv, "r:b:m:t:T:o:", sort_gtf_long_opt, NULL)) >= 0) {
+        switch (c) {
+            case 'r': fai = optarg; break;
+            case 'b': bam = optarg; break;
+            case 'm': max_mem = gtf_sort_parse_mem(optarg); break;
+            case 't': n_threads = atoi(optarg); break;
+            case 'T': prefix = optarg; break;
+            case 'o': out_fn = optarg; break;
+            default: err_printf("Error: unknown option: %s.\n", optarg);
+                     return sort_gtf_usage();
+        }
+    }
+    if (argc - optind != 1) return sort_gtf_usage();
+
+    chr_name_t *cname = chr_name_init();
+    if (fai) {
+        FILE *fp = xopen(fai, "r"); char line[1024];
+        while (fgets(line, 1024, fp)) {
+            line[strcspn(line, "\t\n")] = '\0';
+            if (line[0]) get_chr_id(cname, line);
+        }
+        err_fclose(fp);
+    }
+    if (bam) {
+        samFile *in; bam_hdr_t *h;
+        if ((in = sam_open(bam, "rb")) == NULL) err_fatal(__func__, "Cannot open \"%s\"\n", bam);
+        if ((h = sam_hdr_read(in)) == NULL) err_fatal(__func__, "Couldn't read header for \"%s\"\n", bam);
+        bam_set_cname(h, cname);
+        bam_hdr_destroy(h); sam_close(in);
+    }
+
+    gzFile fp = strcmp(argv[optind], "-") == 0 ? gzdopen(fileno(stdin), "r") : gzopen(argv[optind], "r");
+    if (fp == NULL) err_fatal(__func__, "Cannot open \"%s\"\n", argv[optind]);
+    FILE *out = out_fn ? xopen(out_fn, "w") : stdout;
+    gtf_sort_t *s = gtf_sort_init(cname, max_mem, n_threads, prefix ? prefix : out_fn);
+
+    kstream_t *ks = ks_init(fp); kstring_t str = {0, 0, NULL}; int dret;
+    while (ks_getuntil(ks, KS_SEP_LINE, &str, &dret) >= 0)
+        gtf_sort_push_line(s, str.s, str.l);
+    if (s->fd_n > 0) err_func_format_printf(__func__, "merging %d temporary files ...\n", s->fd_n + (s->b_n > 0));
+    gtf_sort_write(s, out);
+
+    free(str.s); ks_destroy(ks); gzclose(fp);
+    gtf_sort_destroy(s); chr_name_free(cname);
+    err_fclose(out);
+    return 0;
+}
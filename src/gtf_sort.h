@@ -0,0 +1,36 @@
+#ifndef _GTF_SORT_H
+#define _GTF_SORT_H
+#include <stdio.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "gtf.h"
+#include "kstring.h"
+
+#define GTF_SORT_MEM 768000000 // default memory budget of buffered blocks
+
+// a gene line, or a transcript line with the lines that follow it
+// blocks are ordered by tid, start, rank, end and input order
+typedef struct {
+    int32_t tid, start, end, rank; // rank: 0 for gene, 1 otherwise
+    int64_t seq;
+    int64_t off; int32_t len;      // text in gtf_sort_t.text, or length in a run
+} gtf_block_t;
+
+typedef struct {
+    chr_name_t *cname; int own_cname; // tid follows cname, unknown names are appended
+    int64_t max_mem; int n_threads; char *prefix;
+    kstring_t head;                   // comment lines, written first
+    kstring_t text; gtf_block_t *b; int64_t b_n, b_m, seq;
+    int fd_n, fd_m, *fd;              // sorted runs spilled to unlinked temp files
+} gtf_sort_t;
+
+gtf_sort_t *gtf_sort_init(chr_name_t *cname, int64_t max_mem, int n_threads, const char *prefix);
+int gtf_sort_push_line(gtf_sort_t *s, const char *line, int len);
+int gtf_sort_push(gtf_sort_t *s, const char *text, int64_t len);
+int gtf_sort_write(gtf_sort_t *s, FILE *out);
+void gtf_sort_destroy(gtf_sort_t *s);
+int64_t gtf_sort_parse_mem(const char *str);
+
+int sort_gtf(int argc, char *argv[]);
+
+#endif
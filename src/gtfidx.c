@@ -0,0 +1,240 @@
+/* gtfidx.c
+ *   binary annotation snapshot
+ *   index-gtf parses a GTF once and writes transcripts, exons, interned
+ *   names and the transcript interval index; later runs map the snapshot
+ *   and copy out what they need instead of parsing text
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gtfidx.h"
+#include "bam2gtf.h"
+#include "utils.h"
+
+extern const char PROG[20];
+
+static uint32_t gtfidx_crc(uint32_t crc, const void *p, size_t l)
+{
+    const Bytef *q = (const Bytef*)p;
+    while (l > 0) {
+        uInt x = l > 0x40000000 ? 0x40000000 : (uInt)l;
+        crc = crc32(crc, q, x); q += x; l -= x;
+    }
+    return crc;
+}
+
+// write one section, padded to 8 bytes
+static void gtfidx_put(FILE *fp, const void *p, size_t l, uint32_t *crc, int64_t *off)
+{
+    static const char pad[8] = {0};
+    if (l > 0) { err_fwrite(p, 1, l, fp); *crc = gtfidx_crc(*crc, p, l); *off += l; }
+    if (*off & 7) {
+        size_t x = 8 - (*off & 7);
+        err_fwrite(pad, 1, x, fp); *crc = gtfidx_crc(*crc, pad, x); *off += x;
+    }
+}
+
+// tids in T are ids of cname
+int gtfidx_write(const char *fn, read_trans_t *T, chr_name_t *cname)
+{
+    gtfidx_hdr_t hdr; memset(&hdr, 0, sizeof(hdr));
+    anno_idx_t *idx = anno_idx_build(T);
+    chr_name_t *pool = chr_name_init(); // interned strings, id => offset in str[]
+    int i, j;
+
+    gtfidx_chr_t *chr = (gtfidx_chr_t*)_err_calloc(cname->chr_n > 0 ? cname->chr_n : 1, sizeof(gtfidx_chr_t));
+    for (i = 0; i < cname->chr_n; ++i) {
+        chr[i].name = get_chr_id(pool, cname->chr_name[i]);
+        if (i < idx->chr_n) chr[i].itv_off = idx->off[i], chr[i].itv_n = idx->n[i], chr[i].lv = idx->lv[i];
+    }
+    gtfidx_trans_t *trans = (gtfidx_trans_t*)_err_calloc(T->trans_n > 0 ? T->trans_n : 1, sizeof(gtfidx_trans_t));
+    int64_t exon_n = 0;
+    for (i = 0; i < T->trans_n; ++i) {
+        trans_t *t = T->t + i; gtfidx_trans_t *x = trans + i;
+        x->exon_off = exon_n, x->exon_n = t->exon_n; exon_n += t->exon_n;
+        x->tid = t->tid, x->start = t->start, x->end = t->end, x->is_rev = t->is_rev;
+        x->gid = get_chr_id(pool, t->gid); x->gname = get_chr_id(pool, t->gname);
+        x->tname = get_chr_id(pool, t->tname); x->trans_id = get_chr_id(pool, t->trans_id);
+    }
+    gtfidx_exon_t *exon = (gtfidx_exon_t*)_err_malloc((exon_n > 0 ? exon_n : 1) * sizeof(gtfidx_exon_t));
+    for (i = 0; i < T->trans_n; ++i) {
+        gtfidx_exon_t *x = exon + trans[i].exon_off;
+        for (j = 0; j < T->t[i].exon_n; ++j) {
+            exon_t *e = T->t[i].exon + j;
+            x[j].tid = e->tid, x[j].start = e->start, x[j].end = e->end, x[j].is_rev = e->is_rev;
+        }
+    }
+    // string pool: ids are replaced by offsets
+    uint32_t *str_off = (uint32_t*)_err_malloc((pool->chr_n + 1) * sizeof(uint32_t));
+    kstring_t str = {0, 0, 0};
+    for (i = 0; i < pool->chr_n; ++i) {
+        str_off[i] = str.l;
+        kputsn(pool->chr_name[i], strlen(pool->chr_name[i]) + 1, &str);
+    }
+    for (i = 0; i < cname->chr_n; ++i) chr[i].name = str_off[chr[i].name];
+    for (i = 0; i < T->trans_n; ++i) {
+        trans[i].gid = str_off[trans[i].gid]; trans[i].gname = str_off[trans[i].gname];
+        trans[i].tname = str_off[trans[i].tname]; trans[i].trans_id = str_off[trans[i].trans_id];
+    }
+
+    FILE *fp = xopen(fn, "wb");
+    uint32_t crc = crc32(0L, Z_NULL, 0); int64_t off = sizeof(gtfidx_hdr_t);
+    err_fwrite(&hdr, sizeof(hdr), 1, fp); // placeholder
+    hdr.off_chr = off;   gtfidx_put(fp, chr, cname->chr_n * sizeof(gtfidx_chr_t), &crc, &off);
+    hdr.off_trans = off; gtfidx_put(fp, trans, T->trans_n * sizeof(gtfidx_trans_t), &crc, &off);
+    hdr.off_exon = off;  gtfidx_put(fp, exon, exon_n * sizeof(gtfidx_exon_t), &crc, &off);
+    hdr.off_itv = off;   gtfidx_put(fp, idx->itv, idx->itv_n * sizeof(anno_itv_t), &crc, &off);
+    hdr.off_str = off;   gtfidx_put(fp, str.s, str.l, &crc, &off);
+
+    memcpy(hdr.magic, GTFIDX_MAGIC, 8); hdr.version = GTFIDX_VERSION; hdr.crc = crc;
+    hdr.chr_n = cname->chr_n, hdr.trans_n = T->trans_n;
+    hdr.exon_n = exon_n, hdr.itv_n = idx->itv_n, hdr.str_l = str.l, hdr.size = off;
+    err_rewind(fp); err_fwrite(&hdr, sizeof(hdr), 1, fp);
+    err_fclose(fp);
+
+    free(chr); free(trans); free(exon); free(str_off); free(str.s);
+    chr_name_free(pool); anno_idx_destroy(idx);
+    return T->trans_n;
+}
+
+// 1: fn starts with the snapshot magic
+int gtfidx_is(const char *fn)
+{
+    char magic[8]; int ret = 0;
+    if (strcmp(fn, "-") == 0) return 0;
+    FILE *fp = fopen(fn, "rb");
+    if (fp == NULL) return 0;
+    if (fread(magic, 1, 8, fp) == 8 && memcmp(magic, GTFIDX_MAGIC, 8) == 0) ret = 1;
+    fclose(fp);
+    return ret;
+}
+
+gtfidx_t *gtfidx_load(const char *fn)
+{
+    int fd = open(fn, O_RDONLY); struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) err_fatal(__func__, "Can not open snapshot \"%s\"\n", fn);
+    if ((size_t)st.st_size < sizeof(gtfidx_hdr_t)) err_fatal(__func__, "truncated snapshot \"%s\"\n", fn);
+    gtfidx_t *x = (gtfidx_t*)_err_calloc(1, sizeof(gtfidx_t));
+    x->len = st.st_size;
+    x->buf = (char*)mmap(NULL, x->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (x->buf == MAP_FAILED) err_fatal(__func__, "fail to map snapshot \"%s\"\n", fn);
+
+    gtfidx_hdr_t *h = x->hdr = (gtfidx_hdr_t*)x->buf;
+    if (memcmp(h->magic, GTFIDX_MAGIC, 8) != 0) err_fatal(__func__, "\"%s\" is not a %s snapshot\n", fn, GTFIDX_SUFFIX);
+    if (h->version != GTFIDX_VERSION) err_fatal(__func__, "snapshot \"%s\" has version %u, expected %d. Please run index-gtf again.\n", fn, h->version, GTFIDX_VERSION);
+    if (h->size != (int64_t)x->len) err_fatal(__func__, "truncated snapshot \"%s\"\n", fn);
+    if (gtfidx_crc(crc32(0L, Z_NULL, 0), x->buf + sizeof(gtfidx_hdr_t), x->len - sizeof(gtfidx_hdr_t)) != h->crc)
+        err_fatal(__func__, "checksum mismatch in snapshot \"%s\". Please run index-gtf again.\n", fn);
+
+    x->chr = (gtfidx_chr_t*)(x->buf + h->off_chr);
+    x->trans = (gtfidx_trans_t*)(x->buf + h->off_trans);
+    x->exon = (gtfidx_exon_t*)(x->buf + h->off_exon);
+    x->itv = (anno_itv_t*)(x->buf + h->off_itv);
+    x->str = x->buf + h->off_str;
+    return x;
+}
+
+void gtfidx_close(gtfidx_t *x)
+{
+    if (x == NULL) return;
+    munmap(x->buf, x->len); free(x);
+}
+
+// snapshot tid => tid in cname, -1 if unknown
+static int *gtfidx_chr_map(gtfidx_t *x, chr_name_t *cname)
+{
+    int i, *map = (int*)_err_malloc((x->hdr->chr_n > 0 ? x->hdr->chr_n : 1) * sizeof(int));
+    for (i = 0; i < x->hdr->chr_n; ++i) map[i] = chr_name_id(cname, x->str + x->chr[i].name);
+    return map;
+}
+
+// same transcripts as read_anno_trans() on the source GTF
+// exons are stored sorted, so T is filled in place without add_anno_trans()
+int gtfidx_trans(gtfidx_t *x, chr_name_t *cname, read_trans_t *T)
+{
+    int i, j, *map = gtfidx_chr_map(x, cname);
+    while (T->trans_m < T->trans_n + x->hdr->trans_n) read_trans_realloc(T);
+    for (i = 0; i < x->hdr->trans_n; ++i) {
+        gtfidx_trans_t *r = x->trans + i; gtfidx_exon_t *e = x->exon + r->exon_off;
+        trans_t *t = read_trans_new(T);
+        t->tid = r->tid >= 0 ? map[r->tid] : -1; t->is_rev = r->is_rev;
+        t->start = r->start, t->end = r->end;
+        t->gid = str_pool_put(T->sp, x->str + r->gid), t->gname = str_pool_put(T->sp, x->str + r->gname);
+        t->tname = str_pool_put(T->sp, x->str + r->tname), t->trans_id = str_pool_put(T->sp, x->str + r->trans_id);
+        for (j = 0; j < r->exon_n; ++j)
+            read_trans_add_exon(T, e[j].tid >= 0 ? map[e[j].tid] : -1, e[j].start, e[j].end, e[j].is_rev);
+    }
+    free(map);
+    return T->trans_n;
+}
+
+// interval index on top of the mapped intervals, valid until gtfidx_close()
+anno_idx_t *gtfidx_anno_idx(gtfidx_t *x, chr_name_t *cname)
+{
+    int i, *map = gtfidx_chr_map(x, cname);
+    anno_idx_t *idx = (anno_idx_t*)_err_calloc(1, sizeof(anno_idx_t));
+    idx->chr_n = cname->chr_n;
+    idx->off = (int64_t*)_err_calloc(idx->chr_n + 1, sizeof(int64_t));
+    idx->n = (int32_t*)_err_calloc(idx->chr_n + 1, sizeof(int32_t));
+    idx->lv = (int32_t*)_err_calloc(idx->chr_n + 1, sizeof(int32_t));
+    for (i = 0; i < x->hdr->chr_n; ++i) {
+        if (map[i] < 0) continue;
+        idx->off[map[i]] = x->chr[i].itv_off, idx->n[map[i]] = x->chr[i].itv_n, idx->lv[map[i]] = x->chr[i].lv;
+    }
+    idx->itv = x->itv; idx->itv_n = x->hdr->itv_n; idx->own_itv = 0;
+    free(map);
+    return idx;
+}
+
+int index_gtf_usage(void)
+{
+    err_printf("\n");
+    err_printf("Usage:   %s index-gtf [option] <in.gtf>\n\n", PROG);
+    err_printf("Notice:  the snapshot can be given to update-gtf and filter in place of the GTF file.\n\n");
+    err_printf("Options:\n\n");
+    err_printf("         -o --output      [STR]    output snapshot. [<in.gtf>%s]\n", GTFIDX_SUFFIX);
+    err_printf("         -t --threads     [INT]    number of threads used to parse GTF file. [1]\n");
+    err_printf("\n");
+    return 1;
+}
+
+const struct option index_gtf_long_opt [] = {
+    { "output", 1, NULL, 'o' },
+    { "threads", 1, NULL, 't' },
+
+    { 0, 0, 0, 0}
+};
+
+int index_gtf(int argc, char *argv[])
+{
+    int c, n_threads = 1; char *out = NULL;
+    while ((c = getopt_long(argc, argv, "o:t:", index_gtf_long_opt, NULL)) >= 0) {
+        switch (c) {
+            case 'o': out = strdup(optarg); break;
+            case 't': n_threads = atoi(optarg); break;
+            default: err_printf("Error: unknown option: %s.\n", optarg);
+                     return index_gtf_usage();
+        }
+    }
+    if (argc - optind != 1) return index_gtf_usage();
+    if (out == NULL) {
+        out = (char*)_err_malloc(strlen(argv[optind]) + strlen(GTFIDX_SUFFIX) + 1);
+        strcpy(out, argv[optind]); strcat(out, GTFIDX_SUFFIX);
+    }
+
+    chr_name_t *cname = chr_name_init(); read_trans_t *T = read_trans_init();
+    read_anno_trans_core(argv[optind], cname, 1, n_threads, T);
+    gtfidx_write(out, T, cname);
+    err_func_format_printf(__func__, "%d transcripts on %d sequences written to \"%s\".\n", T->trans_n, cname->chr_n, out);
+
+    novel_read_trans_free(T); chr_name_free(cname); free(out);
+    return 0;
+}
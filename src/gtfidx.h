@@ -0,0 +1,53 @@
+#ifndef _GTFIDX_H
+#define _GTFIDX_H
+#include <stdint.h>
+#include "gtf.h"
+#include "anno_idx.h"
+
+#define GTFIDX_MAGIC   "GTFIDX\0\0"
+#define GTFIDX_VERSION 1
+#define GTFIDX_SUFFIX  ".gtfidx"
+
+// binary snapshot of an annotation, native byte order
+// header | chr[] | trans[] | exon[] | itv[] | str[], sections are 8-byte aligned
+typedef struct {
+    char magic[8];
+    uint32_t version, crc; // crc32 of all bytes after the header
+    int32_t chr_n, trans_n;
+    int64_t exon_n, itv_n, str_l;
+    int64_t off_chr, off_trans, off_exon, off_itv, off_str, size;
+} gtfidx_hdr_t;
+
+typedef struct {
+    int64_t itv_off; int32_t itv_n, lv;
+    uint32_t name; int32_t dummy;
+} gtfidx_chr_t;
+
+typedef struct {
+    int64_t exon_off; int32_t exon_n;
+    int32_t tid, start, end, is_rev;
+    uint32_t gid, gname, tname, trans_id; // offsets in str[]
+    int32_t dummy;
+} gtfidx_trans_t;
+
+typedef struct {
+    int32_t tid, start, end, is_rev;
+} gtfidx_exon_t;
+
+typedef struct {
+    char *buf; size_t len; // whole mapped file
+    gtfidx_hdr_t *hdr;
+    gtfidx_chr_t *chr; gtfidx_trans_t *trans; gtfidx_exon_t *exon;
+    anno_itv_t *itv; char *str;
+} gtfidx_t;
+
+int gtfidx_is(const char *fn);
+gtfidx_t *gtfidx_load(const char *fn);
+void gtfidx_close(gtfidx_t *x);
+int gtfidx_trans(gtfidx_t *x, chr_name_t *cname, read_trans_t *T);
+anno_idx_t *gtfidx_anno_idx(gtfidx_t *x, chr_name_t *cname);
+int gtfidx_write(const char *fn, read_trans_t *T, chr_name_t *cname);
+
+int index_gtf(int argc, char *argv[]);
+
+#endif
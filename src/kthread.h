@@ -0,0 +1,16 @@
+#ifndef KTHREAD_H
+#define KTHREAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// func(data, i, tid) for i in [0, n), each thread takes every n_threads-th
+// item and steals from the thread with most items left once it is done
+void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
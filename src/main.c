@@ -6,6 +6,9 @@
 #include "update_gtf.h"
 #include "bam2gtf.h"
 #include "parse_bam.h"
+#include "gtfidx.h"
+#include "gtf_sort.h"
+#include "pipeline.h"
 
 const char PROG[20] = "gtools";
 
@@ -19,6 +22,9 @@ static int usage(void)
 	err_printf("         update-gtf   generate new GTF file based on BAM/SAM and existing GTF file\n");
 	err_printf("         bam2gtf      generate transcript and exon information based on BAM/SAM file\n");
 	err_printf("         bam2sj       generate splice-junction information based on BAM/SAM file\n");
+	err_printf("         index-gtf    build binary annotation snapshot for update-gtf and filter\n");
+	err_printf("         sort-gtf     sort GTF file by position, keeping transcript blocks together\n");
+	err_printf("         run          run filter, bam2sj, bam2gtf and update-gtf in one pass over BAM/SAM\n");
 	err_printf("\n");
 	return 1;
 }
@@ -31,6 +37,9 @@ int main(int argc, char *argv[])
 	else if (strcmp(argv[1], "update-gtf") == 0) return update_gtf(argc-1, argv+1);
 	else if (strcmp(argv[1], "bam2gtf") == 0) return bam2gtf(argc-1, argv+1);
     else if (strcmp(argv[1], "bam2sj") == 0) return bam2sj(argc-1, argv+1);
+    else if (strcmp(argv[1], "index-gtf") == 0) return index_gtf(argc-1, argv+1);
+    else if (strcmp(argv[1], "sort-gtf") == 0) return sort_gtf(argc-1, argv+1);
+    else if (strcmp(argv[1], "run") == 0) return run_pipeline(argc-1, argv+1);
 	else { fprintf(stderr, "[main] unrecognized command '%s'\n", argv[1]); return 1; }
     return 0;
 }
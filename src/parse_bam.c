@@ -12,6 +12,9 @@
 #include "gtf.h"
 #include "kseq.h"
 #include "kstring.h"
+#include "bam_shard.h"
+#include "genome.h"
+#include "bam_lite.h"
 
 extern const char PROG[20];
 const int intron_motif_n = 6;
@@ -24,33 +27,17 @@ const int intron_motif_strand[6] = {
     1, 2, 1, 2, 1, 2
 };
 
-typedef struct {
-    int n_threads;
-
-    int sam_n, tot_rep_n, *rep_n, fp_n;
-    uint8_t in_list; char **in_name; FILE **out_fp;
-
-    int module_type; int exon_num;
-
-    uint8_t fully:1, recur:1, no_novel_sj:1, only_novel:1, use_multi:1, read_type:1, merge_out:1, rm_edge:1;
-    uint8_t only_gtf, only_junc, no_novel_exon; FILE *gtf_fp;
-    int intron_len; double edge_wt;
-    int junc_cnt_min, novel_junc_cnt_min, exon_thres, iso_cnt_max; int asm_exon_max;//, iso_read_cnt_min;
-    int anchor_len[5]; // [anno, non-canonical, GT/AG, GC/AG, AT/AC]
-    int uniq_min[5];   // [anno, non-canonical, GT/AG, GC/AG, AT/AC]
-    int all_min[5];    // [anno, non-canonical, GT/AG, GC/AG, AT/AC]
-} sj_para;
-
 int bam2sj_usage(void)
 {
     err_printf("\n");
     err_printf("Usage:   %s bam2sj [option] <in.bam> > out.sj\n\n", PROG);
-    err_printf("Note:    in.bam should be sorted in advance\n\n");
     err_printf("Input Options:\n\n");
     err_printf("         -G --gtf-anno    [STR]    GTF annotation file, indicating known splice-junctions. \n");
     err_printf("         -g --genome-file [STR]    genome.fa. Use genome sequence to classify intron-motif. \n");
     err_printf("                                   If no genome file is give, intron-motif will be set as 0\n");
     err_printf("                                   (non-canonical) [None]\n");
+    err_printf("         -C --genome-cache [INT]   number of chromosomes kept in memory when genome.fa is indexed\n");
+    err_printf("                                   by samtools faidx (.fai). [%d]\n", GENOME_CACHE_N);
     err_printf("\nFilter Options:\n\n");
     err_printf("         -p --prop-pair            set -p to force to filter out reads mapped in improper pair. [False]\n");
     err_printf("         -a --anchor-len  [INT,INT,INT,INT,INT]\n");
@@ -64,13 +51,16 @@ int bam2sj_usage(void)
     err_printf("                                   read, [annotated, non-canonical, GT/AG, GC/AG, AT/AC].\n");
     err_printf("                                   [%d,%d,%d,%d,%d]\n", ALL_MIN, NON_ALL_MIN, ALL_MIN1, ALL_MIN2, ALL_MIN3);
     err_printf("         -i --intron-len  [INT]    minimum intron length for junction read. [%d]\n", INTRON_MIN_LEN);
+    err_printf("\nOther Options:\n\n");
+    err_printf("         -t --threads     [INT]    number of threads. With a BAM index, each reference is processed\n");
+    err_printf("                                   by its own thread. [1]\n");
 	err_printf("\n");
 	return 1;
 }
 
 sj_para *sj_init_para(void)
 {
-    sj_para *sjp = (sj_para*)_err_malloc(sizeof(sj_para));
+    sj_para *sjp = (sj_para*)_err_calloc(1, sizeof(sj_para));
 
     sjp->n_threads = 1;
     sjp->use_multi = 0; sjp->read_type = PAIR_T;
@@ -217,10 +207,12 @@ const struct option bam2sj_long_opt [] = {
     { "proper-pair", 1, NULL, 'p' },
     { "gtf-anno", 1, NULL, 'G' },
     { "genome-file", 1, NULL, 'g' },
+    { "genome-cache", 1, NULL, 'C' },
     { "anchor-len", 1, NULL, 'a' },
     { "uniq-map", 1, NULL, 'U' },
     { "all-map", 1, NULL, 'A' },
     { "intron-len", 1, NULL, 'i' },
+    { "threads", 1, NULL, 't' },
 
     { 0, 0, 0, 0}
 };
@@ -247,14 +239,6 @@ uint8_t bam_is_uniq_NH(bam1_t *b)
     return (bam_aux2i(p) == 1);
 }
 
-int bam_cigar_opn(int n_cigar, const uint32_t *cigar, uint32_t op, uint32_t len)
-{
-    int i, j;
-    for (i = j = 0; i < n_cigar; ++i)
-        if (bam_cigar_op(cigar[i]) == op && bam_cigar_oplen(cigar[i]) >= len) ++j;
-    return j;
-}
-
 int add_sj(sj_t **sj, int sj_i, int *sj_m, int tid, int don, int acc, uint8_t strand, uint8_t motif_i, uint8_t is_anno, uint8_t is_uniq)
 {
     if (sj_i == *sj_m) {
@@ -291,16 +275,17 @@ ad_t *ad_init(int n) {
     return ad;
 }
 
-uint8_t intr_deri_str(kseq_t *seq, int seq_n, int tid, int start, int end, uint8_t *motif_i)
+uint8_t intr_deri_str(genome_t *g, int tid, int start, int end, uint8_t *motif_i)
 {
     *motif_i = 0;
-    if (seq_n == 0) return 0;
-    if (tid >= seq_n) err_fatal(__func__, "unknown tid: %d\n", tid); 
+    if (g == NULL) return 0;
+    int len; const char *seq = genome_chr(g, tid, &len);
+    if (start < 1 || end > len || end - start < 1) return 0;
     char intron[10]="";
-    intron[0] = toupper(seq[tid].seq.s[start-1]);
-    intron[1] = toupper(seq[tid].seq.s[start]);
-    intron[2] = toupper(seq[tid].seq.s[end-2]);
-    intron[3] = toupper(seq[tid].seq.s[end-1]);
+    intron[0] = toupper(seq[start-1]);
+    intron[1] = toupper(seq[start]);
+    intron[2] = toupper(seq[end-2]);
+    intron[3] = toupper(seq[end-1]);
     int i;
     for (i = 0; i < intron_motif_n; ++i) {
         if (strcmp(intron, intron_motif[i]) == 0) {
@@ -311,47 +296,85 @@ uint8_t intr_deri_str(kseq_t *seq, int seq_n, int tid, int start, int end, uint8
     return 0;
 }
 
-int sj_sch_group(sj_t *SJ, int SJ_n, sj_t sj, int *hit)
+// splice-junction hash: open addressing over the packed (tid, don, acc)
+// junctions are kept in insertion order, sorted once by sj_hash_sort()
+static inline uint64_t sj_hash_key(int32_t tid, int32_t don, int32_t acc)
+{
+    return hash_64(((uint64_t)(uint32_t)tid << 32 | (uint32_t)don) ^ ((uint64_t)(uint32_t)acc * 0x9E3779B97F4A7C15ULL));
+}
+
+sj_hash_t *sj_hash_init(void)
+{
+    sj_hash_t *H = (sj_hash_t*)_err_malloc(sizeof(sj_hash_t));
+    H->sj_n = 0, H->sj_m = 1024;
+    H->sj = (sj_t*)_err_malloc(H->sj_m * sizeof(sj_t));
+    H->h_m = 2048;
+    H->h = (int32_t*)_err_malloc(H->h_m * sizeof(int32_t));
+    memset(H->h, 0xff, H->h_m * sizeof(int32_t));
+    return H;
+}
+
+void sj_hash_free(sj_hash_t *H)
 {
-    *hit = 0;
-    if (SJ_n == 0) return 0;
+    free(H->sj); free(H->h); free(H);
+}
 
-    int i; int tid, don, acc;
-    for (i = SJ_n-1; i >= 0; i--) {
-        tid = SJ[i].tid, don = SJ[i].don, acc = SJ[i].acc;
-        if (tid == sj.tid &&  don == sj.don && acc == sj.acc) { *hit = 1; return i; }
-        else if (tid < sj.tid || don < sj.don || (don == sj.don && acc < sj.acc)) return i+1; // SJ[i] < sj
+static void sj_hash_rehash(sj_hash_t *H)
+{
+    int i; uint32_t k, mask;
+    H->h_m <<= 1; mask = H->h_m - 1;
+    H->h = (int32_t*)_err_realloc(H->h, H->h_m * sizeof(int32_t));
+    memset(H->h, 0xff, H->h_m * sizeof(int32_t));
+    for (i = 0; i < H->sj_n; ++i) {
+        k = sj_hash_key(H->sj[i].tid, H->sj[i].don, H->sj[i].acc) & mask;
+        while (H->h[k] >= 0) k = (k + 1) & mask;
+        H->h[k] = i;
     }
-    return 0;
 }
 
-int sj_update_group(sj_t **SJ_group, int *SJ_n, int *SJ_m, sj_t *sj, int sj_n)
+void sj_hash_add(sj_hash_t *H, sj_t *sj, int sj_n)
 {
-    if (sj_n + *SJ_n > *SJ_m) _realloc(*SJ_group, *SJ_m, sj_t)
-    int i, hit=0;
+    int i; uint32_t k, mask;
     for (i = 0; i < sj_n; ++i) {
-        int sj_i = sj_sch_group(*SJ_group, *SJ_n, sj[i], &hit);
-        if (hit == 0) {
-            if ((*SJ_n)++ >= *SJ_m) _realloc(*SJ_group, *SJ_m, sj_t)
-            // memmove
-            if (sj_i <= *SJ_n-2)
-                memmove(*SJ_group+sj_i+1, *SJ_group+sj_i, (*SJ_n-sj_i-1) * sizeof(sj_t));
-            // set sj
-            (*SJ_group)[sj_i].tid = sj[i].tid;
-            (*SJ_group)[sj_i].don = sj[i].don;
-            (*SJ_group)[sj_i].acc = sj[i].acc;
-            (*SJ_group)[sj_i].strand = sj[i].strand;
-            (*SJ_group)[sj_i].motif = sj[i].motif;
-            (*SJ_group)[sj_i].is_anno = sj[i].is_anno;
-            (*SJ_group)[sj_i].uniq_c = sj[i].uniq_c;
-            (*SJ_group)[sj_i].multi_c = sj[i].multi_c;
+        if ((H->sj_n + 1) * 4 > H->h_m * 3) sj_hash_rehash(H); // load factor 0.75
+        mask = H->h_m - 1;
+        k = sj_hash_key(sj[i].tid, sj[i].don, sj[i].acc) & mask;
+        while (H->h[k] >= 0) {
+            sj_t *hit = H->sj + H->h[k];
+            if (hit->tid == sj[i].tid && hit->don == sj[i].don && hit->acc == sj[i].acc) break;
+            k = (k + 1) & mask;
+        }
+        if (H->h[k] < 0) {
+            if (H->sj_n == H->sj_m) _realloc(H->sj, H->sj_m, sj_t)
+            H->sj[H->sj_n] = sj[i];
+            H->h[k] = H->sj_n++;
         } else {
-            (*SJ_group)[sj_i].uniq_c += sj[i].uniq_c;
-            (*SJ_group)[sj_i].multi_c += sj[i].multi_c;
-            if ((*SJ_group)[sj_i].strand != sj[i].strand) (*SJ_group)[sj_i].strand = 0; // undefined
+            sj_t *hit = H->sj + H->h[k];
+            hit->uniq_c += sj[i].uniq_c;
+            hit->multi_c += sj[i].multi_c;
+            if (hit->strand != sj[i].strand) hit->strand = 0; // undefined
         }
     }
-    return 0;
+}
+
+// sort junctions by (tid, don, acc), no more junctions can be added afterwards
+int sj_hash_sort(sj_hash_t *H)
+{
+    qsort(H->sj, H->sj_n, sizeof(sj_t), sj_group_comp);
+    memset(H->h, 0xff, H->h_m * sizeof(int32_t));
+    return H->sj_n;
+}
+
+// classify intron-motif and strand once per unique junction
+// sj is sorted by (tid, don, acc), so the genome is walked sequentially
+void sj_group_motif(sj_t *sj, int sj_n, genome_t *g)
+{
+    if (g == NULL) return;
+    int i; uint8_t motif_i;
+    for (i = 0; i < sj_n; ++i) {
+        sj[i].strand = intr_deri_str(g, sj[i].tid, sj[i].don, sj[i].acc, &motif_i);
+        sj[i].motif = motif_i;
+    }
 }
 
 kseq_t *kseq_load_genome(gzFile genome_fp, int *_seq_n, int *_seq_m)
@@ -374,45 +397,18 @@ kseq_t *kseq_load_genome(gzFile genome_fp, int *_seq_n, int *_seq_m)
     return seq;
 }
 
-int gen_sj(uint8_t is_uniq, int tid, int start, int n_cigar, uint32_t *c, kseq_t *seq, int seq_n, sj_t **sj, int *sj_m, sj_para *sjp)
+int gen_sj(uint8_t is_uniq, const cigar_walk_t *w, genome_t *g, sj_t **sj, int *sj_m, sj_para *sjp)
 {
-    int end = start - 1; /* 1-base */
     uint8_t strand, motif_i;
-    
-    int i; int min_intr_len = sjp->intron_len, sj_i = 0;
-
-    for (i = 0; i < n_cigar; ++i) {
-        int l = bam_cigar_oplen(c[i]);
-        switch (bam_cigar_op(c[i])) {
-            case BAM_CREF_SKIP: // N(0 1)
-                if (l >= min_intr_len) {
-                    strand = intr_deri_str(seq, seq_n, tid, end+1, end+l, &motif_i);
-                    // filter with anchor length
-                    add_sj(sj, sj_i, sj_m, tid, end+1, end+l, strand, motif_i, 1, is_uniq); ++sj_i;
-                    start = end+l+1;
-                }
-                end += l;
-                break;
-            case BAM_CMATCH: // 1 1
-            case BAM_CEQUAL:
-            case BAM_CDIFF:
-                end += l;
-                break;
-            case BAM_CDEL : // D(0 1)
-                end += l;
-                break; // only M&N allowed
-            case BAM_CINS: // 1 0
-            case BAM_CSOFT_CLIP:
-            case BAM_CHARD_CLIP:
-            case BAM_CPAD: // 0 0
-            case BAM_CBACK:
-                break; // only M&N allowed
-            default:
-                err_printf("Error: unknown cigar type: %d.\n", bam_cigar_op(c[i]));
-                break;
-        }
-    }
+    int i, min_intr_len = sjp->intron_len, sj_i = 0;
 
+    for (i = 0; i < w->intr_n; ++i) {
+        const cigar_intr_t *in = w->intr + i;
+        if (cigar_intr_len(*in) < min_intr_len) continue;
+        strand = intr_deri_str(g, w->tid, in->don, in->acc, &motif_i);
+        // filter with anchor length
+        add_sj(sj, sj_i, sj_m, w->tid, in->don, in->acc, strand, motif_i, 1, is_uniq); ++sj_i;
+    }
     return sj_i;
 }
 
@@ -516,18 +512,13 @@ exon_t *infer_exon_coor(int *infer_e_n, exon_t *e, int e_n, int *don, int don_n)
 }
 
 // only junction-read are kept in AD_T
-int parse_bam(int tid, int start, int *_end, int n_cigar, const uint32_t *c, uint8_t is_uniq, kseq_t *seq, int seq_n, ad_t **ad_g, int *ad_n, int *ad_m, sj_t **sj, int *sj_n, int *sj_m, sj_para *sjp)
+int parse_bam(const cigar_walk_t *w, int *_end, uint8_t is_uniq, genome_t *g, ad_t **ad_g, int *ad_n, int *ad_m, sj_t **sj, int *sj_n, int *sj_m, sj_para *sjp)
 {
     int i, min_intr_len = sjp->intron_len, SJ_n, sj_i = 0;
 #ifdef _RMATS_
-    for (i = 0; i  < n_cigar; ++i) {
-        uint32_t op = bam_cigar_op(c[i]);
-        if (op != BAM_CMATCH && op != BAM_CREF_SKIP) return -1;
-        //&& op != BAM_CEQUAL && op != BAM_CDIFF) return 0;
-    }
+    if (!cigar_walk_is_MN(w)) return -1; // for rMATS, only M&N allowed
 #endif
-    SJ_n = bam_cigar_opn(n_cigar, c, BAM_CREF_SKIP, min_intr_len);
-    int end = start - 1; /* 1-base */
+    SJ_n = cigar_walk_intr_n(w, min_intr_len);
     uint8_t strand, motif_i;
 
     ad_t *ad;
@@ -537,57 +528,25 @@ int parse_bam(int tid, int start, int *_end, int n_cigar, const uint32_t *c, uin
     ad->intv_n = 0;
     ad->exon_end = (int*)_err_malloc((SJ_n+1) * sizeof(int));
     ad->intr_end = (int*)_err_malloc(SJ_n * sizeof(int));
-    ad->tid = tid; ad->start = start;
+    ad->tid = w->tid; ad->start = w->start;
     ad->is_uniq = is_uniq; ad->is_splice = 1;
     //}
-    for (i = 0; i < n_cigar; ++i) {
-        int l = bam_cigar_oplen(c[i]);
-        switch (bam_cigar_op(c[i])) {
-            case BAM_CREF_SKIP: // N(0 1)
-                if (l >= min_intr_len) {
-                    // sj
-                    strand = intr_deri_str(seq, seq_n, tid, end+1, end+l, &motif_i);
-                    add_sj(sj, sj_i, sj_m, tid, end+1, end+l, strand, motif_i, 1, is_uniq); ++sj_i;
-                    // ad
-                    ad->intr_end[ad->intv_n] = end+l;
-                    ad->exon_end[(ad->intv_n)++] = end;
-
-                    start = end+l+1;
-                }
-                end += l;
-                break;
-            case BAM_CMATCH: // 1 1
-            case BAM_CEQUAL:
-            case BAM_CDIFF:
-                end += l;
-                break;
-            case BAM_CDEL : // D(0 1)
-#ifdef _RMATS_
-                return 0; // for rMATS, only M&N allowed
-#else
-                end += l;
-                break;
-#endif
-            case BAM_CINS: // 1 0
-            case BAM_CSOFT_CLIP:
-            case BAM_CHARD_CLIP:
-            case BAM_CPAD: // 0 0
-            case BAM_CBACK:
-#ifdef _RMATS_
-                return 0; // for rMATS, only M&N allowed
-#endif
-                break; 
-            default:
-                err_printf("Error: unknown cigar type: %d.\n", bam_cigar_op(c[i]));
-                break;
-        }
-    }
-    *sj_n = SJ_n; *_end = end;
+    for (i = 0; i < w->intr_n; ++i) {
+        const cigar_intr_t *in = w->intr + i;
+        if (cigar_intr_len(*in) < min_intr_len) continue;
+        // sj
+        strand = intr_deri_str(g, w->tid, in->don, in->acc, &motif_i);
+        add_sj(sj, sj_i, sj_m, w->tid, in->don, in->acc, strand, motif_i, 1, is_uniq); ++sj_i;
+        // ad
+        ad->intr_end[ad->intv_n] = in->acc;
+        ad->exon_end[(ad->intv_n)++] = in->don - 1;
+    }
+    *sj_n = SJ_n; *_end = w->end;
 
     // ad
     //if (SJ_n > 0) {
-        ad->exon_end[(ad->intv_n)++] = end;
-        ad->end = end;
+        ad->exon_end[(ad->intv_n)++] = w->end;
+        ad->end = w->end;
         (*ad_n)++;
     //}
     return SJ_n;
@@ -638,18 +597,13 @@ void ad_copy(ad_t *dest, ad_t *src) {
     }
 }
 
-int bam2ad(int tid, int start, uint8_t is_uniq, int n_cigar, const uint32_t *c, ad_t *ad, sj_para *sjp)
+int bam2ad(const cigar_walk_t *w, uint8_t is_uniq, ad_t *ad, sj_para *sjp)
 {
-    int i, min_intr_len = sjp->intron_len, SJ_n;
+    int i, min_intr_len = sjp->intron_len, SJ_n, start;
 #ifdef _RMATS_
-    for (i = 0; i  < n_cigar; ++i) {
-        uint32_t op = bam_cigar_op(c[i]);
-        if (op != BAM_CMATCH && op != BAM_CREF_SKIP) return -1;
-        //&& op != BAM_CEQUAL && op != BAM_CDIFF) return 0;
-    }
+    if (!cigar_walk_is_MN(w)) return -1; // for rMATS, only M&N allowed
 #endif
-    SJ_n = bam_cigar_opn(n_cigar, c, BAM_CREF_SKIP, min_intr_len);
-    int end = start - 1; /* 1-base */
+    SJ_n = cigar_walk_intr_n(w, min_intr_len);
 
     ad->intv_n = 0;
     if (SJ_n+1 > ad->intv_m) {
@@ -657,52 +611,18 @@ int bam2ad(int tid, int start, uint8_t is_uniq, int n_cigar, const uint32_t *c,
         ad->exon_end = (int*)_err_realloc(ad->exon_end, (SJ_n+1) * sizeof(int));
         ad->intr_end = (int*)_err_realloc(ad->intr_end, (SJ_n+1) * sizeof(int));
     }
-    ad->tid = tid; ad->start = start;
+    ad->tid = w->tid; ad->start = w->start;
     ad->is_uniq = is_uniq; ad->is_splice = (SJ_n > 1);
 
-    for (i = 0; i < n_cigar; ++i) {
-        int l = bam_cigar_oplen(c[i]);
-        switch (bam_cigar_op(c[i])) {
-            case BAM_CREF_SKIP: // N(0 1)
-                if (l >= min_intr_len) {
-                    // ad
-                    ad->intr_end[ad->intv_n] = end+l;
-                    ad->exon_end[(ad->intv_n)++] = end;
-
-                    start = end+l+1;
-                }
-                end += l;
-                break;
-            case BAM_CMATCH: // 1 1
-            case BAM_CEQUAL:
-            case BAM_CDIFF:
-                end += l;
-                break;
-            case BAM_CDEL : // D(0 1)
-#ifdef _RMATS_
-                return 0; // for rMATS, only M&N allowed
-#else
-                end += l;
-                break;
-#endif
-            case BAM_CINS: // 1 0
-            case BAM_CSOFT_CLIP:
-            case BAM_CHARD_CLIP:
-            case BAM_CPAD: // 0 0
-            case BAM_CBACK:
-#ifdef _RMATS_
-                return 0; // for rMATS, only M&N allowed
-#endif
-                break; 
-            default:
-                err_printf("Error: unknown cigar type: %d.\n", bam_cigar_op(c[i]));
-                break;
-        }
+    for (i = 0; i < w->intr_n; ++i) {
+        if (cigar_intr_len(w->intr[i]) < min_intr_len) continue;
+        ad->intr_end[ad->intv_n] = w->intr[i].acc;
+        ad->exon_end[(ad->intv_n)++] = w->intr[i].don - 1;
     }
 
     // ad
-    ad->exon_end[(ad->intv_n)++] = end;
-    ad->end = end;
+    ad->exon_end[(ad->intv_n)++] = w->end;
+    ad->end = w->end;
     // filter with anchor length
     start = ad->start;
     if (ad->intv_n > 1) {
@@ -714,8 +634,7 @@ int bam2ad(int tid, int start, uint8_t is_uniq, int n_cigar, const uint32_t *c,
 
 int parse_bam_record1(bam1_t *b, ad_t *ad, sj_para *sjp)
 {
-    int n_cigar; uint32_t *cigar;
-    uint8_t is_uniq; int tid, bam_start;
+    uint8_t is_uniq; int ret;
     if (bam_unmap(b)) return 0; // unmap (0)
     is_uniq = bam_is_uniq_NH(b); // uniq-map (1)
 #ifdef _RMATS_
@@ -725,82 +644,103 @@ int parse_bam_record1(bam1_t *b, ad_t *ad, sj_para *sjp)
 #endif
     if (bam_is_prop(b) != 1 && sjp->read_type == PAIR_T) return 0; // prop-pair (2)
 
-    tid = b->core.tid; n_cigar = b->core.n_cigar; cigar = bam_get_cigar(b);
-    bam_start = b->core.pos+1;
     ad->rlen = b->core.l_qseq;
 #ifdef __DEBUG__
+    uint32_t *cigar = bam_get_cigar(b);
     err_printf("%s %d ", bam_get_qname(b), b->core.pos+1);
     int i;
-    for (i = 0; i < n_cigar; ++i) fprintf(stderr, "%d%c", cigar[i] >> 4, "MIDNSH"[cigar[i] & 0xf]);
+    for (i = 0; i < b->core.n_cigar; ++i) fprintf(stderr, "%d%c", cigar[i] >> 4, "MIDNSH"[cigar[i] & 0xf]);
     fprintf(stderr, "\n");
 #endif
     // alignment details
-    return bam2ad(tid, bam_start, is_uniq, n_cigar, cigar, ad, sjp);
+    cigar_walk_t w; cigar_walk_init(&w);
+    cigar_walk_bam(&w, b);
+    ret = bam2ad(&w, is_uniq, ad, sjp);
+    cigar_walk_free(&w);
+    return ret;
+}
+
+// @return value
+//    1: b may give splice-junctions, is_uniq is set
+static int bam2sj_check1(bam1_t *b, sj_para *sjp, uint8_t *is_uniq)
+{
+    if (bam_unmap(b)) return 0; // unmap (0)
+    *is_uniq = bam_is_uniq_NH(b); // uniq-map (1)
+#ifdef _RMATS_
+    if (*is_uniq == 0) return 0;
+#endif
+    if (bam_is_prop(b) != 1 && sjp->read_type == PAIR_T) return 0; // prop-pair (2)
+    return 1;
 }
 
+// filter one record and generate its splice-junctions
+// intron-motif is left undefined, see sj_group_motif()
+int bam2sj_record1(bam1_t *b, sj_t **sj, int *sj_m, sj_para *sjp)
+{
+    uint8_t is_uniq; int sj_n;
+    if (bam2sj_check1(b, sjp, &is_uniq) == 0) return 0;
+
+    cigar_walk_t w; cigar_walk_init(&w);
+    cigar_walk_bam(&w, b);
+    sj_n = gen_sj(is_uniq, &w, NULL, sj, sj_m, sjp);
+    cigar_walk_free(&w);
+    return sj_n;
+}
+
+// as bam2sj_record1(), w: CIGAR of b, walked by the caller
+int bam2sj_walk1(bam1_t *b, const cigar_walk_t *w, sj_t **sj, int *sj_m, sj_para *sjp)
+{
+    uint8_t is_uniq;
+    if (bam2sj_check1(b, sjp, &is_uniq) == 0) return 0;
+    return gen_sj(is_uniq, w, NULL, sj, sj_m, sjp);
+}
 
-int bam2cnt_core(samFile *in, bam_hdr_t *h, bam1_t *b, kseq_t *seq, int seq_n, sj_t **SJ_group, int SJ_m, sj_para *sjp) {
+int bam2cnt_core(samFile *in, bam_hdr_t *h, bam1_t *b, genome_t *g, sj_hash_t *SJ_group, sj_para *sjp) {
     err_func_format_printf(__func__, "calculating junction- and exon-body-read count ...\n");
-    int n_cigar; uint32_t *cigar;
-    uint8_t is_uniq; int tid, bam_start;// bam_end;
     // junction
-    int SJ_n = 0, sj_n, sj_m = 1; sj_t *sj = (sj_t*)_err_malloc(sizeof(sj_t));
+    int sj_n, sj_m = 1; sj_t *sj = (sj_t*)_err_malloc(sizeof(sj_t));
     // read bam record
     int ret;
+    bam_lite_t *r = bam_lite_init(in, h, "NH");
     while (1) {
-        ret = sam_read1(in, h, b);
+        ret = bam_lite_read1(r, b);
         if (ret == -1) break;
         else if (ret < 0) err_fatal_simple("bam file error!\n");
 
-        if (bam_unmap(b)) continue; // unmap (0)
-        is_uniq = bam_is_uniq_NH(b); // uniq-map (1)
-#ifdef _RMATS_
-        if (is_uniq == 0) continue;
-#endif
-        if (bam_is_prop(b) != 1 && sjp->read_type == PAIR_T) continue; // prop-pair (2)
-
-        tid = b->core.tid; n_cigar = b->core.n_cigar, cigar = bam_get_cigar(b);
-        bam_start = b->core.pos+1;// bam_end = b->core.pos+bam_cigar2rlen(n_cigar, cigar);
         // junction read
-        if ((sj_n = gen_sj(is_uniq, tid, bam_start, n_cigar, cigar, seq, seq_n, &sj, &sj_m, sjp)) > 0) sj_update_group(SJ_group, &SJ_n, &SJ_m, sj, sj_n);
+        if ((sj_n = bam2sj_record1(b, &sj, &sj_m, sjp)) > 0) sj_hash_add(SJ_group, sj, sj_n);
     }
-    free(sj);
+    free(sj); bam_lite_destroy(r);
+    sj_n = sj_hash_sort(SJ_group);
+    sj_group_motif(SJ_group->sj, sj_n, g);
     err_func_format_printf(__func__, "calculating junction- and exon-body-read count done!\n");
 
-    return SJ_n;
+    return sj_n;
 }
 
-int bam2sj_core(samFile *in, bam_hdr_t *h, bam1_t *b, kseq_t *seq, int seq_n, sj_t **SJ_group, int SJ_m, sj_para *sjp)
+int bam2sj_core(samFile *in, bam_hdr_t *h, bam1_t *b, genome_t *g, sj_hash_t *SJ_group, sj_para *sjp)
 {
     err_func_format_printf(__func__, "generating splice-junction with BAM file ...\n");
-    int n_cigar; uint32_t *cigar;
-    uint8_t is_uniq; int tid, bam_start;// bam_end;
-    int SJ_n = 0, sj_n, sj_m = 1; sj_t *sj = (sj_t*)_err_malloc(sizeof(sj_t));
+    int sj_n, sj_m = 1; sj_t *sj = (sj_t*)_err_malloc(sizeof(sj_t));
 
     int ret;
+    bam_lite_t *r = bam_lite_init(in, h, "NH");
     while (1) {
-        ret = sam_read1(in, h, b);
+        ret = bam_lite_read1(r, b);
         if (ret == -1) break;
         else if (ret < 0) err_fatal_simple("bam file error!\n");
 
-        if (bam_unmap(b)) continue; // unmap (0)
-        is_uniq = bam_is_uniq_NH(b); // uniq-map (1)
-#ifdef _RMATS_
-        if (is_uniq == 0) continue;
-#endif
-        if (bam_is_prop(b) != 1 && sjp->read_type == PAIR_T) continue; // prop-pair (2)
-
-        tid = b->core.tid; n_cigar = b->core.n_cigar, cigar = bam_get_cigar(b);
-        bam_start = b->core.pos+1;// bam_end = b->core.pos+bam_cigar2rlen(n_cigar, cigar);
-        if ((sj_n = gen_sj(is_uniq, tid, bam_start, n_cigar, cigar, seq, seq_n, &sj, &sj_m, sjp)) > 0) sj_update_group(SJ_group, &SJ_n, &SJ_m, sj, sj_n);
+        if ((sj_n = bam2sj_record1(b, &sj, &sj_m, sjp)) > 0) sj_hash_add(SJ_group, sj, sj_n);
     }
-    free(sj);
+    free(sj); bam_lite_destroy(r);
+    sj_n = sj_hash_sort(SJ_group);
+    sj_group_motif(SJ_group->sj, sj_n, g);
     err_func_format_printf(__func__, "generating splice-junction with BAM file done!\n");
 
-    return SJ_n;
+    return sj_n;
 }
 
-int generate_SpliceJunction_core(sj_t **sj_group, const char *in_name, kseq_t *seq, int seq_n, sj_para *sjp)
+int generate_SpliceJunction_core(sj_t **sj_group, const char *in_name, genome_t *g, sj_para *sjp)
 {
     // open bam file
     samFile *in; bam_hdr_t *h; bam1_t *b;
@@ -809,34 +749,55 @@ int generate_SpliceJunction_core(sj_t **sj_group, const char *in_name, kseq_t *s
     if ((h = sam_hdr_read(in)) == NULL) err_fatal(__func__, "Couldn't read header for \"%s\"\n", in_name);
 
     // parse bam record
-    int n_cigar; uint32_t *cigar;
-    uint8_t is_uniq; int tid, bam_start;// bam_end;
-    int SJ_n = 0, SJ_m = 10000; sj_t **SJ_group = (sj_t**)_err_malloc(sizeof(sj_t*)); 
-    *SJ_group = (sj_t*)_err_malloc(SJ_m * sizeof(sj_t));
-    int sj_n, sj_m = 1; sj_t *sj = (sj_t*)_err_malloc(sizeof(sj_t));
+    sj_hash_t *SJ_group = sj_hash_init();
+    int SJ_n, sj_n, sj_m = 1; sj_t *sj = (sj_t*)_err_malloc(sizeof(sj_t));
 
     int ret;
+    bam_lite_t *r = bam_lite_init(in, h, "NH");
     while (1) {
-        ret = sam_read1(in, h, b);
+        ret = bam_lite_read1(r, b);
         if (ret == -1) break;
         else if (ret < 0) err_fatal_simple("bam file error!\n");
 
-        if (bam_unmap(b)) continue; // unmap (0)
-        is_uniq = bam_is_uniq_NH(b); // uniq-map (1)
-#ifdef _RMATS_
-        if (is_uniq == 0) continue;
-#endif
-        if (bam_is_prop(b) != 1 && sjp->read_type == PAIR_T) continue; // prop-pair (2)
-
-        tid = b->core.tid; n_cigar = b->core.n_cigar, cigar = bam_get_cigar(b);
-        bam_start = b->core.pos+1; // bam_end = b->core.pos+bam_cigar2rlen(n_cigar, cigar);
-        if ((sj_n = gen_sj(is_uniq, tid, bam_start, n_cigar, cigar, seq, seq_n, &sj, &sj_m, sjp)) > 0) sj_update_group(SJ_group, &SJ_n, &SJ_m, sj, sj_n);
+        if ((sj_n = bam2sj_record1(b, &sj, &sj_m, sjp)) > 0) sj_hash_add(SJ_group, sj, sj_n);
     }
-    free(sj); bam_destroy1(b); bam_hdr_destroy(h); sam_close(in);
-    (*sj_group) = *SJ_group;
+    free(sj); bam_lite_destroy(r); bam_destroy1(b); bam_hdr_destroy(h); sam_close(in);
+    SJ_n = sj_hash_sort(SJ_group);
+    sj_group_motif(SJ_group->sj, SJ_n, g);
+    (*sj_group) = SJ_group->sj;
+    free(SJ_group->h); free(SJ_group);
     return SJ_n;
 }
 
+typedef struct {
+    sj_para *sjp;
+    sj_hash_t *SJ_group;
+} bam2sj_shard_aux_t;
+
+// one shard of an indexed BAM => splice-junctions of the shard
+void *bam2sj_shard_work(bam_aux_t *a, bam_shard_t *s, void *data)
+{
+    bam2sj_shard_aux_t *aux = (bam2sj_shard_aux_t*)data;
+    sj_hash_t *res = sj_hash_init();
+    int sj_n, sj_m = 1; sj_t *sj = (sj_t*)_err_malloc(sizeof(sj_t));
+    while (bam_shard_read1(a, s) >= 0) {
+        if ((sj_n = bam2sj_record1(a->b, &sj, &sj_m, aux->sjp)) > 0)
+            sj_hash_add(res, sj, sj_n);
+    }
+    free(sj);
+    return res;
+}
+
+// a junction may be seen by two chunks of one reference
+int bam2sj_shard_write(void *_res, void *data)
+{
+    bam2sj_shard_aux_t *aux = (bam2sj_shard_aux_t*)data;
+    sj_hash_t *res = (sj_hash_t*)_res;
+    sj_hash_add(aux->SJ_group, res->sj, res->sj_n);
+    sj_hash_free(res);
+    return 0;
+}
+
 typedef struct {
     int tid;
     kseq_t *seq; int seq_n;
@@ -863,13 +824,14 @@ void print_sj(sj_t *sj_group, int sj_n, FILE *out, char **cname)
 
 int bam2sj(int argc, char *argv[])
 {
-    int c; char *p; char ref_fn[1024]="";
+    int c, genome_cache = GENOME_CACHE_N; char *p; char ref_fn[1024]="";
     sj_para *sjp = sj_init_para();
     //FILE *gtf_fp=NULL; char gtf_fn[1024]="";
 
-    while ((c = getopt_long(argc, argv, "G:g:pa:i:A:U:", bam2sj_long_opt, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "G:g:C:pa:i:A:U:t:", bam2sj_long_opt, NULL)) >= 0) {
         switch (c) {
             case 'g': strcpy(ref_fn, optarg); break;
+            case 'C': genome_cache = atoi(optarg); break;
             //case 'G': gtf_fp = xopen(optarg, "r"); strcpy(gtf_fn, optarg); break;
             case 'p': sjp->read_type = PAIR_T; break;
             case 'a': sjp->anchor_len[0] = strtol(optarg, &p, 10);
@@ -891,19 +853,15 @@ int bam2sj(int argc, char *argv[])
                       if (*p != 0) sjp->all_min[4] = strtol(p+1, &p, 10); else return bam2sj_usage();
                       break;
             case 'i': sjp->intron_len = atoi(optarg); break;
+            case 't': sjp->n_threads = atoi(optarg); break;
 
             default: err_printf("Error: unknown option: %s.\n", optarg); return bam2sj_usage();
         }
     }
     if (argc - optind != 1) return bam2sj_usage();
 
-    int seq_n = 0, seq_m; kseq_t *seq = 0;
-    if (strlen(ref_fn) != 0) {
-        gzFile genome_fp = gzopen(ref_fn, "r");
-        if (genome_fp == NULL) { err_fatal(__func__, "Can not open genome file. %s\n", ref_fn); }
-        seq = kseq_load_genome(genome_fp, &seq_n, &seq_m);
-        err_gzclose(genome_fp); 
-    }
+    genome_t *g = NULL;
+    if (strlen(ref_fn) != 0) g = genome_load(ref_fn, genome_cache);
 
     // open bam and parse bam header
     samFile *in; bam_hdr_t *h; bam1_t *b;
@@ -923,13 +881,20 @@ int bam2sj(int argc, char *argv[])
     } chr_name_free(cname);
     */
 
-    sj_t *sj_group = (sj_t*)_err_malloc(10000 * sizeof(sj_t)); int sj_m = 10000;
-    int sj_n = bam2sj_core(in, h, b, seq, seq_n, &sj_group, sj_m, sjp);
+    sj_hash_t *sj_group = sj_hash_init(); int sj_n = -1;
+    if (sjp->n_threads > 1) {
+        bam2sj_shard_aux_t aux = {sjp, sj_group};
+        if (bam_shard_run(argv[optind], h, sjp->n_threads, 1, bam2sj_shard_work, bam2sj_shard_write, &aux) == 0) {
+            sj_n = sj_hash_sort(sj_group);
+            sj_group_motif(sj_group->sj, sj_n, g);
+        }
+    }
+    if (sj_n < 0) sj_n = bam2sj_core(in, h, b, g, sj_group, sjp);
 
-    print_sj(sj_group, sj_n, stdout, h->target_name);
+    print_sj(sj_group->sj, sj_n, stdout, h->target_name);
 
     bam_destroy1(b); sam_close(in); bam_hdr_destroy(h); 
-    sj_free_para(sjp); free(sj_group);
-    int i; for (i = 0; i < seq_n; ++i) { free(seq[i].name.s); free(seq[i].seq.s); } free(seq);
+    sj_free_para(sjp); sj_hash_free(sj_group);
+    if (g) genome_destroy(g);
     return 0;
 }
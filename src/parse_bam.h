@@ -5,6 +5,8 @@
 #include "gtf.h"
 #include "kseq.h"
 #include "utils.h"
+#include "genome.h"
+#include "cigar_walk.h"
 
 KSEQ_INIT(gzFile, gzread)
 
@@ -24,6 +26,23 @@ typedef struct {
 #define bam_is_prop(b) (((b)->core.flag&BAM_FPROPER_PAIR) != 0)
 
 
+typedef struct {
+    int n_threads;
+
+    int sam_n, tot_rep_n, *rep_n, fp_n;
+    uint8_t in_list; char **in_name; FILE **out_fp;
+
+    int module_type; int exon_num;
+
+    uint8_t fully:1, recur:1, no_novel_sj:1, only_novel:1, use_multi:1, read_type:1, merge_out:1, rm_edge:1;
+    uint8_t only_gtf, only_junc, no_novel_exon; FILE *gtf_fp;
+    int intron_len; double edge_wt;
+    int junc_cnt_min, novel_junc_cnt_min, exon_thres, iso_cnt_max; int asm_exon_max;//, iso_read_cnt_min;
+    int anchor_len[5]; // [anno, non-canonical, GT/AG, GC/AG, AT/AC]
+    int uniq_min[5];   // [anno, non-canonical, GT/AG, GC/AG, AT/AC]
+    int all_min[5];    // [anno, non-canonical, GT/AG, GC/AG, AT/AC]
+} sj_para;
+
 typedef struct {
     char fn[1024];
     hts_idx_t *idx;
@@ -34,6 +53,17 @@ typedef struct {
     hts_itr_t *itr;
 } bam_aux_t;
 
+typedef struct {
+    sj_t *sj; int sj_n, sj_m;   // junctions in insertion order
+    int32_t *h; uint32_t h_m;   // open-addressing slots, index of sj, -1: empty
+} sj_hash_t;
+
+sj_hash_t *sj_hash_init(void);
+void sj_hash_free(sj_hash_t *H);
+void sj_hash_add(sj_hash_t *H, sj_t *sj, int sj_n);
+int sj_hash_sort(sj_hash_t *H);
+void sj_group_motif(sj_t *sj, int sj_n, genome_t *g);
+
 int ad_sim_comp(ad_t *ad1, ad_t *ad2);
 int ad_comp(ad_t *ad1, ad_t *ad2);
 ad_t *ad_init(int n);
@@ -42,6 +72,12 @@ int push_exon_coor(exon_t **e, int *e_n, int *e_m, ad_t *ad);
 int push_sj(int **don, int *don_n, int *don_m, ad_t *ad);
 exon_t *infer_exon_coor(int *infer_e_n, exon_t *e, int e_n, int *don, int don_n);
 
+sj_para *sj_init_para(void);
+void sj_free_para(sj_para *sjp);
+int bam2sj_record1(bam1_t *b, sj_t **sj, int *sj_m, sj_para *sjp);
+int bam2sj_walk1(bam1_t *b, const cigar_walk_t *w, sj_t **sj, int *sj_m, sj_para *sjp);
+void print_sj(sj_t *sj_group, int sj_n, FILE *out, char **cname);
+
 kseq_t *kseq_load_genome(gzFile genome_fp, int *_seq_n, int *_seq_m);
 int bam2sj(int argc, char *argv[]);
 void free_sj_group(sj_t *sj_g, int sj_n);
@@ -0,0 +1,359 @@
+/* pipeline.c
+ *   run filter, bam2sj, bam2gtf and update-gtf over one BAM in one pass
+ *   each record is decoded once and handed through a chain of stages,
+ *   every stage writes its own output
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "htslib/sam.h"
+#include "htslib/thread_pool.h"
+#include "utils.h"
+#include "gtf.h"
+#include "bam2gtf.h"
+#include "bam_filter.h"
+#include "bam_sort.h"
+#include "gtf_sort.h"
+#include "parse_bam.h"
+#include "update_gtf.h"
+#include "region_mask.h"
+#include "pipeline.h"
+
+extern const char PROG[20];
+
+static void run_add(run_t *R, const char *name, void *data, run_push_f push, run_finish_f finish, run_destroy_f destroy)
+{
+    if (R->n == R->m) {
+        R->m = R->m ? R->m << 1 : 8;
+        R->s = (run_stage_t*)_err_realloc(R->s, R->m * sizeof(run_stage_t));
+    }
+    run_stage_t *s = R->s + R->n++;
+    s->name = name, s->data = data, s->push = push, s->finish = finish, s->destroy = destroy;
+}
+
+// hand b to the stages after stage i
+static inline void run_pass(run_t *R, int i, bam1_t *b)
+{
+    if (i + 1 < R->n) R->s[i+1].push(R, i+1, b);
+}
+
+// CIGAR walk of b, done once for all the stages that see b
+// a stage that hands on a record other than the one it got resets R->w_b
+static inline const cigar_walk_t *run_walk(run_t *R, const bam1_t *b)
+{
+    if (R->w_b != b) cigar_walk_bam(&R->w, b), R->w_b = b;
+    return &R->w;
+}
+
+/*********
+ * filter *
+ *********/
+static void run_filter_push(run_t *R, int i, bam1_t *b)
+{
+    bam1_t *best = filter_push((filter_t*)R->s[i].data, b);
+    if (best) R->w_b = NULL, run_pass(R, i, best);
+}
+
+static void run_filter_finish(run_t *R, int i)
+{
+    filter_t *f = (filter_t*)R->s[i].data; bam1_t *best;
+    if ((best = filter_flush(f)) != NULL) R->w_b = NULL, run_pass(R, i, best);
+    err_func_format_printf(__func__, "Filtered alignments: %d\n", f->cnt);
+}
+
+static void run_filter_destroy(void *data)
+{
+    filter_t *f = (filter_t*)data;
+    region_mask_destroy(f->r); filter_destroy(f);
+}
+
+/*************
+ * BAM output *
+ *************/
+typedef struct {
+    samFile *out; bam_sort_t *sort;
+} run_bam_t;
+
+static void run_bam_push(run_t *R, int i, bam1_t *b)
+{
+    run_bam_t *o = (run_bam_t*)R->s[i].data;
+    if (o->sort) bam_sort_push(o->sort, b);
+    else if (sam_write1(o->out, R->h, b) < 0) err_fatal_simple("Error in writing SAM record\n");
+    run_pass(R, i, b);
+}
+
+static void run_bam_finish(run_t *R, int i)
+{
+    run_bam_t *o = (run_bam_t*)R->s[i].data;
+    if (o->sort) bam_sort_write(o->sort, o->out, R->h);
+    sam_close(o->out); o->out = NULL;
+}
+
+static void run_bam_destroy(void *data)
+{
+    run_bam_t *o = (run_bam_t*)data;
+    if (o->out) sam_close(o->out);
+    bam_sort_destroy(o->sort); free(o);
+}
+
+/*********
+ * bam2sj *
+ *********/
+typedef struct {
+    sj_para *sjp; sj_hash_t *H; genome_t *g;
+    sj_t *sj; int sj_m;
+    FILE *out;
+} run_sj_t;
+
+static void run_sj_push(run_t *R, int i, bam1_t *b)
+{
+    run_sj_t *s = (run_sj_t*)R->s[i].data; int sj_n;
+    if ((sj_n = bam2sj_walk1(b, run_walk(R, b), &s->sj, &s->sj_m, s->sjp)) > 0) sj_hash_add(s->H, s->sj, sj_n);
+    run_pass(R, i, b);
+}
+
+static void run_sj_finish(run_t *R, int i)
+{
+    run_sj_t *s = (run_sj_t*)R->s[i].data;
+    int sj_n = sj_hash_sort(s->H);
+    sj_group_motif(s->H->sj, sj_n, s->g);
+    print_sj(s->H->sj, sj_n, s->out, R->h->target_name);
+}
+
+static void run_sj_destroy(void *data)
+{
+    run_sj_t *s = (run_sj_t*)data;
+    sj_free_para(s->sjp); sj_hash_free(s->H); free(s->sj);
+    if (s->g) genome_destroy(s->g);
+    err_fclose(s->out); free(s);
+}
+
+/**********
+ * bam2gtf *
+ **********/
+typedef struct {
+    trans_t *t; char *src; int exon_min, intron_len;
+    FILE *out;
+} run_gtf_t;
+
+static void run_gtf_push(run_t *R, int i, bam1_t *b)
+{
+    run_gtf_t *g = (run_gtf_t*)R->s[i].data;
+    if (gen_trans_walk(b, run_walk(R, b), g->t, g->exon_min, g->intron_len)) {
+        set_trans_name(g->t, NULL, NULL, NULL, bam_get_qname(b));
+        print_trans(*g->t, R->h, g->src, g->out);
+    }
+    run_pass(R, i, b);
+}
+
+static void run_gtf_destroy(void *data)
+{
+    run_gtf_t *g = (run_gtf_t*)data;
+    trans_free(g->t); err_fclose(g->out); free(g);
+}
+
+/*************
+ * update-gtf *
+ *************/
+typedef struct {
+    update_gtf_para *ugp; const char *anno_fn;
+    trans_pack_t *P; trans_t *t;
+} run_update_t;
+
+static void run_update_push(run_t *R, int i, bam1_t *b)
+{
+    run_update_t *u = (run_update_t*)R->s[i].data;
+    if (gen_trans_walk(b, run_walk(R, b), u->t, u->ugp->min_exon, u->ugp->min_intron)) {
+        set_trans_name(u->t, NULL, NULL, NULL, bam_get_qname(b));
+        trans_pack_add(u->P, u->t, bam_get_qname(b));
+    }
+    run_pass(R, i, b);
+}
+
+static void run_update_finish(run_t *R, int i)
+{
+    run_update_t *u = (run_update_t*)R->s[i].data;
+    update_gtf_core(NULL, u->P, R->h, R->cname, u->anno_fn, u->ugp);
+}
+
+static void run_update_destroy(void *data)
+{
+    run_update_t *u = (run_update_t*)data;
+    err_fclose(u->ugp->out_gtf_fp); free(u->ugp->intron_fn); free(u->ugp);
+    trans_pack_destroy(u->P); trans_free(u->t); free(u);
+}
+
+const struct option run_long_opt [] = {
+    { "filter", 1, NULL, 'f' },
+    { "bam", 1, NULL, 'b' },
+    { "sj", 1, NULL, 'j' },
+    { "gtf", 1, NULL, 'g' },
+    { "update", 1, NULL, 'u' },
+    { "anno", 1, NULL, 'a' },
+
+    { "coverage", 1, NULL, 'v' },
+    { "map-quality", 1, NULL, 'q' },
+    { "sec-rat", 1, NULL, 's' },
+    { "intron-num", 1, NULL, 'N' },
+    { "sort", 0, NULL, 'S' },
+    { "max-mem", 1, NULL, 'm' },
+    { "genome-file", 1, NULL, 'r' },
+    { "min-exon", 1, NULL, 'e' },
+    { "intron-len", 1, NULL, 'i' },
+    { "intron", 1, NULL, 'I' },
+    { "distance", 1, NULL, 'd' },
+    { "full-length", 1, NULL, 'l' },
+    { "unclassified", 0, NULL, 'U' },
+    { "threads", 1, NULL, 't' },
+
+    { 0, 0, 0, 0 }
+};
+
+static int run_usage(void)
+{
+    err_printf("\n");
+    err_printf("Usage:   %s run [option] <in.bam>\n\n", PROG);
+    err_printf("         decode <in.bam> once and run the stages whose output is given, in this order:\n");
+    err_printf("         filter, BAM output, bam2sj, bam2gtf, update-gtf\n\n");
+    err_printf("Stages:\n\n");
+    err_printf("         -f --filter      [STR]    rRNA.gtf/rRNA.gtf.gtfidx/rRNA.bed, filter alignments as %s filter does,\n", PROG);
+    err_printf("                                   the other stages only see the retained ones. The alignments of\n");
+    err_printf("                                   a read need to be adjacent in <in.bam>. [NONE]\n");
+    err_printf("         -b --bam         [STR]    BAM output. [NONE]\n");
+    err_printf("         -j --sj          [STR]    splice-junction output, as %s bam2sj. [NONE]\n", PROG);
+    err_printf("         -g --gtf         [STR]    read-transcript output, as %s bam2gtf. [NONE]\n", PROG);
+    err_printf("         -u --update      [STR]    novel-transcript output, as %s update-gtf, needs -a. [NONE]\n", PROG);
+    err_printf("         -a --anno        [STR]    old.gtf/old.gtf.gtfidx for -u. [NONE]\n");
+    err_printf("\nFilter Options:\n\n");
+    err_printf("         -v --coverage    [FLOAT]  minimum fraction of aligned bases. [%.2f]\n", COV_RATIO);
+    err_printf("         -q --map-quality [FLOAT]  minimum fraction of identically aligned bases. [%.2f]\n", MAP_QUAL);
+    err_printf("         -s --sec-rat     [FLOAT]  maximum ratio of second best and best score to retain the best\n");
+    err_printf("                                   alignment. [%.2f]\n", SEC_RATIO);
+    err_printf("         -N --intron-num  [INT]    minimum number of intron indicated by the alignment. [%d]\n", MIN_INTRON_NUM);
+    err_printf("\nBAM Options:\n\n");
+    err_printf("         -S --sort                 write coordinate-sorted BAM. [False]\n");
+    err_printf("         -m --max-mem     [STR]    memory for sorting, K/M/G suffix accepted. [768M]\n");
+    err_printf("\nTranscript Options:\n\n");
+    err_printf("         -r --genome-file [STR]    genome.fa, to classify intron-motif of -j. [None]\n");
+    err_printf("         -e --min-exon    [INT]    minimum length of internal exon. [%d]\n", INTER_EXON_MIN_LEN);
+    err_printf("         -i --intron-len  [INT]    minimum length of intron. [%d]\n", INTRON_MIN_LEN);
+    err_printf("         -I --intron      [STR]    intron information file output by STAR(*.out.tab) for -u, can be\n");
+    err_printf("                                   given more than once. [NONE]\n");
+    err_printf("         -d --distance    [INT]    consider same if distance between two splice site is not bigger than d. [%d]\n", SPLICE_DISTANCE);
+    err_printf("         -l --full-length [INT]    level of strict criterion for considering full-length transcript. \n");
+    err_printf("                                   (1->5, most strict->most relaxed) [%d]\n", 5);
+    err_printf("         -U --unclassified         output UNCLASSIFIED novel transcript. [False]\n");
+    err_printf("\n         -t --threads     [INT]    number of threads, for BAM (de)compression, sorting and update-gtf. [1]\n");
+    err_printf("\n");
+    return 1;
+}
+
+int run_pipeline(int argc, char *argv[])
+{
+    int c, i, n_threads = 1, is_sort = 0; int64_t max_mem = BAM_SORT_MEM;
+    float cov_rat = COV_RATIO, map_qual = MAP_QUAL, sec_rat = SEC_RATIO; int min_intron_n = MIN_INTRON_NUM;
+    char *filter_fn = NULL, *bam_fn = NULL, *sj_fn = NULL, *gtf_fn = NULL, *update_fn = NULL, *anno_fn = NULL, *ref_fn = NULL;
+    update_gtf_para *ugp = update_gtf_init_para();
+    while ((c = getopt_long(argc, argv, "f:b:j:g:u:a:v:q:s:N:Sm:r:e:i:I:d:l:Ut:", run_long_opt, NULL)) >= 0) {
+        switch (c) {
+            case 'f': filter_fn = optarg; break;
+            case 'b': bam_fn = optarg; break;
+            case 'j': sj_fn = optarg; break;
+            case 'g': gtf_fn = optarg; break;
+            case 'u': update_fn = optarg; break;
+            case 'a': anno_fn = optarg; break;
+            case 'v': cov_rat = atof(optarg); break;
+            case 'q': map_qual = atof(optarg); break;
+            case 's': sec_rat = atof(optarg); break;
+            case 'N': min_intron_n = atoi(optarg); break;
+            case 'S': is_sort = 1; break;
+            case 'm': max_mem = gtf_sort_parse_mem(optarg); break;
+            case 'r': ref_fn = optarg; break;
+            case 'e': ugp->min_exon = atoi(optarg); break;
+            case 'i': ugp->min_intron = atoi(optarg); break;
+            case 'I': if (ugp->intron_fn_n == ugp->intron_fn_m) {
+                          ugp->intron_fn_m = ugp->intron_fn_m ? ugp->intron_fn_m << 1 : 16;
+                          ugp->intron_fn = (char**)_err_realloc(ugp->intron_fn, ugp->intron_fn_m * sizeof(char*));
+                      }
+                      ugp->intron_fn[ugp->intron_fn_n++] = optarg;
+                      break;
+            case 'd': ugp->ss_dis = atoi(optarg); break;
+            case 'l': ugp->full_len_level = atoi(optarg); break;
+            case 'U': ugp->uncla = 1; break;
+            case 't': n_threads = atoi(optarg); break;
+            default: err_printf("Error: unknown option: %s.\n", optarg);
+                     return run_usage();
+        }
+    }
+    if (argc - optind != 1) return run_usage();
+    if (update_fn && anno_fn == NULL) err_fatal_simple("-u/--update needs -a/--anno.\n");
+    if (!bam_fn && !sj_fn && !gtf_fn && !update_fn) err_fatal_simple("no output is given, see -b/-j/-g/-u.\n");
+
+    samFile *in; bam_hdr_t *h; bam1_t *b; int ret;
+    if ((in = sam_open(argv[optind], "rb")) == NULL) err_fatal(__func__, "Cannot open \"%s\"\n", argv[optind]);
+    if ((h = sam_hdr_read(in)) == NULL) err_fatal(__func__, "Couldn't read header for \"%s\"\n", argv[optind]);
+    htsThreadPool p = {NULL, 0};
+    if (n_threads > 1) {
+        if ((p.pool = hts_tpool_init(n_threads)) == NULL) err_fatal_simple("Failed to initialize thread pool\n");
+        hts_set_thread_pool(in, &p);
+    }
+    run_t R; memset(&R, 0, sizeof(run_t)); cigar_walk_init(&R.w);
+    R.h = h; R.cname = chr_name_init(); bam_set_cname(h, R.cname);
+
+    if (filter_fn) {
+        region_mask_t *r = region_mask_init();
+        region_mask_read(r, filter_fn, R.cname);
+        run_add(&R, "filter", filter_init(cov_rat, map_qual, sec_rat, min_intron_n, r), run_filter_push, run_filter_finish, run_filter_destroy);
+    }
+    if (bam_fn) {
+        run_bam_t *o = (run_bam_t*)_err_calloc(1, sizeof(run_bam_t));
+        if ((o->out = sam_open_format(bam_fn, "wb", NULL)) == NULL) err_fatal(__func__, "Cannot open \"%s\"\n", bam_fn);
+        if (p.pool) hts_set_thread_pool(o->out, &p);
+        if (is_sort) {
+            o->sort = bam_sort_init(max_mem, n_threads, bam_fn);
+            if (sam_hdr_update_hd(h, "SO", "coordinate") < 0 && sam_hdr_add_line(h, "HD", "VN", "1.6", "SO", "coordinate", NULL) < 0)
+                err_fatal_simple("Error in updating SAM header\n");
+        }
+        if (sam_hdr_write(o->out, h) != 0) err_fatal_simple("Error in writing SAM header\n");
+        run_add(&R, "bam", o, run_bam_push, run_bam_finish, run_bam_destroy);
+    }
+    if (sj_fn) {
+        run_sj_t *s = (run_sj_t*)_err_calloc(1, sizeof(run_sj_t));
+        s->sjp = sj_init_para(); s->sjp->intron_len = ugp->min_intron;
+        s->H = sj_hash_init();
+        s->sj_m = 1; s->sj = (sj_t*)_err_malloc(sizeof(sj_t));
+        if (ref_fn) s->g = genome_load(ref_fn, GENOME_CACHE_N);
+        s->out = xopen(sj_fn, "w");
+        run_add(&R, "bam2sj", s, run_sj_push, run_sj_finish, run_sj_destroy);
+    }
+    if (gtf_fn) {
+        run_gtf_t *g = (run_gtf_t*)_err_calloc(1, sizeof(run_gtf_t));
+        g->t = trans_init(1); g->src = "NONE";
+        g->exon_min = ugp->min_exon, g->intron_len = ugp->min_intron;
+        g->out = xopen(gtf_fn, "w");
+        run_add(&R, "bam2gtf", g, run_gtf_push, NULL, run_gtf_destroy);
+    }
+    if (update_fn) {
+        run_update_t *u = (run_update_t*)_err_calloc(1, sizeof(run_update_t));
+        u->ugp = ugp; u->anno_fn = anno_fn;
+        ugp->n_threads = n_threads; ugp->out_gtf_fp = xopen(update_fn, "w");
+        u->P = trans_pack_init(); u->t = trans_init(1);
+        run_add(&R, "update-gtf", u, run_update_push, run_update_finish, run_update_destroy);
+    } else free(ugp->intron_fn), free(ugp);
+
+    b = bam_init1();
+    while ((ret = sam_read1(in, h, b)) >= 0) R.w_b = NULL, R.s[0].push(&R, 0, b);
+    if (ret < -1) err_fatal_simple("bam file error!\n");
+    for (i = 0; i < R.n; ++i) {
+        if (R.s[i].finish) R.s[i].finish(&R, i);
+        err_func_format_printf(__func__, "%s done!\n", R.s[i].name);
+    }
+
+    for (i = 0; i < R.n; ++i) R.s[i].destroy(R.s[i].data);
+    free(R.s); chr_name_free(R.cname); cigar_walk_free(&R.w);
+    bam_destroy1(b); bam_hdr_destroy(h); sam_close(in);
+    if (p.pool) hts_tpool_destroy(p.pool);
+    return 0;
+}
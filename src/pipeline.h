@@ -0,0 +1,28 @@
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+#include "htslib/sam.h"
+#include "gtf.h"
+#include "cigar_walk.h"
+
+typedef struct run_s run_t;
+
+// push() gets each record that passed the stages before, and hands it on
+// with run_pass(); finish() is called at the end of input, in stage order
+typedef void (*run_push_f)(run_t *R, int i, bam1_t *b);
+typedef void (*run_finish_f)(run_t *R, int i);
+typedef void (*run_destroy_f)(void *data);
+
+typedef struct {
+    const char *name; void *data;
+    run_push_f push; run_finish_f finish; run_destroy_f destroy;
+} run_stage_t;
+
+struct run_s {
+    bam_hdr_t *h; chr_name_t *cname;
+    run_stage_t *s; int n, m;
+    cigar_walk_t w; const bam1_t *w_b; // CIGAR walk shared by the stages, of w_b
+};
+
+int run_pipeline(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,137 @@
+/* region_mask.c
+ *   masked regions of the genome (rRNA, repeats) for filter
+ *   intervals from a GTF, index-gtf snapshot or BED file are merged into
+ *   sorted disjoint intervals per tid, an overlap test is a binary search
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "region_mask.h"
+#include "gtf_reader.h"
+#include "gtfidx.h"
+#include "utils.h"
+#include "kseq.h"
+
+KSTREAM_INIT(gzFile, gzread, 0x10000)
+
+region_mask_t *region_mask_init(void)
+{
+    region_mask_t *m = (region_mask_t*)_err_calloc(1, sizeof(region_mask_t));
+    return m;
+}
+
+// 0-based, [beg, end), tid < 0 is skipped
+void region_mask_add(region_mask_t *m, int tid, int32_t beg, int32_t end)
+{
+    if (tid < 0 || beg >= end) return;
+    if (m->raw_n == m->raw_m) {
+        m->raw_m = m->raw_m ? m->raw_m << 1 : 1024;
+        m->raw = (region_t*)_err_realloc(m->raw, m->raw_m * sizeof(region_t));
+    }
+    m->raw[m->raw_n].tid = tid, m->raw[m->raw_n].beg = beg, m->raw[m->raw_n].end = end;
+    m->raw_n++;
+}
+
+static int region_comp(const void *_a, const void *_b)
+{
+    region_t *a = (region_t*)_a, *b = (region_t*)_b;
+    if (a->tid != b->tid) return a->tid - b->tid;
+    else return (a->beg > b->beg) - (a->beg < b->beg);
+}
+
+// merge overlapping and adjacent intervals, input order does not matter
+// @return value
+//    number of disjoint intervals
+int64_t region_mask_index(region_mask_t *m)
+{
+    int64_t i, k = 0; int tid;
+    if (m->raw_n > 0) qsort(m->raw, m->raw_n, sizeof(region_t), region_comp);
+    for (i = 0; i < m->raw_n; ++i) {
+        region_t *r = m->raw + i;
+        if (k > 0 && m->raw[k-1].tid == r->tid && r->beg <= m->raw[k-1].end) {
+            if (r->end > m->raw[k-1].end) m->raw[k-1].end = r->end;
+        } else m->raw[k++] = *r;
+    }
+    m->chr_n = k > 0 ? m->raw[k-1].tid + 1 : 0;
+    m->off = (int64_t*)_err_calloc(m->chr_n + 1, sizeof(int64_t));
+    m->n = (int32_t*)_err_calloc(m->chr_n + 1, sizeof(int32_t));
+    m->beg = (int32_t*)_err_malloc((k > 0 ? k : 1) * sizeof(int32_t));
+    m->end = (int32_t*)_err_malloc((k > 0 ? k : 1) * sizeof(int32_t));
+    for (i = 0; i < k; ++i) {
+        m->n[m->raw[i].tid]++;
+        m->beg[i] = m->raw[i].beg, m->end[i] = m->raw[i].end;
+    }
+    for (tid = 1; tid <= m->chr_n; ++tid) m->off[tid] = m->off[tid-1] + m->n[tid-1];
+    free(m->raw); m->raw = NULL; m->raw_n = m->raw_m = 0;
+    return k;
+}
+
+// [beg, end) overlaps a masked interval of tid, 0-based
+int region_mask_overlap(const region_mask_t *m, int tid, int32_t beg, int32_t end)
+{
+    if (tid < 0 || tid >= m->chr_n || m->n[tid] == 0) return 0;
+    const int32_t *e = m->end + m->off[tid]; int32_t n = m->n[tid];
+    // first interval ending after beg, ends are sorted as intervals are disjoint
+    const int32_t *p = e;
+    while (n > 1) {
+        int32_t h = n >> 1;
+        p = p[h] <= beg ? p + h : p;
+        n -= h;
+    }
+    if (*p <= beg) ++p;
+    if (p == e + m->n[tid]) return 0;
+    return m->beg[m->off[tid] + (p - e)] < end;
+}
+
+void region_mask_destroy(region_mask_t *m)
+{
+    if (m == NULL) return;
+    free(m->off); free(m->n); free(m->beg); free(m->end); free(m->raw); free(m);
+}
+
+static void region_mask_gtf_rec(const gtf_rec_t *r, int tid, void *data)
+{
+    if (r->type == GTF_TRANS || r->type == GTF_EXON)
+        region_mask_add((region_mask_t*)data, tid, r->start - 1, r->end);
+}
+
+static int is_bed(const char *fn)
+{
+    int l = strlen(fn);
+    if (l >= 4 && strcmp(fn + l - 4, ".bed") == 0) return 1;
+    if (l >= 7 && strcmp(fn + l - 7, ".bed.gz") == 0) return 1;
+    return 0;
+}
+
+// BED (*.bed, *.bed.gz), GTF or snapshot written by index-gtf
+// transcript and exon spans of GTF are masked, names not in cname are skipped
+// @return value
+//    number of disjoint intervals
+int64_t region_mask_read(region_mask_t *m, const char *fn, chr_name_t *cname)
+{
+    if (gtfidx_is(fn)) {
+        gtfidx_t *x = gtfidx_load(fn); read_trans_t *T = read_trans_init(); int i;
+        gtfidx_trans(x, cname, T);
+        for (i = 0; i < T->trans_n; ++i) region_mask_add(m, T->t[i].tid, T->t[i].start - 1, T->t[i].end);
+        read_trans_free(T); gtfidx_close(x);
+    } else if (is_bed(fn)) {
+        gzFile fp = strcmp(fn, "-") == 0 ? gzdopen(fileno(stdin), "r") : gzopen(fn, "r");
+        if (fp == NULL) err_fatal(__func__, "Cannot open \"%s\"\n", fn);
+        kstream_t *ks = ks_init(fp); kstring_t str = {0, 0, NULL}; int dret;
+        while (ks_getuntil(ks, KS_SEP_LINE, &str, &dret) >= 0) {
+            char *p, *q; long beg, end;
+            if (str.l == 0 || str.s[0] == '#' || strncmp(str.s, "track", 5) == 0 || strncmp(str.s, "browser", 7) == 0) continue;
+            if ((p = strchr(str.s, '\t')) == NULL) err_fatal(__func__, "BED format error: \"%s\".\n", str.s);
+            *p++ = '\0';
+            beg = strtol(p, &q, 10);
+            if (q == p || *q != '\t') err_fatal(__func__, "BED format error in \"%s\".\n", fn);
+            end = strtol(q + 1, &p, 10);
+            if (p == q + 1) err_fatal(__func__, "BED format error in \"%s\".\n", fn);
+            region_mask_add(m, chr_name_id(cname, str.s), beg, end);
+        }
+        free(str.s); ks_destroy(ks); gzclose(fp);
+    } else gtf_read(fn, cname, 0, 1, region_mask_gtf_rec, m);
+    return region_mask_index(m);
+}
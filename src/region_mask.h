@@ -0,0 +1,27 @@
+#ifndef _REGION_MASK_H
+#define _REGION_MASK_H
+#include <stdint.h>
+#include "gtf.h"
+
+typedef struct {
+    int32_t tid, beg, end;
+} region_t;
+
+// masked regions (rRNA, repeats) as sorted disjoint intervals per tid
+// after region_mask_index(), intervals of tid are
+// beg/end[off[tid], off[tid]+n[tid]), 0-based, [beg, end)
+typedef struct {
+    int chr_n;
+    int64_t *off; int32_t *n;
+    int32_t *beg, *end;
+    region_t *raw; int64_t raw_n, raw_m; // added, not indexed yet
+} region_mask_t;
+
+region_mask_t *region_mask_init(void);
+void region_mask_add(region_mask_t *m, int tid, int32_t beg, int32_t end);
+int64_t region_mask_index(region_mask_t *m);
+int64_t region_mask_read(region_mask_t *m, const char *fn, chr_name_t *cname);
+int region_mask_overlap(const region_mask_t *m, int tid, int32_t beg, int32_t end);
+void region_mask_destroy(region_mask_t *m);
+
+#endif
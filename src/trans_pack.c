@@ -0,0 +1,101 @@
+/* trans_pack.c
+ *   compact in-memory read-transcript set
+ *   exon boundaries are delta-encoded as LEB128 varints, a typical
+ *   spliced read takes a few bytes per exon plus its name
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trans_pack.h"
+#include "utils.h"
+
+trans_pack_t *trans_pack_init(void)
+{
+    trans_pack_t *p = (trans_pack_t*)_err_calloc(1, sizeof(trans_pack_t));
+    p->m = 0x10000;
+    p->s = (uint8_t*)_err_malloc(p->m);
+    return p;
+}
+
+void trans_pack_destroy(trans_pack_t *p)
+{
+    if (p == NULL) return;
+    free(p->s); free(p);
+}
+
+static inline uint8_t *pack_put_u64(uint8_t *q, uint64_t x)
+{
+    while (x >= 0x80) *q++ = (uint8_t)(x | 0x80), x >>= 7;
+    *q++ = (uint8_t)x;
+    return q;
+}
+
+static inline const uint8_t *pack_get_u64(const uint8_t *q, uint64_t *x)
+{
+    uint64_t v = 0; int s = 0;
+    while (*q & 0x80) v |= (uint64_t)(*q++ & 0x7f) << s, s += 7;
+    *x = v | (uint64_t)*q++ << s;
+    return q;
+}
+
+#define zigzag_enc(x) ((uint64_t)(int64_t)(x) << 1 ^ (uint64_t)((int64_t)(x) >> 63))
+#define zigzag_dec(x) ((int64_t)((x) >> 1) ^ -(int64_t)((x) & 1))
+
+// t: exons sorted by start, as set_trans_name() leaves them
+int trans_pack_add(trans_pack_t *p, const trans_t *t, const char *name)
+{
+    int i, l_name = strlen(name);
+    if (t->exon_n == 0) return 0;
+    for (i = 1; i < t->exon_n; ++i)
+        if (t->exon[i].tid != t->exon[0].tid || t->exon[i].is_rev != t->exon[0].is_rev)
+            err_fatal(__func__, "exons of \"%s\" are on different references or strands.\n", name);
+    // at most 10 bytes a varint
+    int64_t max_l = 30 + 20 * (int64_t)t->exon_n + l_name;
+    while (p->l + max_l > p->m) {
+        p->m <<= 1;
+        p->s = (uint8_t*)_err_realloc(p->s, p->m);
+    }
+    uint8_t *q = p->s + p->l;
+    q = pack_put_u64(q, (uint64_t)(t->exon[0].tid + 1));
+    q = pack_put_u64(q, (uint64_t)t->exon_n << 1 | (t->exon[0].is_rev & 1));
+    q = pack_put_u64(q, (uint64_t)(uint32_t)t->exon[0].start);
+    for (i = 0; i < t->exon_n; ++i) {
+        if (i > 0) q = pack_put_u64(q, zigzag_enc((int64_t)t->exon[i].start - t->exon[i-1].end));
+        q = pack_put_u64(q, zigzag_enc((int64_t)t->exon[i].end - t->exon[i].start));
+    }
+    q = pack_put_u64(q, l_name);
+    memcpy(q, name, l_name); q += l_name;
+    p->l = q - p->s, p->n++;
+    return 1;
+}
+
+// decode the record at off into t, with its name in *name
+// t->tid, is_rev, start and end are set as by set_trans_name()
+// @return value
+//    offset of the next record, -1 at the end
+int64_t trans_pack_get(const trans_pack_t *p, int64_t off, trans_t *t, char **name, int *name_m)
+{
+    uint64_t x, tid, n, start; int i, is_rev;
+    if (off >= p->l) return -1;
+    const uint8_t *q = p->s + off;
+    q = pack_get_u64(q, &tid); q = pack_get_u64(q, &n); q = pack_get_u64(q, &start);
+    is_rev = n & 1, n >>= 1;
+    t->exon_n = 0;
+    for (i = 0; i < (int)n; ++i) {
+        if (i > 0) q = pack_get_u64(q, &x), start = t->exon[i-1].end + zigzag_dec(x);
+        q = pack_get_u64(q, &x);
+        add_exon(t, (int)tid - 1, (int)start, (int)(start + zigzag_dec(x)), is_rev);
+    }
+    q = pack_get_u64(q, &x);
+    if ((int)x + 1 > *name_m) {
+        *name_m = x + 1;
+        *name = (char*)_err_realloc(*name, *name_m);
+    }
+    memcpy(*name, q, x); (*name)[x] = '\0'; q += x;
+
+    t->tid = (int)tid - 1, t->is_rev = is_rev;
+    t->start = t->exon[0].start, t->end = t->exon[t->exon_n-1].end;
+    t->trans_id = *name;
+    return q - p->s;
+}
@@ -0,0 +1,21 @@
+#ifndef _TRANS_PACK_H
+#define _TRANS_PACK_H
+#include <stdint.h>
+#include "gtf.h"
+
+// read-transcripts packed back to back, one record each:
+//   varint(tid+1) varint(exon_n<<1|is_rev) varint(start of first exon)
+//   then per exon zigzag(end-start), and zigzag(start-previous end) before all but the first
+//   varint(l_name) name
+// all exons of a record share tid and strand
+typedef struct {
+    uint8_t *s; int64_t l, m;
+    int64_t n;               // number of records
+} trans_pack_t;
+
+trans_pack_t *trans_pack_init(void);
+void trans_pack_destroy(trans_pack_t *p);
+int trans_pack_add(trans_pack_t *p, const trans_t *t, const char *name);
+int64_t trans_pack_get(const trans_pack_t *p, int64_t off, trans_t *t, char **name, int *name_m);
+
+#endif
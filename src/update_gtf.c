@@ -14,7 +14,12 @@
 #include "htslib/sam.h"
 #include "utils.h"
 #include "gtf.h"
+#include "gtf_reader.h"
+#include "gtfidx.h"
 #include "bam2gtf.h"
+#include "update_gtf.h"
+#include "bam_lite.h"
+#include "kthread.h"
 
 #define bam_unmap(b) ((b)->core.flag & BAM_FUNMAP)
 
@@ -23,8 +28,9 @@ extern const char PROG[20];
 update_gtf_para *update_gtf_init_para(void) {
     update_gtf_para *ugp = (update_gtf_para*)_err_malloc(sizeof(update_gtf_para));
     ugp->input_mode = 0/*bam*/, ugp->full_len_level = 5/*most relax*/, ugp->uncla = 0, ugp->only_bam = 0;
-    ugp->intron_fp = NULL, ugp->out_gtf_fp = stdout; strcpy(ugp->source, PROG);
+    ugp->intron_fn = NULL, ugp->intron_fn_n = ugp->intron_fn_m = 0, ugp->out_gtf_fp = stdout; strcpy(ugp->source, PROG);
     ugp->min_exon = INTER_EXON_MIN_LEN, ugp->min_intron = INTRON_MIN_LEN, ugp->ss_dis = SPLICE_DISTANCE;
+    ugp->n_threads = 1, ugp->stream = 0, ugp->sort = NULL;
 
     return ugp;
 }
@@ -32,12 +38,13 @@ update_gtf_para *update_gtf_init_para(void) {
 int update_gtf_usage(void)
 {
     err_printf("\n");
-    err_printf("Usage:   %s update-gtf [option] <in.bam/in.gtf> <old.gtf> > new.gtf\n\n", PROG);
+    err_printf("Usage:   %s update-gtf [option] <in.bam/in.gtf> <old.gtf/old.gtf.gtfidx> > new.gtf\n\n", PROG);
     err_printf("Notice:  the BAM and GTF files should be sorted in advance.\n\n");
     err_printf("Options:\n\n");
     err_printf("         -m --input-mode  [STR]    format of input file <in.bam/in.gtf>, BAM file(b) or GTF file(g). [b]\n");
     err_printf("         -b --bam         [STR]    for GTF input <in.gtf>, BAM file is needed to obtain BAM header information. [NULL]\n");
-    err_printf("         -I --intron      [STR]    intron information file output by STAR(*.out.tab). [NONE]\n");
+    err_printf("         -I --intron      [STR]    intron information file output by STAR(*.out.tab), can be given\n");
+    err_printf("                                   more than once, junctions of all files are pooled. [NONE]\n");
     err_printf("         -e --min-exon    [INT]    minimum length of internal exon. [%d]\n", INTER_EXON_MIN_LEN);
     err_printf("         -i --intron-len  [INT]    minimum length of intron. [%d]\n", INTRON_MIN_LEN);
     err_printf("         -d --distance    [INT]    consider same if distance between two splice site is not bigger than d. [%d]\n", SPLICE_DISTANCE);
@@ -48,74 +55,128 @@ int update_gtf_usage(void)
     err_printf("         -s --source      [STR]    source field in GTF, program, database or project name. [gtools]\n");
     err_printf("         -n --only-bam             only output bam-derived transcript. [False]\n");
     err_printf("         -o --output               output GTF file. [stdout]\n");
+    err_printf("         -t --threads     [INT]    number of threads used to parse GTF files and to classify\n");
+    err_printf("                                   independent loci. [1]\n");
+    err_printf("         -S --stream               sweep coordinate-sorted BAM and print novel transcripts as soon as\n");
+    err_printf("                                   they are final, memory depends on locus depth. [False]\n");
+    err_printf("         -O --sort                 sort output GTF by position, as %s sort-gtf does. [False]\n", PROG);
     err_printf("\n");
     return 1;
 }
 
-void check_exon_junction(trans_t *bam_t, trans_t anno_t, int dis, int *iden_n, int *iden_intron_n, int *not_iden_iden, int *intron_map)
+// read exon i matches annotated exon j of transcript ti within dis, at exon start or end
+typedef struct {
+    int32_t ti, i, j, is_end;
+} site_hit_t;
+
+static int site_hit_comp(const void *_a, const void *_b)
 {
-    int i,j, left=0,right=0, last_j=-1;
-    *iden_n=0, *iden_intron_n = 0, *not_iden_iden=0;
-    for (i = 0; i < bam_t->exon_n; ++i) {
-        for (j = 0; j < anno_t.exon_n; ++j) {
-            // for exon
-            if (abs(bam_t->exon[i].start-anno_t.exon[j].start) <= dis || i==0) left = 1;
-            if (abs(bam_t->exon[i].end - anno_t.exon[j].end) <= dis || i==bam_t->exon_n-1) right = 1;
-            if (left) set_l_iden(bam_t->novel_exon_map[i]);
-            if (right) set_r_iden(bam_t->novel_exon_map[i]);
-            if (left && right) set_b_iden(bam_t->novel_exon_map[i]);
-            left = right = 0;
-            // for junction
-            if (i != bam_t->exon_n-1 && j != anno_t.exon_n-1) {
-                if (abs(bam_t->exon[i].end-anno_t.exon[j].end) <= dis) left = 1;
-                if (abs(bam_t->exon[i+1].start-anno_t.exon[j+1].start) <= dis) right= 1;
-                if (left) set_l_iden(bam_t->novel_sj_map[i]);
-                if (right) set_r_iden(bam_t->novel_sj_map[i]);
-                if (left && right) {
-                    set_b_iden(bam_t->novel_sj_map[i]);
-
-                    if (last_j != -1 && j != last_j+1) *not_iden_iden = 1;
-                    last_j = j; *iden_intron_n += 1;
-                    if (intron_map) intron_map[i] = 1;
-                }
-                *iden_n += (left+right);
+    site_hit_t *a = (site_hit_t*)_a, *b = (site_hit_t*)_b;
+    if (a->ti != b->ti) return a->ti - b->ti;
+    else if (a->i != b->i) return a->i - b->i;
+    else if (a->is_end != b->is_end) return a->is_end - b->is_end;
+    else return a->j - b->j;
+}
 
-                left = right = 0;
-                if (anno_t.exon[j+1].start > bam_t->exon[i+1].start) break;
+// look up every exon start/end of bam_t in the splice-site index
+// @return value
+//    number of hits, sorted by (ti, i, is_end, j)
+int collect_site_hits(trans_t *bam_t, anno_site_idx_t *sidx, int dis, site_hit_t **h, int *m)
+{
+    int i, k, n = 0, is_end, s_n;
+    for (i = 0; i < bam_t->exon_n; ++i) {
+        for (is_end = 0; is_end < 2; ++is_end) {
+            const anno_site_t *s = anno_site_get(sidx, bam_t->exon[i].tid, is_end, is_end ? bam_t->exon[i].end : bam_t->exon[i].start, dis, &s_n);
+            for (k = 0; k < s_n; ++k) {
+                if (n == *m) { *m = *m ? *m << 1 : 64; *h = (site_hit_t*)_err_realloc(*h, *m * sizeof(site_hit_t)); }
+                (*h)[n].ti = s[k].i, (*h)[n].i = i, (*h)[n].j = s[k].j, (*h)[n].is_end = is_end;
+                n++;
             }
         }
     }
+    qsort(*h, n, sizeof(site_hit_t), site_hit_comp);
+    return n;
 }
 
-int check_short_sj1(int tid, int start, int end, uint8_t is_rev, intron_group_t *I, int i_start, int dis)
+// last annotated exon compared with read exon i: exon j is compared until
+// anno_t.exon[j+1] starts after bam_t->exon[i+1]
+static int exon_window_end(trans_t *bam_t, trans_t *anno_t, int i)
 {
-    int i = i_start;
-    while (i < I->intron_n) {
-        if (I->intron[i].tid > tid || I->intron[i].start > start) return 0;
-        if (I->intron[i].is_rev != is_rev) { i++; continue; }
-
-        if (abs(I->intron[i].start-start)<=dis && abs(I->intron[i].end-end)<=dis) return 1;
-        else i++;
+    int a_last = anno_t->exon_n-1;
+    if (i == bam_t->exon_n-1) return a_last;
+    int lo = 1, hi = a_last + 1, pos = bam_t->exon[i+1].start;
+    while (lo < hi) {
+        int mid = lo + ((hi - lo) >> 1);
+        if (anno_t->exon[mid].start > pos) hi = mid;
+        else lo = mid + 1;
     }
-    return 0;
+    return lo <= a_last ? lo - 1 : a_last;
 }
 
-int check_short_sj(trans_t *bam_t, int *intron_map, intron_group_t *I, int *intron_i, int dis)
+// h[0, h_n): site hits of bam_t on anno_t, sorted by (i, is_end, j)
+void check_exon_junction(trans_t *bam_t, trans_t *anno_t, site_hit_t *h, int h_n, int *iden_n, int *iden_intron_n, int *not_iden_iden, int *intron_map)
 {
-    int i = *intron_i, j;
-    while (i < I->intron_n) {
-        if (I->intron[i].tid < bam_t->tid || (I->intron[i].tid == bam_t->tid && I->intron[i].end <= bam_t->start)) {
-            i++; *intron_i = i;
-        } else if (I->intron[i].tid > bam_t->tid) return 0;
+    int i, last_j=-1, b_last = bam_t->exon_n-1, a_last = anno_t->exon_n-1;
+    int p = 0, s0, s1, e1, n0, n1; // hits of exon i: start [s0, s1), end [s1, e1); start of exon i+1: [e1, n1)
+    *iden_n=0, *iden_intron_n = 0, *not_iden_iden=0;
+    for (i = 0; i < bam_t->exon_n; ++i) {
+        int J = exon_window_end(bam_t, anno_t, i), left = (i == 0), right = (i == b_last), both = 0, x, y;
+        while (p < h_n && h[p].i < i) ++p;
+        s0 = p; for (s1 = s0; s1 < h_n && h[s1].i == i && h[s1].is_end == 0; ++s1);
+        for (e1 = s1; e1 < h_n && h[e1].i == i; ++e1);
+        n0 = e1; for (n1 = n0; n1 < h_n && h[n1].i == i+1 && h[n1].is_end == 0; ++n1);
+
+        // for exon
+        if (s0 < s1 && h[s0].j <= J) left = 1;
+        if (s1 < e1 && h[s1].j <= J) right = 1;
+        if (i == 0 || i == b_last) both = left && right;
         else {
-            for (j = 0; j < bam_t->exon_n-1; ++j) {
-                if (intron_map[j] == 0 && check_short_sj1(bam_t->tid, bam_t->exon[j].end+1, bam_t->exon[j+1].start-1, bam_t->is_rev, I, i, dis) == 0)
-                    return 0;
+            for (x = s0, y = s1; x < s1 && y < e1 && h[x].j <= J && h[y].j <= J; ) {
+                if (h[x].j == h[y].j) { both = 1; break; }
+                else if (h[x].j < h[y].j) ++x;
+                else ++y;
+            }
+        }
+        if (left) set_l_iden(bam_t->novel_exon_map[i]);
+        if (right) set_r_iden(bam_t->novel_exon_map[i]);
+        if (both) set_b_iden(bam_t->novel_exon_map[i]);
+
+        // for junction: exon[i].end vs exon[j].end, exon[i+1].start vs exon[j+1].start
+        if (i == b_last || a_last == 0) continue;
+        int jJ = J < a_last ? J : a_last-1;
+        for (x = s1; x < e1 && h[x].j <= jJ; ++x) {
+            set_l_iden(bam_t->novel_sj_map[i]);
+            *iden_n += 1;
+        }
+        for (y = n0; y < n1 && h[y].j <= jJ+1; ++y) {
+            if (h[y].j == 0) continue;
+            set_r_iden(bam_t->novel_sj_map[i]);
+            *iden_n += 1;
+        }
+        for (x = s1, y = n0; x < e1 && y < n1 && h[x].j <= jJ; ) {
+            if (h[y].j == 0 || h[y].j - 1 < h[x].j) ++y;
+            else if (h[y].j - 1 > h[x].j) ++x;
+            else {
+                set_b_iden(bam_t->novel_sj_map[i]);
+                if (last_j != -1 && h[x].j != last_j+1) *not_iden_iden = 1;
+                last_j = h[x].j; *iden_intron_n += 1;
+                if (intron_map) intron_map[i] = 1;
+                ++x, ++y;
             }
-            return 1;
         }
     }
-    return 0;
+}
+
+// every junction of bam_t not matched by the annotation (intron_map[j] == 0)
+// is supported by a short-read junction in I
+int check_short_sj(trans_t *bam_t, int *intron_map, intron_group_t *I, int dis)
+{
+    int j;
+    for (j = 0; j < bam_t->exon_n-1; ++j) {
+        if (intron_map[j] == 0 && intron_group_get(I, bam_t->tid, bam_t->is_rev, bam_t->exon[j].end+1, bam_t->exon[j+1].start-1, dis) == 0)
+            return 0;
+    }
+    return 1;
 }
 
 int exon_overlap(exon_t e1, exon_t e2)
@@ -193,7 +254,7 @@ void set_full(trans_t *t, int l)
     }
 }
 
-int check_novel_intron(trans_t *bam_t, trans_t anno_t, intron_group_t *I, int *intron_i, int dis, int l)
+int check_novel_intron(trans_t *bam_t, trans_t anno_t, site_hit_t *h, int h_n, intron_group_t *I, int dis, int l)
 {
     if (bam_t->is_rev != anno_t.is_rev || bam_t->exon_n < 2) return 3;
     // check full-length
@@ -202,14 +263,14 @@ int check_novel_intron(trans_t *bam_t, trans_t anno_t, intron_group_t *I, int *i
     // check novel
     int iden_n=0, iden_intron_n = 0, not_iden_iden=0;
     int *intron_map = (int*)_err_calloc((bam_t->exon_n-1), sizeof(int));
-    check_exon_junction(bam_t, anno_t, dis, &iden_n, &iden_intron_n, &not_iden_iden, intron_map);
+    check_exon_junction(bam_t, &anno_t, h, h_n, &iden_n, &iden_intron_n, &not_iden_iden, intron_map);
 
     // analyse check result
     if (iden_intron_n == bam_t->exon_n-1 && not_iden_iden == 0) bam_t->all_iden=1;
     else {
         if (iden_n > 0) {
-            if (check_short_sj(bam_t, intron_map, I, intron_i, dis)) {
-                strcpy(bam_t->gname, anno_t.gname), strcpy(bam_t->gid, anno_t.gid);
+            if (check_short_sj(bam_t, intron_map, I, dis)) {
+                bam_t->gname = anno_t.gname, bam_t->gid = anno_t.gid;
                 bam_t->novel = 1;
             }
         } else {
@@ -227,7 +288,7 @@ int check_novel_intron(trans_t *bam_t, trans_t anno_t, intron_group_t *I, int *i
 //    1: novel, and share identical splice site (gene_id)
 //    2: totally identical, can NOT be added to any anno
 //    3: other cases that cannot be added to this anno(not full-length to any anno-trans)
-int check_novel1(trans_t *bam_t, trans_t anno_t, int dis, int l)
+int check_novel1(trans_t *bam_t, trans_t anno_t, site_hit_t *h, int h_n, int dis, int l)
 {
     if (bam_t->is_rev != anno_t.is_rev || bam_t->exon_n < 2) return 0;
     // check full-length
@@ -235,12 +296,12 @@ int check_novel1(trans_t *bam_t, trans_t anno_t, int dis, int l)
 
     // check novel
     int iden_n=0, iden_intron_n=0, not_iden_iden=0;
-    check_exon_junction(bam_t, anno_t, dis, &iden_n, &iden_intron_n, &not_iden_iden, NULL);
+    check_exon_junction(bam_t, &anno_t, h, h_n, &iden_n, &iden_intron_n, &not_iden_iden, NULL);
 
     // analyse check result
     if (iden_intron_n == bam_t->exon_n-1 && not_iden_iden == 0) bam_t->all_iden=1;
     else if (iden_n > 0) {
-        strcpy(bam_t->gname, anno_t.gname), strcpy(bam_t->gid, anno_t.gid);
+        bam_t->gname = anno_t.gname, bam_t->gid = anno_t.gid;
         bam_t->novel = 1;
     } else {
         bam_t->all_novel = 1;
@@ -268,106 +329,569 @@ int merge_trans1(trans_t *t1, trans_t *t2, int dis)
     else return 0;
 }
 
-int merge_trans(trans_t *t, read_trans_t *T, int dis)
+// junctions of novel transcripts, splice sites are bucketed by (dis+1)
+// so two sites within dis fall in the same or neighbouring buckets
+typedef struct {
+    int32_t tid, don, acc; uint8_t type; // type: is_rev | is_first<<1
+    int32_t head;                        // first entry, -1: empty slot
+} junc_slot_t;
+
+typedef struct {
+    int32_t i, next; // global index: index in novel_T plus junc_idx_t.base
+} junc_ent_t;
+
+typedef struct {
+    int w, base, live;      // base: global index of novel_T->t[0], live: of the first not flushed one
+    junc_slot_t *slot; uint32_t slot_n, slot_m;
+    junc_ent_t *ent; int ent_n, ent_m;
+} junc_idx_t;
+
+junc_idx_t *junc_idx_init(int dis)
+{
+    junc_idx_t *x = (junc_idx_t*)_err_calloc(1, sizeof(junc_idx_t));
+    x->w = dis + 1;
+    x->slot_m = 1024;
+    x->slot = (junc_slot_t*)_err_malloc(x->slot_m * sizeof(junc_slot_t));
+    int i; for (i = 0; i < (int)x->slot_m; ++i) x->slot[i].head = -1;
+    x->ent_m = 1024;
+    x->ent = (junc_ent_t*)_err_malloc(x->ent_m * sizeof(junc_ent_t));
+    return x;
+}
+
+void junc_idx_destroy(junc_idx_t *x) { free(x->slot); free(x->ent); free(x); }
+
+static inline uint32_t junc_idx_hash(int32_t tid, int32_t don, int32_t acc, uint8_t type)
+{
+    uint64_t k = (uint64_t)(uint32_t)don << 32 | (uint32_t)acc;
+    return (uint32_t)hash_64(k ^ ((uint64_t)tid << 2 | type) * 0x9E3779B97F4A7C15ULL);
+}
+
+// slot holding the bucket, or the empty slot it would go to
+static junc_slot_t *junc_idx_slot(junc_idx_t *x, int32_t tid, int32_t don, int32_t acc, uint8_t type)
 {
-    int i; 
-    for (i = T->trans_n-1; i >= 0; --i) {
-        if (merge_trans1(t, T->t+i, dis)) return 1;
-        if (t->tid > T->t[i].tid || t->start > T->t[i].end) return 0;
+    uint32_t mask = x->slot_m - 1, k = junc_idx_hash(tid, don, acc, type) & mask;
+    while (x->slot[k].head >= 0) {
+        junc_slot_t *s = x->slot + k;
+        if (s->tid == tid && s->don == don && s->acc == acc && s->type == type) break;
+        k = (k + 1) & mask;
     }
-    return 0;
+    return x->slot + k;
 }
 
-int check_novel_trans(read_trans_t *bam_T, read_trans_t *anno_T, intron_group_t *I, read_trans_t *novel_T, update_gtf_para *ugp)
-{
-    int i=0, j=0, last_j=0, k=0;
-    int unclassify = 0; char uncla[1024];
-    while (i < bam_T->trans_n && j < anno_T->trans_n) {
-        // check if redundant
-        if (merge_trans(bam_T->t+i, novel_T, ugp->ss_dis)) { 
-            //err_printf("merge: %s\n", bam_T->t[i].tname);
-            i++; continue; 
-        } else if (bam_T->t[i].tid > anno_T->t[j].tid || (bam_T->t[i].tid == anno_T->t[j].tid && bam_T->t[i].start > anno_T->t[j].end)) {
-            if (j == last_j) last_j++;
-            j++;
-        } // compare with all anno trans done
-        else if (anno_T->t[j].tid > bam_T->t[i].tid || (anno_T->t[j].tid == bam_T->t[i].tid && anno_T->t[j].start > bam_T->t[i].end)) {
-            //if (bam_T->t[i].novel != 1) err_printf("unrecover: %s\n", bam_T->t[i].tname);
-            set_full(bam_T->t+i, ugp->full_len_level);
-            if (bam_T->t[i].full && bam_T->t[i].novel) {
-                if (bam_T->t[i].all_iden) {
-                    err_printf("Error: all iden %s.\n", bam_T->t[i].tname);
-                    exit(0);
-                } else if (bam_T->t[i].all_novel && ugp->uncla) {
-                    add_read_trans(novel_T, bam_T->t[i]);
-                    sprintf(uncla, "UNCLA_%d", unclassify++);
-                    set_trans_name(novel_T->t+novel_T->trans_n-1, NULL, uncla, NULL, NULL);
-                } else if (bam_T->t[i].all_novel == 0) {
-                    add_read_trans(novel_T, bam_T->t[i]);
-                    set_trans_name(novel_T->t+novel_T->trans_n-1, NULL, NULL, NULL, NULL);
-                }
+static void junc_idx_rehash(junc_idx_t *x)
+{
+    junc_slot_t *old = x->slot; uint32_t i, old_m = x->slot_m;
+    x->slot_m <<= 1;
+    x->slot = (junc_slot_t*)_err_malloc(x->slot_m * sizeof(junc_slot_t));
+    for (i = 0; i < x->slot_m; ++i) x->slot[i].head = -1;
+    for (i = 0; i < old_m; ++i) {
+        if (old[i].head < 0) continue;
+        *junc_idx_slot(x, old[i].tid, old[i].don, old[i].acc, old[i].type) = old[i];
+    }
+    free(old);
+}
+
+static void junc_idx_add1(junc_idx_t *x, int32_t tid, int32_t don, int32_t acc, uint8_t type, int i)
+{
+    if ((x->slot_n + 1) * 4 > x->slot_m * 3) junc_idx_rehash(x); // load factor 0.75
+    junc_slot_t *s = junc_idx_slot(x, tid, don / x->w, acc / x->w, type);
+    if (s->head < 0) {
+        s->tid = tid, s->don = don / x->w, s->acc = acc / x->w, s->type = type;
+        x->slot_n++;
+    } else if (x->ent[s->head].i == i) return; // same bucket twice in one transcript
+    if (x->ent_n == x->ent_m) _realloc(x->ent, x->ent_m, junc_ent_t)
+    x->ent[x->ent_n].i = i, x->ent[x->ent_n].next = s->head;
+    s->head = x->ent_n++;
+}
+
+// index all junctions of novel_T->t[i], the first one is also kept on its own
+void junc_idx_add(junc_idx_t *x, read_trans_t *novel_T, int i)
+{
+    trans_t *t = novel_T->t + i; int j;
+    for (j = 0; j < t->exon_n-1; ++j)
+        junc_idx_add1(x, t->tid, t->exon[j].end, t->exon[j+1].start, t->is_rev, x->base + i);
+    if (t->exon_n > 1)
+        junc_idx_add1(x, t->tid, t->exon[0].end, t->exon[1].start, t->is_rev | 2, x->base + i);
+}
+
+static void junc_idx_get(junc_idx_t *x, int32_t tid, int32_t don, int32_t acc, uint8_t type, int **b, int *n, int *m)
+{
+    int d, a;
+    for (d = don / x->w - 1; d <= don / x->w + 1; ++d) {
+        for (a = acc / x->w - 1; a <= acc / x->w + 1; ++a) {
+            junc_slot_t *s = junc_idx_slot(x, tid, d, a, type);
+            int e;
+            for (e = s->head; e >= 0; e = x->ent[e].next) {
+                if (*n == *m) { *m = *m ? *m << 1 : 16; *b = (int*)_err_realloc(*b, *m * sizeof(int)); }
+                (*b)[(*n)++] = x->ent[e].i;
             }
+        }
+    }
+}
 
-            i++; j = last_j;
-        } else {
-            if (I->intron_n > 0) check_novel_intron(bam_T->t+i, anno_T->t[j], I, &k, ugp->ss_dis, ugp->full_len_level);
-            else check_novel1(bam_T->t+i, anno_T->t[j], ugp->ss_dis, ugp->full_len_level);
-
-            if (bam_T->t[i].all_iden == 1) {
-                //err_printf("all-iden: %s\n", bam_T->t[i].tname);
-                i++; j = last_j;
-            } else {
-                j++;
+static int int_desc_comp(const void *a, const void *b) { return *(int*)b - *(int*)a; }
+
+// merge t into the latest novel transcript that is identical to it,
+// contains it or is contained in it
+// candidates share t's first junction, or have their first junction in t
+int merge_trans(trans_t *t, read_trans_t *T, junc_idx_t *x, int dis, int **b, int *m)
+{
+    int i, j, n = 0;
+    if (t->exon_n < 2) return 0;
+    junc_idx_get(x, t->tid, t->exon[0].end, t->exon[1].start, t->is_rev, b, &n, m);
+    for (j = 0; j < t->exon_n-1; ++j)
+        junc_idx_get(x, t->tid, t->exon[j].end, t->exon[j+1].start, t->is_rev | 2, b, &n, m);
+    if (n == 0) return 0;
+    qsort(*b, n, sizeof(int), int_desc_comp);
+    for (i = 0; i < n && (*b)[i] >= x->live; ++i) { // flushed ones are at the end
+        if (i > 0 && (*b)[i] == (*b)[i-1]) continue;
+        if (merge_trans1(t, T->t+(*b)[i]-x->base, dis)) return 1;
+    }
+    return 0;
+}
+
+// compare t with every annotated transcript it overlaps, in annotation order
+// @return value
+//    1: all splice sites are identical with an annotated transcript
+//    0: otherwise, t is classified by its full/novel flags
+typedef struct {
+    int *cand; int cand_m;      // overlapping annotated transcripts
+    site_hit_t *hit; int hit_m; // splice-site hits of one read
+} check_buf_t;
+
+// compare t with every annotated transcript it overlaps, in annotation order
+// @return value
+//    1: all splice sites are identical with an annotated transcript
+//    0: otherwise, t is classified by its full/novel flags
+int check_novel_trans1(trans_t *t, read_trans_t *anno_T, anno_idx_t *idx, anno_site_idx_t *sidx, intron_group_t *I, update_gtf_para *ugp, check_buf_t *buf)
+{
+    int j, n = anno_idx_overlap(idx, t->tid, t->start-1, t->end, &buf->cand, &buf->cand_m);
+    if (n == 0) return 0;
+    int h_n = collect_site_hits(t, sidx, ugp->ss_dis, &buf->hit, &buf->hit_m), h0 = 0, h1;
+    for (j = 0; j < n; ++j) {
+        int ti = buf->cand[j];
+        while (h0 < h_n && buf->hit[h0].ti < ti) ++h0;
+        for (h1 = h0; h1 < h_n && buf->hit[h1].ti == ti; ++h1);
+        if (I->intron_n > 0) check_novel_intron(t, anno_T->t[ti], buf->hit+h0, h1-h0, I, ugp->ss_dis, ugp->full_len_level);
+        else check_novel1(t, anno_T->t[ti], buf->hit+h0, h1-h0, ugp->ss_dis, ugp->full_len_level);
+        if (t->all_iden == 1) return 1;
+        h0 = h1;
+    }
+    return 0;
+}
+
+typedef struct {
+    read_trans_t *anno_T; anno_idx_t *idx; anno_site_idx_t *sidx; intron_group_t *I;
+    int own_sidx;
+    read_trans_t *novel_T; junc_idx_t *x; int unclassify, name_uncla; // name_uncla == 0: only novel_gene_flag is set
+    update_gtf_para *ugp;
+    check_buf_t buf; int *merge, merge_m;
+} novel_aux_t;
+
+// sidx: shared splice-site index, NULL: built from anno_T
+novel_aux_t *novel_aux_init(read_trans_t *anno_T, anno_idx_t *idx, anno_site_idx_t *sidx, intron_group_t *I, read_trans_t *novel_T, update_gtf_para *ugp)
+{
+    novel_aux_t *a = (novel_aux_t*)_err_calloc(1, sizeof(novel_aux_t));
+    a->anno_T = anno_T; a->idx = idx; a->I = I; a->novel_T = novel_T; a->ugp = ugp;
+    if (sidx) a->sidx = sidx;
+    else a->sidx = anno_site_build(anno_T), a->own_sidx = 1;
+    a->x = junc_idx_init(ugp->ss_dis);
+    a->name_uncla = 1;
+    return a;
+}
+
+void novel_aux_destroy(novel_aux_t *a)
+{
+    if (a->own_sidx) anno_site_destroy(a->sidx);
+    junc_idx_destroy(a->x);
+    free(a->buf.cand); free(a->buf.hit); free(a->merge); free(a);
+}
+
+// classify one read-transcript, add it to novel_T if it is a full-length novel one
+void check_novel_trans_add(novel_aux_t *a, trans_t *t)
+{
+    update_gtf_para *ugp = a->ugp; read_trans_t *novel_T = a->novel_T; char uncla[1024];
+    // check if redundant
+    if (merge_trans(t, novel_T, a->x, ugp->ss_dis, &a->merge, &a->merge_m)) return;
+    if (check_novel_trans1(t, a->anno_T, a->idx, a->sidx, a->I, ugp, &a->buf)) {
+        //err_printf("all-iden: %s\n", t->tname);
+        return;
+    }
+    // compare with all anno trans done
+    set_full(t, ugp->full_len_level);
+    if (t->full && t->novel) {
+        if (t->all_iden) {
+            err_printf("Error: all iden %s.\n", t->tname);
+            exit(0);
+        } else if (t->all_novel && ugp->uncla) {
+            add_read_trans(novel_T, t);
+            novel_T->t[novel_T->trans_n-1].novel_gene_flag = 1;
+            if (a->name_uncla) {
+                sprintf(uncla, "UNCLA_%d", a->unclassify++);
+                set_trans_name(novel_T->t+novel_T->trans_n-1, NULL, str_pool_put(novel_T->sp, uncla), NULL, NULL);
             }
+            junc_idx_add(a->x, novel_T, novel_T->trans_n-1);
+        } else if (t->all_novel == 0) {
+            add_read_trans(novel_T, t);
+            set_trans_name(novel_T->t+novel_T->trans_n-1, NULL, NULL, NULL, NULL);
+            junc_idx_add(a->x, novel_T, novel_T->trans_n-1);
         }
     }
+}
+
+int check_novel_trans(read_trans_t *bam_T, read_trans_t *anno_T, anno_idx_t *idx, intron_group_t *I, read_trans_t *novel_T, update_gtf_para *ugp)
+{
+    int i;
+    novel_aux_t *a = novel_aux_init(anno_T, idx, NULL, I, novel_T, ugp);
+    for (i = 0; i < bam_T->trans_n; ++i) check_novel_trans_add(a, bam_T->t+i);
+    novel_aux_destroy(a);
     return 0;
 }
 
-// from annotation gtf file extract transcript-exon structure
-int read_anno_trans(FILE *fp, bam_hdr_t *h, read_trans_t *T)
-{
-    char line[1024], ref[100]="\0", type[20]="\0"; int start, end; char strand, add_info[1024], gname[100];
-    trans_t *t = trans_init(1);
-    while (fgets(line, 1024, fp) != NULL) {
-        sscanf(line, "%s\t%*s\t%s\t%d\t%d\t%*s\t%c\t%*s\t%[^\n]", ref, type, &start, &end, &strand, add_info);
-        uint8_t is_rev = (strand == '-' ? 1 : 0);
-        if (strcmp(type, "transcript") == 0) {
-            if (t->exon_n > 1) {
-                add_read_trans(T, *t);
-                set_trans_name(T->t+T->trans_n-1, NULL, NULL, NULL, NULL);
-                // for bam_trans
-                T->t[T->trans_n-1].novel_exon_map = (uint8_t*)calloc(t->exon_n, sizeof(uint8_t));
-                T->t[T->trans_n-1].novel_sj_map = (uint8_t*)calloc(t->exon_n-1, sizeof(uint8_t));
-                T->t[T->trans_n-1].lfull = 0, T->t[T->trans_n-1].lnoth = 1, T->t[T->trans_n-1].rfull = 0, T->t[T->trans_n-1].rnoth = 1;
-                T->t[T->trans_n-1].novel = 0, T->t[T->trans_n-1].all_novel=0, T->t[T->trans_n-1].all_iden=0;
+static void novel_trans_print1(trans_t *t, bam_hdr_t *h, update_gtf_para *ugp)
+{
+    if (ugp->sort == NULL) {
+        print_read_trans1(t, h, ugp->source, ugp->out_gtf_fp);
+        return;
+    }
+    kstring_t s = {0, 0, NULL};
+    sprint_read_trans1(&s, t, h, ugp->source);
+    gtf_sort_push(ugp->sort, s.s, s.l);
+    free(s.s);
+}
+
+// print the leading novel transcripts that no read starting at or after
+// (tid, pos) can be merged into, tid < 0: all of them
+// output order is the same as without streaming
+static int novel_trans_flush(novel_aux_t *a, int tid, int pos, bam_hdr_t *h)
+{
+    read_trans_t *T = a->novel_T; junc_idx_t *x = a->x;
+    int i, k = x->live - x->base, dis = a->ugp->ss_dis; // T->t[0..k) are printed
+    while (k < T->trans_n && (tid < 0 || T->t[k].tid != tid || T->t[k].end + dis < pos)) {
+        novel_trans_print1(T->t+k, h, a->ugp);
+        ++k, ++x->live;
+    }
+    // drop printed ones once they outnumber the others, and their junctions with them
+    if (tid >= 0 && k >= 1024 && k >= T->trans_n - k) {
+        read_trans_shift(T, k);
+        a->x = junc_idx_init(dis);
+        a->x->base = a->x->live = x->live;
+        for (i = 0; i < T->trans_n; ++i) junc_idx_add(a->x, T, i);
+        junc_idx_destroy(x);
+    }
+    return k;
+}
+
+// clear maps and flags of a reused read-transcript before it is classified
+static void novel_trans_reset(trans_t *t, int *map_m)
+{
+    if (t->exon_n > *map_m) {
+        *map_m = t->exon_n;
+        t->novel_exon_map = (uint8_t*)_err_realloc(t->novel_exon_map, *map_m * sizeof(uint8_t));
+        t->novel_sj_map = (uint8_t*)_err_realloc(t->novel_sj_map, *map_m * sizeof(uint8_t));
+    }
+    memset(t->novel_exon_map, 0, *map_m); memset(t->novel_sj_map, 0, *map_m);
+    t->gid = t->gname = "";
+    t->lfull = 0, t->lnoth = 1, t->rfull = 0, t->rnoth = 1;
+    t->novel = 0, t->all_novel = 0, t->all_iden = 0;
+}
+
+// packed reads are decoded one at a time into a reused transcript
+int check_novel_trans_pack(trans_pack_t *P, read_trans_t *anno_T, anno_idx_t *idx, intron_group_t *I, read_trans_t *novel_T, update_gtf_para *ugp)
+{
+    novel_aux_t *a = novel_aux_init(anno_T, idx, NULL, I, novel_T, ugp);
+    trans_t *t = trans_init(1); int map_m = 0, name_m = 0; char *name = NULL; int64_t off = 0;
+    t->novel_exon_map = t->novel_sj_map = NULL;
+    while ((off = trans_pack_get(P, off, t, &name, &name_m)) >= 0) {
+        novel_trans_reset(t, &map_m);
+        check_novel_trans_add(a, t);
+    }
+    free(name); free(t->novel_exon_map); free(t->novel_sj_map); trans_free(t);
+    novel_aux_destroy(a);
+    return 0;
+}
+
+// reads whose spans are more than ss_dis apart can not share a junction,
+// so loci are classified independently: reads are merged into clusters
+// by overlap, as genes are in read_gene_group(), and clusters are run by
+// kt_for() from the largest one
+typedef struct {
+    int32_t tid, start, end, i;
+} locus_read_t;
+
+static int locus_read_comp(const void *_a, const void *_b)
+{
+    locus_read_t *a = (locus_read_t*)_a, *b = (locus_read_t*)_b;
+    if (a->tid != b->tid) return a->tid - b->tid;
+    else if (a->start != b->start) return a->start - b->start;
+    else return a->i - b->i;
+}
+
+static int uint64_comp(const void *_a, const void *_b)
+{
+    uint64_t a = *(uint64_t*)_a, b = *(uint64_t*)_b;
+    return (a > b) - (a < b);
+}
+
+typedef struct {
+    int32_t ord, w, j; // novel transcript j of worker w, from read ord
+} locus_novel_t;
+
+static int locus_novel_comp(const void *_a, const void *_b)
+{
+    return ((locus_novel_t*)_a)->ord - ((locus_novel_t*)_b)->ord;
+}
+
+typedef struct {
+    novel_aux_t *a; read_trans_t *novel_T;
+    int *ord, ord_m;                  // ord[k]: input index of the read novel_T->t[k] comes from
+    trans_t *t; int map_m, name_m; char *name; // decoded packed read
+} locus_worker_t;
+
+typedef struct {
+    read_trans_t *bam_T; trans_pack_t *P; int64_t *off; // read i: bam_T->t[i] or P at off[i]
+    int *read; int *clu_off;          // reads of cluster c in input order: read[clu_off[c], clu_off[c+1])
+    uint64_t *job;                    // (~size)<<32 | cluster
+    locus_worker_t *w;
+} locus_aux_t;
+
+static void locus_worker(void *data, long k, int tid)
+{
+    locus_aux_t *L = (locus_aux_t*)data; locus_worker_t *w = L->w + tid;
+    int j, c = (uint32_t)L->job[k];
+    for (j = L->clu_off[c]; j < L->clu_off[c+1]; ++j) {
+        int i = L->read[j], n = w->novel_T->trans_n; trans_t *t;
+        if (L->P) {
+            trans_pack_get(L->P, L->off[i], w->t, &w->name, &w->name_m);
+            novel_trans_reset(w->t, &w->map_m);
+            t = w->t;
+        } else t = L->bam_T->t + i;
+        check_novel_trans_add(w->a, t);
+        if (w->novel_T->trans_n > n) {
+            if (n >= w->ord_m) {
+                w->ord_m = w->novel_T->trans_m;
+                w->ord = (int*)_err_realloc(w->ord, w->ord_m * sizeof(int));
             }
-            t->exon_n = 0;
-        } else if (strcmp(type, "exon") == 0) { // exon
-            add_exon(t, bam_name2id(h, ref), start, end, is_rev);
-            char tag[20]="gene_id";
-            gtf_add_info(add_info, tag, gname); strcpy(t->gid, gname);
-            strcpy(tag, "gene_name");
-            gtf_add_info(add_info, tag, gname); strcpy(t->gname, gname);
-            strcpy(tag, "transcript_name");
-            gtf_add_info(add_info, tag, gname); strcpy(t->tname, gname);
-            strcpy(tag, "transcript_id");
-            gtf_add_info(add_info, tag, gname); strcpy(t->trans_id, gname);
+            w->ord[n] = i;
+        }
+    }
+}
+
+// multi-threaded check_novel_trans()/check_novel_trans_pack(), bam_T or P is NULL
+// novel_T and UNCLA_%d numbering are the same as with one thread
+int check_novel_trans_locus(read_trans_t *bam_T, trans_pack_t *P, read_trans_t *anno_T, anno_idx_t *idx, intron_group_t *I, read_trans_t *novel_T, update_gtf_para *ugp)
+{
+    int i, j, n = bam_T ? bam_T->trans_n : P->n, clu_n = 0, n_threads = ugp->n_threads;
+    locus_aux_t L; memset(&L, 0, sizeof(L));
+    L.bam_T = bam_T, L.P = P;
+
+    // read spans, in input order
+    locus_read_t *r = (locus_read_t*)_err_malloc((n > 0 ? n : 1) * sizeof(locus_read_t));
+    if (P) {
+        trans_t *t = trans_init(1); char *name = NULL; int name_m = 0; int64_t off = 0, next;
+        L.off = (int64_t*)_err_malloc((n > 0 ? n : 1) * sizeof(int64_t));
+        for (i = 0; (next = trans_pack_get(P, off, t, &name, &name_m)) >= 0; ++i, off = next) {
+            L.off[i] = off;
+            r[i].tid = t->tid, r[i].start = t->start, r[i].end = t->end, r[i].i = i;
+        }
+        free(name); trans_free(t);
+    } else {
+        for (i = 0; i < n; ++i)
+            r[i].tid = bam_T->t[i].tid, r[i].start = bam_T->t[i].start, r[i].end = bam_T->t[i].end, r[i].i = i;
+    }
+
+    // merge overlapping spans into clusters
+    int *clu = (int*)_err_malloc((n > 0 ? n : 1) * sizeof(int)), last_tid = -1, last_end = 0;
+    if (n > 0) qsort(r, n, sizeof(locus_read_t), locus_read_comp);
+    for (j = 0; j < n; ++j) {
+        if (clu_n == 0 || r[j].tid != last_tid || r[j].start > last_end + ugp->ss_dis) {
+            last_tid = r[j].tid, last_end = r[j].end;
+            clu_n++;
+        } else if (r[j].end > last_end) last_end = r[j].end;
+        clu[r[j].i] = clu_n - 1;
+    }
+    free(r);
+    L.clu_off = (int*)_err_calloc(clu_n + 1, sizeof(int));
+    L.read = (int*)_err_malloc((n > 0 ? n : 1) * sizeof(int));
+    for (i = 0; i < n; ++i) L.clu_off[clu[i]+1]++;
+    for (j = 1; j <= clu_n; ++j) L.clu_off[j] += L.clu_off[j-1];
+    for (i = 0; i < n; ++i) L.read[L.clu_off[clu[i]]++] = i;
+    for (j = clu_n; j > 0; --j) L.clu_off[j] = L.clu_off[j-1];
+    L.clu_off[0] = 0;
+    free(clu);
+
+    // largest clusters first, they decide the run time
+    L.job = (uint64_t*)_err_malloc((clu_n > 0 ? clu_n : 1) * sizeof(uint64_t));
+    for (j = 0; j < clu_n; ++j)
+        L.job[j] = (uint64_t)(uint32_t)~(L.clu_off[j+1] - L.clu_off[j]) << 32 | j;
+    if (clu_n > 0) qsort(L.job, clu_n, sizeof(uint64_t), uint64_comp);
+
+    anno_site_idx_t *sidx = anno_site_build(anno_T);
+    L.w = (locus_worker_t*)_err_calloc(n_threads, sizeof(locus_worker_t));
+    for (i = 0; i < n_threads; ++i) {
+        locus_worker_t *w = L.w + i;
+        w->novel_T = read_trans_init();
+        w->a = novel_aux_init(anno_T, idx, sidx, I, w->novel_T, ugp);
+        w->a->name_uncla = 0;
+        w->t = trans_init(1); w->t->novel_exon_map = w->t->novel_sj_map = NULL;
+    }
+    kt_for(n_threads, locus_worker, &L, clu_n);
+
+    // collect novel transcripts in the order of the reads they come from
+    int tot = 0, k, unclassify = 0; char uncla[1024];
+    for (i = 0; i < n_threads; ++i) tot += L.w[i].novel_T->trans_n;
+    locus_novel_t *o = (locus_novel_t*)_err_malloc((tot > 0 ? tot : 1) * sizeof(locus_novel_t));
+    for (i = 0, k = 0; i < n_threads; ++i)
+        for (j = 0; j < L.w[i].novel_T->trans_n; ++j, ++k)
+            o[k].ord = L.w[i].ord[j], o[k].w = i, o[k].j = j;
+    if (tot > 0) qsort(o, tot, sizeof(locus_novel_t), locus_novel_comp);
+    for (k = 0; k < tot; ++k) {
+        trans_t *t = L.w[o[k].w].novel_T->t + o[k].j, *t1;
+        add_read_trans(novel_T, t);
+        t1 = novel_T->t + novel_T->trans_n - 1;
+        t1->cov = t->cov, t1->novel_gene_flag = t->novel_gene_flag;
+        if (t->novel_gene_flag) {
+            sprintf(uncla, "UNCLA_%d", unclassify++);
+            set_trans_name(t1, NULL, str_pool_put(novel_T->sp, uncla), NULL, NULL);
         }
     }
-    if (t->exon_n != 0) {
-        add_read_trans(T, *t);
-        set_trans_name(T->t+T->trans_n-1, NULL, NULL, NULL, NULL);
-        // for bam_trans
-        T->t[T->trans_n-1].novel_exon_map = (uint8_t*)calloc(t->exon_n, sizeof(uint8_t));
-        T->t[T->trans_n-1].novel_sj_map = (uint8_t*)calloc(t->exon_n-1, sizeof(uint8_t));
-        T->t[T->trans_n-1].lfull = 0, T->t[T->trans_n-1].lnoth = 1, T->t[T->trans_n-1].rfull = 0, T->t[T->trans_n-1].rnoth = 1;
-        T->t[T->trans_n-1].novel = 0, T->t[T->trans_n-1].all_novel=0, T->t[T->trans_n-1].all_iden=0;
+    free(o);
+
+    for (i = 0; i < n_threads; ++i) {
+        locus_worker_t *w = L.w + i;
+        novel_aux_destroy(w->a); read_trans_free(w->novel_T);
+        free(w->ord); free(w->name); free(w->t->novel_exon_map); free(w->t->novel_sj_map); trans_free(w->t);
     }
-    trans_free(t);
+    anno_site_destroy(sidx);
+    free(L.w); free(L.job); free(L.read); free(L.clu_off); free(L.off);
+    return 0;
+}
+
+// sweep coordinate-sorted BAM, only novel transcripts that may still absorb
+// a later read are kept in memory
+int check_novel_trans_stream(samFile *in, bam_hdr_t *h, bam1_t *b, read_trans_t *anno_T, anno_idx_t *idx, intron_group_t *I, update_gtf_para *ugp)
+{
+    read_trans_t *novel_T = read_trans_init();
+    novel_aux_t *a = novel_aux_init(anno_T, idx, NULL, I, novel_T, ugp);
+    trans_t *t = trans_init(1); int map_m = 0, last_tid = -1, last_pos = 0, ret;
+    bam_lite_t *r = bam_lite_init(in, h, "XS");
+    t->novel_exon_map = t->novel_sj_map = NULL;
+    while ((ret = bam_lite_read1(r, b)) >= 0) {
+        if (gen_trans(b, t, ugp->min_exon, ugp->min_intron) == 0) continue;
+        set_trans_name(t, NULL, NULL, NULL, bam_get_qname(b));
+        if (t->tid < last_tid || (t->tid == last_tid && t->start < last_pos))
+            err_fatal(__func__, "streaming mode needs coordinate-sorted BAM, \"%s\" is out of order.\n", bam_get_qname(b));
+        last_tid = t->tid, last_pos = t->start;
+
+        novel_trans_reset(t, &map_m);
+        novel_trans_flush(a, t->tid, t->start, h);
+        check_novel_trans_add(a, t);
+    }
+    if (ret < -1) err_fatal_simple("bam file error!\n");
+    novel_trans_flush(a, -1, 0, h);
+    err_printf("Total novel transcript: %d\n", a->x->live);
+
+    free(t->novel_exon_map); free(t->novel_sj_map); trans_free(t); bam_lite_destroy(r);
+    novel_aux_destroy(a); read_trans_free(novel_T);
+    return 0;
+}
+
+// from annotation gtf file extract transcript-exon structure
+void add_anno_trans(read_trans_t *T, trans_t *t)
+{
+    add_read_trans(T, t);
+    set_trans_name(T->t+T->trans_n-1, NULL, NULL, NULL, NULL);
+}
+
+typedef struct {
+    trans_t *t; read_trans_t *T;
+    char gid[1024], gname[1024], tname[1024], trans_id[1024];
+} anno_trans_aux_t;
+
+static void read_anno_trans_rec(const gtf_rec_t *r, int tid, void *data)
+{
+    anno_trans_aux_t *a = (anno_trans_aux_t*)data; trans_t *t = a->t;
+    if (r->type == GTF_TRANS) {
+        if (t->exon_n > 1) add_anno_trans(a->T, t);
+        t->exon_n = 0;
+    } else if (r->type == GTF_EXON) { // exon
+        add_exon(t, tid, r->start, r->end, r->is_rev);
+        gtf_attr_cpy(a->gid, sizeof(a->gid), r, GTF_GENE_ID);
+        gtf_attr_cpy(a->gname, sizeof(a->gname), r, GTF_GENE_NAME);
+        gtf_attr_cpy(a->tname, sizeof(a->tname), r, GTF_TRANS_NAME);
+        gtf_attr_cpy(a->trans_id, sizeof(a->trans_id), r, GTF_TRANS_ID);
+    }
+}
+
+int read_anno_trans_core(const char *fn, chr_name_t *cname, int add_chr, int n_threads, read_trans_t *T)
+{
+    anno_trans_aux_t a;
+    a.t = trans_init(1); a.T = T;
+    a.gid[0] = a.gname[0] = a.tname[0] = a.trans_id[0] = '\0';
+    a.t->gid = a.gid, a.t->gname = a.gname, a.t->tname = a.tname, a.t->trans_id = a.trans_id;
+    gtf_read(fn, cname, add_chr, n_threads, read_anno_trans_rec, &a);
+    if (a.t->exon_n != 0) add_anno_trans(T, a.t);
+    trans_free(a.t);
     return T->trans_n;
 }
 
+// fn: GTF file or snapshot written by index-gtf
+int read_anno_trans(const char *fn, chr_name_t *cname, int n_threads, read_trans_t *T)
+{
+    if (gtfidx_is(fn)) {
+        gtfidx_t *x = gtfidx_load(fn);
+        gtfidx_trans(x, cname, T);
+        gtfidx_close(x);
+        return T->trans_n;
+    }
+    return read_anno_trans_core(fn, cname, 0, n_threads, T);
+}
+
+// annotated transcripts, their overlap index and short-read junctions of ugp->intron_fn
+static anno_idx_t *update_gtf_load_anno(const char *anno_fn, chr_name_t *cname, update_gtf_para *ugp, read_trans_t *anno_T, intron_group_t *I, gtfidx_t **gx)
+{
+    anno_idx_t *idx; int i;
+    *gx = NULL;
+    if (gtfidx_is(anno_fn)) {
+        *gx = gtfidx_load(anno_fn);
+        gtfidx_trans(*gx, cname, anno_T);
+        idx = gtfidx_anno_idx(*gx, cname);
+    } else {
+        read_anno_trans(anno_fn, cname, ugp->n_threads, anno_T);
+        idx = anno_idx_build(anno_T);
+    }
+    // read intron files, junctions of all files are pooled
+    for (i = 0; i < ugp->intron_fn_n; ++i) {
+        FILE *fp;
+        if ((fp = fopen(ugp->intron_fn[i], "r")) == NULL) err_fatal(__func__, "Can not open intron file \"%s\"\n", ugp->intron_fn[i]);
+        read_intron_group(I, fp, cname);
+        err_fclose(fp);
+    }
+    intron_group_index(I);
+    return idx;
+}
+
+// classify read-transcripts of bam_T or P (the other one is NULL) against
+// the annotation in anno_fn and print the novel ones
+int update_gtf_core(read_trans_t *bam_T, trans_pack_t *P, bam_hdr_t *h, chr_name_t *cname, const char *anno_fn, update_gtf_para *ugp)
+{
+    read_trans_t *anno_T = read_trans_init(), *novel_T = read_trans_init();
+    intron_group_t *I = intron_group_init(); gtfidx_t *gx; int i;
+    anno_idx_t *idx = update_gtf_load_anno(anno_fn, cname, ugp, anno_T, I, &gx);
+
+    // identify novel transcript
+    if (ugp->n_threads > 1) check_novel_trans_locus(bam_T, P, anno_T, idx, I, novel_T, ugp);
+    else if (P) check_novel_trans_pack(P, anno_T, idx, I, novel_T, ugp);
+    else check_novel_trans(bam_T, anno_T, idx, I, novel_T, ugp);
+    // print novel transcript
+    for (i = 0; i < novel_T->trans_n; ++i) novel_trans_print1(novel_T->t+i, h, ugp);
+    err_printf("Total novel transcript: %d\n", novel_T->trans_n);
+
+    anno_idx_destroy(idx); gtfidx_close(gx);
+    novel_read_trans_free(anno_T); read_trans_free(novel_T); intron_group_free(I);
+    return 0;
+}
+
 const struct option update_long_opt [] = {
     { "input-mode", 1, NULL, 'm' },
     { "bam", 1, NULL, 'b' },
@@ -381,23 +905,27 @@ const struct option update_long_opt [] = {
     { "source", 1, NULL, 's' },
     { "only-bam", 0, NULL, 'n' },
     { "full-bam", 0, NULL, 'f' },
+    { "threads", 1, NULL, 't' },
+    { "stream", 0, NULL, 'S' },
+    { "sort", 0, NULL, 'O' },
 
     { 0, 0, 0, 0}
 };
 
 int update_gtf(int argc, char *argv[])
 {
-    int c; 
+    int c, sort_out = 0; char *out_fn = NULL;
     update_gtf_para *ugp = update_gtf_init_para();
-    while ((c = getopt_long(argc, argv, "m:b:i:I:e:d:l:us:no:", update_long_opt, NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "m:b:i:I:e:d:l:us:no:t:SO", update_long_opt, NULL)) >= 0) {
         switch(c)
         {
             case 'm': if (optarg[0] == 'b') ugp->input_mode=0; else if (optarg[0] == 'g') ugp->input_mode=1; else return update_gtf_usage();
             case 'b': strcpy(ugp->in_bam, optarg); break;
-            case 'I': if ((ugp->intron_fp = fopen(optarg, "r")) == NULL) {
-                          err_fatal(__func__, "Can not open intron file \"%s\"\n", optarg);
-                          return update_gtf_usage();
-                      } 
+            case 'I': if (ugp->intron_fn_n == ugp->intron_fn_m) {
+                          ugp->intron_fn_m = ugp->intron_fn_m ? ugp->intron_fn_m << 1 : 16;
+                          ugp->intron_fn = (char**)_err_realloc(ugp->intron_fn, ugp->intron_fn_m * sizeof(char*));
+                      }
+                      ugp->intron_fn[ugp->intron_fn_n++] = optarg;
                       break;
             case 'e': ugp->min_exon = atoi(optarg); break;
             case 'i': ugp->min_intron = atoi(optarg); break;
@@ -406,7 +934,10 @@ int update_gtf(int argc, char *argv[])
             case 'u': ugp->uncla = 1; break;
             case 's': strcpy(ugp->source, optarg); break;
             case 'n': ugp->only_bam = 1; break;
-            case 'o': ugp->out_gtf_fp = fopen(optarg, "w"); break;
+            case 'o': ugp->out_gtf_fp = fopen(optarg, "w"); out_fn = optarg; break;
+            case 't': ugp->n_threads = atoi(optarg); break;
+            case 'S': ugp->stream = 1; break;
+            case 'O': sort_out = 1; break;
             default:
                       err_printf("Error: unknown option: %s.\n", optarg);
                       return update_gtf_usage();
@@ -416,41 +947,43 @@ int update_gtf(int argc, char *argv[])
     if (argc - optind != 2) return update_gtf_usage();
 
     chr_name_t *cname = chr_name_init();
-    read_trans_t *anno_T, *bam_T, *novel_T; gene_group_t *gg = gene_group_init();
-    anno_T = read_trans_init(); bam_T = read_trans_init(); novel_T = read_trans_init(); 
-    intron_group_t *I; I = intron_group_init();
+    read_trans_t *bam_T = read_trans_init();
+    trans_pack_t *bam_P = trans_pack_init(); // bam input
+
+    if (ugp->stream && ugp->input_mode != 0) {
+        err_printf("[%s] Warning: streaming mode needs BAM input, all transcripts of \"%s\" are loaded.\n", __func__, argv[optind]);
+        ugp->stream = 0;
+    }
 
     // read all input-transcript
-    samFile *in; bam_hdr_t *h; 
+    samFile *in; bam_hdr_t *h; bam1_t *b = NULL;
     if (ugp->input_mode == 0) { // bam input
-        bam1_t *b;     
         if ((in = sam_open(argv[optind], "rb")) == NULL) err_fatal(__func__, "Cannot open \"%s\"\n", argv[optind]);
         if ((h = sam_hdr_read(in)) == NULL) err_fatal(__func__, "Couldn't read header for \"%s\"\n", argv[optind]);
+        bam_set_cname(h, cname);
         b = bam_init1(); 
-        read_bam_trans(in, h, b, ugp, bam_T);
-        bam_destroy1(b);
+        if (ugp->stream == 0) read_bam_trans(in, h, b, ugp, bam_P);
     } else { // gtf input
         if ((in = sam_open(ugp->in_bam, "rb")) == NULL) err_fatal(__func__, "Cannot open \"%s\"\n", ugp->in_bam);
         if ((h = sam_hdr_read(in)) == NULL) err_fatal(__func__, "Couldn't read header for \"%s\"\n", ugp->in_bam);
-        FILE *fp = xopen(argv[optind], "r");
-        read_anno_trans(fp, h, bam_T);
+        bam_set_cname(h, cname);
+        read_anno_trans(argv[optind], cname, ugp->n_threads, bam_T);
     }
 
-    FILE *gfp = xopen(argv[optind+1], "r");
-    // read all anno-transcript
-    read_anno_trans(gfp, h, anno_T);
-    // read intron file
-    read_intron_group(I, ugp->intron_fp);
+    if (sort_out) ugp->sort = gtf_sort_init(cname, GTF_SORT_MEM, ugp->n_threads, out_fn);
 
-    // identify novel transcript
-    check_novel_trans(bam_T, anno_T, I, novel_T, ugp);
-
-    // print novel transcript
-    print_read_trans(anno_T, novel_T, h, ugp->source, ugp->out_gtf_fp);
+    if (ugp->stream) { // identify and print novel transcript while reading
+        read_trans_t *anno_T = read_trans_init(); intron_group_t *I = intron_group_init(); gtfidx_t *gx;
+        anno_idx_t *idx = update_gtf_load_anno(argv[optind+1], cname, ugp, anno_T, I, &gx);
+        check_novel_trans_stream(in, h, b, anno_T, idx, I, ugp);
+        anno_idx_destroy(idx); gtfidx_close(gx);
+        novel_read_trans_free(anno_T); intron_group_free(I);
+    } else update_gtf_core(ugp->input_mode == 0 ? NULL : bam_T, ugp->input_mode == 0 ? bam_P : NULL, h, cname, argv[optind+1], ugp);
+    if (ugp->sort) gtf_sort_write(ugp->sort, ugp->out_gtf_fp), gtf_sort_destroy(ugp->sort);
+    if (b) bam_destroy1(b);
 
     chr_name_free(cname);
-    novel_read_trans_free(bam_T); novel_read_trans_free(anno_T); 
-    read_trans_free(novel_T); intron_group_free(I); gene_group_free(gg);
-    bam_hdr_destroy(h); sam_close(in); err_fclose(ugp->out_gtf_fp); if (ugp->intron_fp) err_fclose(ugp->intron_fp);
+    trans_pack_destroy(bam_P); novel_read_trans_free(bam_T);
+    bam_hdr_destroy(h); sam_close(in); err_fclose(ugp->out_gtf_fp); free(ugp->intron_fn);
     return 0;
 }
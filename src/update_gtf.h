@@ -1,5 +1,10 @@
 #ifndef _UPDATE_GTF_H
 #define _UPDATE_GTF_H
+#include "htslib/sam.h"
+#include "bam2gtf.h"
+
+update_gtf_para *update_gtf_init_para(void);
+int update_gtf_core(read_trans_t *bam_T, trans_pack_t *P, bam_hdr_t *h, chr_name_t *cname, const char *anno_fn, update_gtf_para *ugp);
 
 int update_gtf(int argc, char *argv[]);
 